@@ -0,0 +1,722 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xcp-ng/async-io.h"
+
+// =============================================================================
+
+#define MAX_SWEEP_VALUES 32
+
+#define DEFAULT_RUNTIME 5.0
+#define DEFAULT_READ_MIX 50
+
+// Size of the writes used to lay out the file before the runs.
+#define LAYOUT_BLOCK_SIZE (1024 * 1024)
+
+// -----------------------------------------------------------------------------
+
+typedef enum {
+  BenchWorkloadRead,
+  BenchWorkloadWrite,
+  BenchWorkloadRandRead,
+  BenchWorkloadRandWrite,
+  BenchWorkloadReadWrite,
+  BenchWorkloadRandReadWrite,
+  BenchWorkloadCount
+} BenchWorkload;
+
+static const char *WorkloadNames[BenchWorkloadCount] = {
+  "read", "write", "randread", "randwrite", "rw", "randrw"
+};
+
+typedef enum {
+  BenchModeWait,
+  BenchModeEventFd,
+  BenchModeHybridPolling,
+  BenchModePolling,
+  BenchModeSqPolling,
+  BenchModeCount
+} BenchMode;
+
+static const char *ModeNames[BenchModeCount] = {
+  "wait", "event-fd", "hybrid-polling", "polling", "sq-polling"
+};
+
+static inline bool workload_is_random (BenchWorkload workload) {
+  return workload == BenchWorkloadRandRead || workload == BenchWorkloadRandWrite ||
+    workload == BenchWorkloadRandReadWrite;
+}
+
+static inline bool workload_has_writes (BenchWorkload workload) {
+  return workload != BenchWorkloadRead && workload != BenchWorkloadRandRead;
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  const char *path;
+  off_t size;
+  double runtime;
+  unsigned int readMix; // Percentage of reads in the mixed workloads.
+  int sqThreadCpu;
+  int flags; // Open flags.
+  uint64_t seed;
+
+  unsigned int workloads[MAX_SWEEP_VALUES];
+  size_t workloadCount;
+
+  unsigned int modes[MAX_SWEEP_VALUES];
+  size_t modeCount;
+
+  size_t queueDepths[MAX_SWEEP_VALUES];
+  size_t queueDepthCount;
+
+  size_t blockSizes[MAX_SWEEP_VALUES];
+  size_t blockSizeCount;
+} BenchOptions;
+
+typedef struct {
+  uint64_t ios;
+  uint64_t errors;
+  uint64_t bytes;
+  XcpIoHistogram latency; // In nanoseconds.
+} BenchDirStats;
+
+typedef struct {
+  XcpIoQueue *queue;
+  XcpIoReqPool *reqPool;
+  int fd;
+  size_t blockSize;
+  uint64_t blockCount;
+  BenchWorkload workload;
+  unsigned int readMix;
+
+  uint64_t rngState;
+  uint64_t nextBlock; // Sequential workloads only.
+
+  // Insertion time of each request, indexed by pool index.
+  uint64_t *startTimes;
+
+  BenchDirStats reads;
+  BenchDirStats writes;
+
+  // The run is stopped at the first I/O error.
+  int firstError;
+} BenchJob;
+
+// -----------------------------------------------------------------------------
+
+static inline uint64_t get_time_ns (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*, good enough to pick offsets.
+static inline uint64_t get_random (uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * UINT64_C(2685821657736338717);
+}
+
+static inline int get_file_size (int fd, off_t *size) {
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return -1;
+
+  if (S_ISREG(st.st_mode)) {
+    *size = st.st_size;
+    return 0;
+  }
+  if (S_ISBLK(st.st_mode))
+    return ioctl(fd, BLKGETSIZE64, size) ? -1 : 0;
+
+  return -1;
+}
+
+// Parse a size with an optional k, m or g suffix (powers of 1024).
+static int parse_size (const char *str, uint64_t *size) {
+  char *end;
+  errno = 0;
+  uint64_t value = strtoull(str, &end, 10);
+  if (errno || end == str)
+    return -1;
+
+  unsigned int shift = 0;
+  switch (*end) {
+    case 'k': case 'K': shift = 10; ++end; break;
+    case 'm': case 'M': shift = 20; ++end; break;
+    case 'g': case 'G': shift = 30; ++end; break;
+    default: break;
+  }
+  if (*end || value > (UINT64_MAX >> shift))
+    return -1;
+
+  *size = value << shift;
+  return 0;
+}
+
+// Parse a comma separated list of names, each name is converted to its index in names.
+static int parse_name_list (
+  const char *str, const char **names, unsigned int nameCount, unsigned int *values, size_t *count
+) {
+  *count = 0;
+  for (const char *name = str; *name; ) {
+    const size_t len = strcspn(name, ",");
+    unsigned int i = 0;
+    while (i < nameCount && (strlen(names[i]) != len || strncmp(names[i], name, len)))
+      ++i;
+    if (i == nameCount || *count == MAX_SWEEP_VALUES)
+      return -1;
+
+    values[(*count)++] = i;
+    name += len;
+    if (*name == ',')
+      ++name;
+  }
+  return *count ? 0 : -1;
+}
+
+static int parse_size_list (const char *str, size_t *values, size_t *count) {
+  char buf[64];
+  *count = 0;
+  for (const char *value = str; *value; ) {
+    const size_t len = strcspn(value, ",");
+    if (len >= sizeof buf || *count == MAX_SWEEP_VALUES)
+      return -1;
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+
+    uint64_t size;
+    if (parse_size(buf, &size) || !size || size > SIZE_MAX)
+      return -1;
+
+    values[(*count)++] = (size_t)size;
+    value += len;
+    if (*value == ',')
+      ++value;
+  }
+  return *count ? 0 : -1;
+}
+
+// -----------------------------------------------------------------------------
+
+// Write the missing part of a regular file, so the reads are not served from holes.
+// A block device can't be truncated and has no holes: it's only checked to be large enough.
+static int layout_file (int fd, off_t size) {
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return -errno;
+
+  off_t offset;
+  if (get_file_size(fd, &offset))
+    return -EINVAL;
+  if (offset >= size)
+    return 0;
+  if (S_ISBLK(st.st_mode))
+    return -ENOSPC;
+
+  void *buf;
+  if (posix_memalign(&buf, XCP_IO_REQ_POOL_DATA_ALIGNMENT, LAYOUT_BLOCK_SIZE))
+    return -ENOMEM;
+
+  uint64_t rngState = UINT64_C(0x9e3779b97f4a7c15);
+  for (size_t i = 0; i < LAYOUT_BLOCK_SIZE / sizeof(uint64_t); ++i)
+    ((uint64_t *)buf)[i] = get_random(&rngState);
+
+  // Keep the writes aligned for O_DIRECT.
+  offset &= ~(off_t)(XCP_IO_REQ_POOL_DATA_ALIGNMENT - 1);
+
+  int ret = 0;
+  while (offset < size) {
+    const ssize_t written = pwrite(fd, buf, LAYOUT_BLOCK_SIZE, offset);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      ret = -errno;
+      break;
+    }
+    offset += written;
+  }
+  free(buf);
+
+  if (!ret && ftruncate(fd, size) < 0)
+    ret = -errno;
+  return ret ? ret : (fsync(fd) < 0 ? -errno : 0);
+}
+
+// Write a string in a JSON document, with the quotes.
+static void print_json_string (FILE *out, const char *str) {
+  fputc('"', out);
+  for (; *str; ++str) {
+    const unsigned char c = (unsigned char)*str;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+// -----------------------------------------------------------------------------
+
+static void completion_cb (XcpIoReq *req, int err, void *userArg) {
+  BenchJob *job = userArg;
+  const size_t index = xcp_io_req_pool_get_index(job->reqPool, req);
+
+  BenchDirStats *stats = req->opcode == XcpIoOpcodeRead ? &job->reads : &job->writes;
+  ++stats->ios;
+  if (err) {
+    ++stats->errors;
+    if (!job->firstError)
+      job->firstError = err;
+  } else
+    stats->bytes += job->blockSize;
+  xcp_io_histogram_record(&stats->latency, get_time_ns() - job->startTimes[index]);
+
+  xcp_io_req_pool_put(job->reqPool, req);
+}
+
+static void queue_io (BenchJob *job) {
+  XcpIoReq *req = xcp_io_req_pool_get(job->reqPool);
+  assert(req); // Request count is equal to the queue depth.
+
+  uint64_t block;
+  if (workload_is_random(job->workload))
+    block = get_random(&job->rngState) % job->blockCount;
+  else {
+    block = job->nextBlock;
+    if (++job->nextBlock == job->blockCount)
+      job->nextBlock = 0;
+  }
+
+  bool isRead;
+  switch (job->workload) {
+    case BenchWorkloadRead:
+    case BenchWorkloadRandRead:
+      isRead = true;
+      break;
+    case BenchWorkloadWrite:
+    case BenchWorkloadRandWrite:
+      isRead = false;
+      break;
+    default:
+      isRead = get_random(&job->rngState) % 100 < job->readMix;
+  }
+
+  xcp_io_req_prep_rw(
+    req, isRead ? XcpIoOpcodeRead : XcpIoOpcodeWrite, job->fd, xcp_io_req_pool_get_data(job->reqPool, req),
+    job->blockSize, (off_t)(block * job->blockSize)
+  );
+  xcp_io_req_set_cb(req, completion_cb);
+  xcp_io_req_set_user_data(req, job);
+
+  job->startTimes[xcp_io_req_pool_get_index(job->reqPool, req)] = get_time_ns();
+  const int ret = xcp_io_queue_insert(job->queue, req);
+  if (ret < 0)
+    completion_cb(req, ret, job);
+}
+
+static int run_job (BenchJob *job, size_t queueDepth, double runtime, uint64_t *duration) {
+  const uint64_t start = get_time_ns();
+  const uint64_t deadline = start + (uint64_t)(runtime * 1e9);
+
+  int ret = 0;
+  uint64_t now = start;
+  while (now < deadline || !xcp_io_queue_is_empty(job->queue)) {
+    // The queue is refilled to keep queueDepth requests in flight until the deadline, then drained.
+    if (now < deadline && !job->firstError) {
+      size_t count = xcp_io_queue_get_inflight_count(job->queue) + xcp_io_queue_get_pending_count(job->queue);
+      for (; count < queueDepth && !job->firstError; ++count)
+        queue_io(job);
+    }
+
+    if ((ret = xcp_io_queue_process(job->queue)) < 0) {
+      xcp_io_queue_cancel(job->queue);
+      break;
+    }
+    now = get_time_ns();
+  }
+
+  *duration = get_time_ns() - start;
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+
+static void print_dir_stats (FILE *out, const char *name, const BenchDirStats *stats, uint64_t duration) {
+  const double seconds = (double)duration / 1e9;
+  fprintf(
+    out,
+    "\"%s\": {\"ios\": %llu, \"errors\": %llu, \"bytes\": %llu, \"iops\": %.1f, \"bandwidth\": %.1f, "
+    "\"latency_ns\": {\"mean\": %llu, \"p50\": %llu, \"p99\": %llu, \"p99.9\": %llu}}",
+    name,
+    (unsigned long long)stats->ios,
+    (unsigned long long)stats->errors,
+    (unsigned long long)stats->bytes,
+    (double)stats->ios / seconds,
+    (double)stats->bytes / seconds,
+    (unsigned long long)xcp_io_histogram_get_mean(&stats->latency),
+    (unsigned long long)xcp_io_histogram_get_percentile(&stats->latency, 50),
+    (unsigned long long)xcp_io_histogram_get_percentile(&stats->latency, 99),
+    (unsigned long long)xcp_io_histogram_get_percentile(&stats->latency, 99.9)
+  );
+}
+
+static void print_result (
+  FILE *out, const BenchOptions *options, BenchWorkload workload, BenchMode mode, size_t queueDepth, size_t blockSize,
+  const BenchJob *job, uint64_t duration, int err
+) {
+  fprintf(
+    out,
+    "    {\"workload\": \"%s\", \"mode\": \"%s\", \"queue_depth\": %zu, \"block_size\": %zu, ",
+    WorkloadNames[workload], ModeNames[mode], queueDepth, blockSize
+  );
+  if (workload == BenchWorkloadReadWrite || workload == BenchWorkloadRandReadWrite)
+    fprintf(out, "\"read_mix\": %u, ", options->readMix);
+
+  if (err) {
+    fprintf(out, "\"error\": \"%s\"}", strerror(-err));
+    return;
+  }
+
+  BenchDirStats total = job->reads;
+  total.ios += job->writes.ios;
+  total.errors += job->writes.errors;
+  total.bytes += job->writes.bytes;
+  xcp_io_histogram_merge(&total.latency, &job->writes.latency);
+
+  fprintf(out, "\"runtime\": %.3f, ", (double)duration / 1e9);
+  print_dir_stats(out, "total", &total, duration);
+  fputs(", ", out);
+  print_dir_stats(out, "read", &job->reads, duration);
+  fputs(", ", out);
+  print_dir_stats(out, "write", &job->writes, duration);
+  fputc('}', out);
+}
+
+// -----------------------------------------------------------------------------
+
+static int init_queue (XcpIoQueue *queue, BenchMode mode, size_t queueDepth, const BenchOptions *options) {
+  XcpIoQueueOptions queueOptions;
+  xcp_io_queue_options_init(&queueOptions, queueDepth);
+  queueOptions.sqThreadCpu = options->sqThreadCpu;
+
+  switch (mode) {
+    case BenchModeWait:
+      queueOptions.flags |= XcpIoQueueFlagNoEventFd;
+      break;
+    case BenchModeEventFd:
+      break;
+    case BenchModeHybridPolling:
+      queueOptions.flags |= XcpIoQueueFlagNoEventFd | XcpIoQueueFlagHybridPoll;
+      break;
+    case BenchModePolling:
+      queueOptions.flags |= XcpIoQueueFlagNoEventFd | XcpIoQueueFlagIoPoll;
+      break;
+    case BenchModeSqPolling:
+      queueOptions.flags |= XcpIoQueueFlagNoEventFd | XcpIoQueueFlagSqPoll;
+      break;
+    case BenchModeCount:
+      assert(false);
+  }
+
+  return xcp_io_queue_init_with_options(queue, &queueOptions);
+}
+
+static int bench (
+  FILE *out, int fd, const BenchOptions *options, BenchWorkload workload, BenchMode mode, size_t queueDepth,
+  size_t blockSize, bool *first
+) {
+  XcpIoQueue queue;
+  XcpIoReqPool reqPool;
+  uint64_t duration = 0;
+
+  BenchJob *job = calloc(1, sizeof *job);
+  if (!job)
+    return -ENOMEM;
+
+  int ret;
+  if ((ret = init_queue(&queue, mode, queueDepth, options)) < 0)
+    goto end;
+
+  if ((ret = xcp_io_req_pool_init(&reqPool, queueDepth, blockSize, 0)) < 0)
+    goto uninitQueue;
+
+  if (!(job->startTimes = calloc(queueDepth, sizeof *job->startTimes))) {
+    ret = -ENOMEM;
+    goto uninitPool;
+  }
+
+  job->queue = &queue;
+  job->reqPool = &reqPool;
+  job->fd = fd;
+  job->blockSize = blockSize;
+  job->blockCount = (uint64_t)options->size / blockSize;
+  job->workload = workload;
+  job->readMix = options->readMix;
+  job->rngState = options->seed ? options->seed : 1;
+
+  fprintf(
+    stderr, "Running %s, mode %s, queue depth %zu, block size %zu...\n",
+    WorkloadNames[workload], ModeNames[mode], queueDepth, blockSize
+  );
+  if (!(ret = run_job(job, queueDepth, options->runtime, &duration)))
+    ret = job->firstError;
+
+  free(job->startTimes);
+
+uninitPool:
+  xcp_io_req_pool_uninit(&reqPool);
+
+uninitQueue:
+  xcp_io_queue_uninit(&queue);
+
+end:
+  // An unsupported combination (e.g. polling without O_DIRECT) is reported and the sweep continues.
+  if (ret < 0)
+    fprintf(stderr, "  Failed: %s\n", strerror(-ret));
+
+  fputs(*first ? "\n" : ",\n", out);
+  *first = false;
+  print_result(out, options, workload, mode, queueDepth, blockSize, job, duration, ret);
+
+  free(job);
+  return ret == -ENOMEM ? ret : 0;
+}
+
+// -----------------------------------------------------------------------------
+
+static void usage (const char *progname) {
+  printf("Usage: %s [OPTIONS]\n", progname);
+  puts("  --file                   file or block device to use");
+  puts("  --size                   size of the tested area, the file is written to this size if needed");
+  puts("  --workloads              read,write,randread,randwrite,rw,randrw (default: randread)");
+  puts("  --modes                  wait,event-fd,hybrid-polling,polling,sq-polling (default: wait)");
+  puts("  --queue-depths           list of queue depths (default: 1,4,16,64)");
+  puts("  --block-sizes            list of block sizes, k/m/g suffixes allowed (default: 4k,64k)");
+  puts("  --read-mix               percentage of reads in rw and randrw workloads (default: 50)");
+  puts("  --runtime                duration of each run in seconds (default: 5)");
+  puts("  --o-direct               open the file with O_DIRECT");
+  puts("  --sq-cpu                 pin the submission thread on this CPU");
+  puts("  --seed                   seed of the random offsets");
+  puts("  --output                 write the JSON report in this file instead of stdout");
+  puts("  --help                   print this help and exit");
+}
+
+// -----------------------------------------------------------------------------
+
+int main (int argc, char *argv[]) {
+  const struct option longopts[] = {
+    { "file", 1, NULL, 'f' },
+    { "size", 1, NULL, 'z' },
+    { "workloads", 1, NULL, 'w' },
+    { "modes", 1, NULL, 'm' },
+    { "queue-depths", 1, NULL, 'q' },
+    { "block-sizes", 1, NULL, 'b' },
+    { "read-mix", 1, NULL, 'x' },
+    { "runtime", 1, NULL, 't' },
+    { "o-direct", 0, NULL, 'd' },
+    { "sq-cpu", 1, NULL, 'c' },
+    { "seed", 1, NULL, 's' },
+    { "output", 1, NULL, 'o' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, 0, 0 }
+  };
+
+  BenchOptions options;
+  memset(&options, 0, sizeof options);
+  options.runtime = DEFAULT_RUNTIME;
+  options.readMix = DEFAULT_READ_MIX;
+  options.sqThreadCpu = -1;
+  options.seed = (uint64_t)time(NULL);
+
+  const char *outPath = NULL;
+  const char *workloads = "randread";
+  const char *modes = "wait";
+  const char *queueDepths = "1,4,16,64";
+  const char *blockSizes = "4k,64k";
+  uint64_t size = 0;
+
+  int option;
+  int longindex = 0;
+  while ((option = getopt_long_only(argc, argv, "", longopts, &longindex)) != -1) {
+    switch (option) {
+      case 'f':
+        options.path = optarg;
+        break;
+      case 'z':
+        if (parse_size(optarg, &size) || size > INT64_MAX) {
+          fprintf(stderr, "Invalid size: `%s`.\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'w':
+        workloads = optarg;
+        break;
+      case 'm':
+        modes = optarg;
+        break;
+      case 'q':
+        queueDepths = optarg;
+        break;
+      case 'b':
+        blockSizes = optarg;
+        break;
+      case 'x':
+        options.readMix = (unsigned int)atoi(optarg);
+        break;
+      case 't':
+        options.runtime = atof(optarg);
+        break;
+      case 'd':
+        options.flags |= O_DIRECT;
+        break;
+      case 'c':
+        options.sqThreadCpu = atoi(optarg);
+        break;
+      case 's':
+        options.seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'o':
+        outPath = optarg;
+        break;
+      case 'h':
+        usage(argv[0]);
+        return EXIT_SUCCESS;
+      case '?':
+        if (optopt == 0)
+          fprintf(stderr, "Unknown option: `%s`.\n", argv[optind - 1]);
+        else
+          fprintf(stderr, "Error parsing option: `-%c`\n", optopt);
+        fprintf(stderr, "Try `%s --help` for more information.\n", *argv);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (!options.path) {
+    fprintf(stderr, "file is not set!\n");
+    return EXIT_FAILURE;
+  }
+
+  if (
+    parse_name_list(workloads, WorkloadNames, BenchWorkloadCount, options.workloads, &options.workloadCount) ||
+    parse_name_list(modes, ModeNames, BenchModeCount, options.modes, &options.modeCount) ||
+    parse_size_list(queueDepths, options.queueDepths, &options.queueDepthCount) ||
+    parse_size_list(blockSizes, options.blockSizes, &options.blockSizeCount)
+  ) {
+    fprintf(stderr, "Invalid workload, mode, queue depth or block size list.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (options.readMix > 100 || options.runtime <= 0.0) {
+    fprintf(stderr, "Invalid read mix or runtime.\n");
+    return EXIT_FAILURE;
+  }
+
+  bool hasWrites = false;
+  for (size_t i = 0; i < options.workloadCount; ++i)
+    hasWrites |= workload_has_writes(options.workloads[i]);
+
+  const int fd = open(options.path, options.flags | (hasWrites || size ? O_RDWR | O_CREAT : O_RDONLY), 0644);
+  if (fd < 0) {
+    perror("Failed to open file");
+    return EXIT_FAILURE;
+  }
+
+  int ret;
+  if (size) {
+    fprintf(stderr, "Laying out %s...\n", options.path);
+    if ((ret = layout_file(fd, (off_t)size)) < 0) {
+      fprintf(stderr, "Failed to lay out file: %s\n", strerror(-ret));
+      close(fd);
+      return EXIT_FAILURE;
+    }
+    options.size = (off_t)size;
+  } else if (get_file_size(fd, &options.size) || !options.size) {
+    fprintf(stderr, "Unable to get size of file, use --size.\n");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  // Results of builds with and without ENABLE_STATS should not be compared.
+  #ifdef XCP_IO_ENABLE_STATS
+    const bool hasStats = true;
+  #else
+    const bool hasStats = false;
+  #endif // ifdef XCP_IO_ENABLE_STATS
+
+  FILE *out = outPath ? fopen(outPath, "w") : stdout;
+  if (!out) {
+    perror("Failed to open output file");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  fputs("{\n  \"file\": ", out);
+  print_json_string(out, options.path);
+  fprintf(
+    out,
+    ",\n  \"size\": %lld,\n  \"runtime\": %.3f,\n  \"o_direct\": %s,\n  \"stats\": %s,\n  \"results\": [",
+    (long long)options.size,
+    options.runtime,
+    options.flags & O_DIRECT ? "true" : "false",
+    hasStats ? "true" : "false"
+  );
+
+  // Sweep all combinations, the block size is the innermost loop.
+  ret = 0;
+  bool first = true;
+  for (size_t w = 0; !ret && w < options.workloadCount; ++w)
+    for (size_t m = 0; !ret && m < options.modeCount; ++m)
+      for (size_t q = 0; !ret && q < options.queueDepthCount; ++q)
+        for (size_t b = 0; !ret && b < options.blockSizeCount; ++b) {
+          if (options.blockSizes[b] > (size_t)options.size) {
+            fprintf(stderr, "Block size %zu is greater than the file size, skipped.\n", options.blockSizes[b]);
+            continue;
+          }
+          ret = bench(
+            out, fd, &options, options.workloads[w], options.modes[m], options.queueDepths[q], options.blockSizes[b],
+            &first
+          );
+        }
+
+  fputs("\n  ]\n}\n", out);
+
+  if (outPath)
+    fclose(out);
+  close(fd);
+
+  return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -19,12 +19,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <poll.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "xcp-ng/async-io.h"
@@ -32,9 +33,10 @@
 // =============================================================================
 
 #define QUEUE_CAPACITY 64
-#define QUEUE_BLOCK_SIZE 32 * 1024
+#define QUEUE_BLOCK_SIZE (32 * 1024)
 
-#define REQ_ALIGNMENT 512
+// All the requests of the copy use the same tenant: the rate limits apply to the reads and writes together.
+#define COPY_TENANT 1
 
 // -----------------------------------------------------------------------------
 
@@ -55,116 +57,165 @@ static inline int get_file_size (int fd, off_t *size) {
 
 // -----------------------------------------------------------------------------
 
-typedef struct {
-  XcpIoQueue *queue;
-  int out;
-  int flags;
-} WriteContext;
-
-static void write_completion_cb (XcpIoReq *req, int err, void *userArg) {
-  XCP_UNUSED(userArg);
-
-  if (err)
-    fprintf(stderr, "Write error: %s\n", strerror(-err));
-  free(req);
+// Manifest file: a "<checksum> <block size> <size> <digest>" line, then the hash of each block in hex.
+static int write_manifest (const char *path, const XcpIoChecksumManifest *manifest) {
+  FILE *file = fopen(path, "w");
+  if (!file)
+    return -errno;
+
+  fprintf(
+    file, "%s %zu %llu %016llx\n",
+    xcp_io_checksum_to_str(manifest->checksum),
+    manifest->blockSize,
+    (unsigned long long)manifest->size,
+    (unsigned long long)xcp_io_checksum_manifest_get_digest(manifest)
+  );
+  for (size_t i = 0; i < manifest->blockCount; ++i)
+    fprintf(file, "%016llx\n", (unsigned long long)manifest->hashes[i]);
+
+  const int ret = ferror(file) ? -EIO : 0;
+  return fclose(file) && !ret ? -errno : ret;
 }
 
-static void read_completion_cb (XcpIoReq *req, int err, void *userArg) {
-  if (err) {
-    fprintf(stderr, "Read error: %s\n", strerror(-err));
-    free(req);
-    return;
+static int read_manifest (const char *path, XcpIoChecksumManifest *manifest) {
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return -errno;
+
+  char checksum[16];
+  size_t blockSize;
+  unsigned long long size, digest;
+  int ret = -EINVAL;
+  if (fscanf(file, "%15s %zu %llu %llx", checksum, &blockSize, &size, &digest) != 4)
+    goto end;
+
+  if (!strcmp(checksum, xcp_io_checksum_to_str(XcpIoChecksumCrc32c)))
+    xcp_io_checksum_manifest_init(manifest, XcpIoChecksumCrc32c, blockSize);
+  else if (!strcmp(checksum, xcp_io_checksum_to_str(XcpIoChecksumXxh3)))
+    xcp_io_checksum_manifest_init(manifest, XcpIoChecksumXxh3, blockSize);
+  else
+    goto end;
+
+  if ((ret = xcp_io_checksum_manifest_set_size(manifest, size)) < 0)
+    goto end;
+
+  for (size_t i = 0; i < manifest->blockCount; ++i) {
+    unsigned long long hash;
+    if (fscanf(file, "%llx", &hash) != 1) {
+      ret = -EINVAL;
+      goto end;
+    }
+    manifest->hashes[i] = hash;
   }
+  ret = xcp_io_checksum_manifest_get_digest(manifest) == digest ? 0 : -EBADMSG;
 
-  const WriteContext *writeContext = userArg;
-  const size_t blockSize = xcp_io_req_get_size(req);
-  const off_t offset = xcp_io_req_get_offset(req);
-
-  void *buf = (char *)req + (writeContext->flags & O_DIRECT ? REQ_ALIGNMENT : sizeof *req);
-  xcp_io_req_prep_rw(req, XcpIoOpcodeWrite, writeContext->out, buf, blockSize, offset);
-  xcp_io_req_set_cb(req, write_completion_cb);
-  xcp_io_req_set_user_data(req, NULL);
-  xcp_io_queue_insert(writeContext->queue, req);
-}
-
-static int queue_read (XcpIoQueue *queue, int in, size_t blockSize, off_t offset, WriteContext *writeContext) {
-  XcpIoReq *req = NULL;
-
-  if (writeContext->flags & O_DIRECT) {
-    static_assert(sizeof(XcpIoReq) <= REQ_ALIGNMENT, "");
-    const int ret = posix_memalign((void **)&req, REQ_ALIGNMENT, REQ_ALIGNMENT + blockSize);
-    if (ret < 0)
-      return ret;
-  } else if (!(req = malloc(sizeof *req + blockSize)))
-    return -ENOMEM;
-
-  void *buf = (char *)req + (writeContext->flags & O_DIRECT ? REQ_ALIGNMENT : sizeof *req);
-  xcp_io_req_prep_rw(req, XcpIoOpcodeRead, in, buf, blockSize, offset);
-  xcp_io_req_set_cb(req, read_completion_cb);
-  xcp_io_req_set_user_data(req, writeContext);
-  xcp_io_queue_insert(queue, req);
-  return 0;
+end:
+  if (ret < 0)
+    xcp_io_checksum_manifest_uninit(manifest);
+  fclose(file);
+  return ret;
 }
 
-// -----------------------------------------------------------------------------
+// Print the first blocks that differ, returns false if the manifests are not equal.
+static bool compare_manifests (const XcpIoChecksumManifest *expected, const XcpIoChecksumManifest *manifest) {
+  if (expected->size != manifest->size) {
+    fprintf(
+      stderr, "Size mismatch: %llu bytes expected, %llu read\n",
+      (unsigned long long)expected->size, (unsigned long long)manifest->size
+    );
+    return false;
+  }
 
-static inline int queue_submit (XcpIoQueue *queue) {
-  int ret;
-  if ((ret = xcp_io_queue_submit(queue)) < 0)
-    fprintf(stderr, "Failed to submit reqs: %s\n", strerror(-ret));
-  return ret;
+  size_t mismatchCount = 0;
+  for (size_t i = 0; i < manifest->blockCount; ++i) {
+    if (expected->hashes[i] == manifest->hashes[i])
+      continue;
+    if (++mismatchCount <= 10)
+      fprintf(stderr, "Block mismatch at offset %llu\n", (unsigned long long)i * manifest->blockSize);
+  }
+  if (mismatchCount > 10)
+    fprintf(stderr, "%zu mismatched blocks\n", mismatchCount);
+  return !mismatchCount;
 }
 
 // -----------------------------------------------------------------------------
 
-static int copy (XcpIoQueue *queue, int in, int out, off_t inSize, int flags) {
-  off_t offset = 0;
+// Print the progress each time it changes by 0.1%.
+static void progress_cb (const XcpIoCopyProgress *progress, void *userArg) {
+  unsigned int *lastPermille = userArg;
 
-  WriteContext writeContext = { queue, out, flags };
-  while (inSize || !xcp_io_queue_is_empty(queue)) {
-    // 1. Read from in.
-    while (inSize && !xcp_io_queue_is_full(queue)) {
-      off_t blockSize = inSize;
-      if (blockSize > QUEUE_BLOCK_SIZE)
-        blockSize = QUEUE_BLOCK_SIZE;
+  const uint64_t done = progress->copiedBytes + progress->skippedBytes;
+  const unsigned int permille = progress->size ? (unsigned int)(done * 1000 / progress->size) : 1000;
+  if (permille == *lastPermille)
+    return;
 
-      int ret;
-      if ((ret = queue_read(queue, in, (size_t)blockSize, offset, &writeContext)))
-        return ret;
+  *lastPermille = permille;
+  fprintf(stderr, "\r%5.1f%%", (double)permille / 10);
+}
 
-      inSize -= blockSize;
-      offset += blockSize;
-    }
+// -----------------------------------------------------------------------------
 
-    int ret;
-    if ((ret = queue_submit(queue)) < 0)
-      return ret;
-
-    // 2. Write to out.
-    if (!xcp_io_queue_polling_enabled(queue)) {
-      struct pollfd fds;
-      fds.events = POLLIN;
-      fds.fd = xcp_io_queue_get_event_fd(queue);
-      fds.revents = 0;
-
-      do {
-        ret = poll(&fds, 1, 0);
-      } while (ret == -1 && errno == EINTR);
-      if (!ret)
+static void print_stats (
+  const XcpIoQueue *queue, const XcpIoCopyProgress *progress, const struct timespec *start, const struct timespec *end
+) {
+  const double duration = (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+  const double size = (double)progress->copiedBytes;
+  const double blockCount = (double)((progress->copiedBytes + QUEUE_BLOCK_SIZE - 1) / QUEUE_BLOCK_SIZE);
+
+  // Each block is read and written, the holes are skipped.
+  printf("Copied %llu bytes in %.3f s\n", (unsigned long long)progress->copiedBytes, duration);
+  if (progress->offloadedBytes)
+    printf("  Offloaded to the kernel: %llu bytes\n", (unsigned long long)progress->offloadedBytes);
+  if (progress->skippedBytes)
+    printf("  Skipped holes: %llu bytes\n", (unsigned long long)progress->skippedBytes);
+  if (progress->zeroBytes)
+    printf("  Blocks of zeros: %llu bytes\n", (unsigned long long)progress->zeroBytes);
+  printf("  Throughput: %.2f MiB/s\n", size / (1024 * 1024) / duration);
+  printf("  IOPS: %.0f\n", 2 * blockCount / duration);
+  printf("  Avg time per I/O: %.3f us\n", duration * 1e6 / (2 * blockCount));
+
+  const XcpIoQueueCounters *counters = xcp_io_queue_get_counters(queue);
+  if (counters->shortTransfers)
+    printf("  Short transfers: %llu\n", (unsigned long long)counters->shortTransfers);
+  if (counters->merges)
+    printf(
+      "  Merges: %llu (%llu requests)\n",
+      (unsigned long long)counters->merges,
+      (unsigned long long)counters->mergedRequests
+    );
+  if (counters->throttledRequests)
+    printf("  Throttled requests: %llu\n", (unsigned long long)counters->throttledRequests);
+
+  // Available only if the library is built with ENABLE_STATS.
+  XcpIoQueueStats *stats = malloc(sizeof *stats);
+  if (stats && !xcp_io_queue_get_stats(queue, stats)) {
+    for (unsigned int i = 0; i < XCP_IO_OPCODE_COUNT; ++i) {
+      const XcpIoOpStats *opStats = &stats->ops[i];
+      if (!opStats->count)
         continue;
-      if (ret < 0)
-        return -errno;
+      printf(
+        "  %s: %llu requests, queue time p50 %.1f us, service time p50/p99/p99.9 %.1f/%.1f/%.1f us\n",
+        xcp_io_opcode_to_str((XcpIoOpcode)(1u << i)),
+        (unsigned long long)opStats->count,
+        (double)xcp_io_histogram_get_percentile(&opStats->queueTime, 50) / 1e3,
+        (double)xcp_io_histogram_get_percentile(&opStats->serviceTime, 50) / 1e3,
+        (double)xcp_io_histogram_get_percentile(&opStats->serviceTime, 99) / 1e3,
+        (double)xcp_io_histogram_get_percentile(&opStats->serviceTime, 99.9) / 1e3
+      );
     }
-
-    if ((ret = xcp_io_queue_process_responses(queue)) < 0)
-      return ret;
+    printf("  Avg batch size: %llu\n", (unsigned long long)xcp_io_histogram_get_mean(&stats->batchSizes));
+  }
+  free(stats);
+
+  if (xcp_io_queue_hybrid_polling_enabled(queue)) {
+    const uint64_t waitCount = counters->spinHits + counters->spinMisses;
+    printf(
+      "  Spin hits: %llu/%llu (%.1f%%)\n",
+      (unsigned long long)counters->spinHits,
+      (unsigned long long)waitCount,
+      waitCount ? 100.0 * (double)counters->spinHits / (double)waitCount : 0.0
+    );
   }
-
-  assert(xcp_io_queue_get_inflight_count(queue) == 0);
-  assert(xcp_io_queue_get_pending_count(queue) == 0);
-  assert(xcp_io_queue_is_empty(queue));
-
-  return 0;
 }
 
 // -----------------------------------------------------------------------------
@@ -174,6 +225,29 @@ static void usage (const char *progname) {
   puts("  --int                    input file");
   puts("  --out                    output file");
   puts("  --polling                use polling");
+  puts("  --hybrid-polling         spin on the completion ring before sleeping");
+  puts("  --sq-polling             use a kernel thread to poll submissions");
+  puts("  --sq-cpu                 pin the submission thread on this CPU");
+  puts("  --o-direct               open files with O_DIRECT");
+  puts("  --event-fd               wait responses with poll on the event fd");
+  puts("  --fixed-buffers          use registered buffers");
+  puts("  --fixed-files            use registered files");
+  puts("  --huge-pages             allocate requests and buffers with huge pages");
+  puts("  --linked                 link each read to its write in the kernel");
+  puts("  --merge                  merge contiguous requests at submission");
+  puts("  --fdatasync              flush the output file data before exit");
+  puts("  --no-sparse              copy the holes of the input file");
+  puts("  --no-reflink             do not clone the input file");
+  puts("  --no-copy-file-range     do not use copy_file_range");
+  puts("  --no-splice              do not use splice requests");
+  puts("  --detect-zeroes          punch the blocks of zeros instead of writing them");
+  puts("  --checksum               hash the input blocks: crc32c or xxh3");
+  puts("  --manifest               write the block hashes of the input in this file");
+  puts("  --verify                 check the input against this manifest");
+  puts("  --progress               print the copy progress");
+  puts("  --iops-limit             max number of reads and writes per second");
+  puts("  --bandwidth-limit        max number of bytes read and written per second");
+  puts("  --stats                  print copy duration and throughput");
   puts("  --help                   print this help and exit");
 }
 
@@ -184,7 +258,29 @@ int main(int argc, char *argv[]) {
     { "in", 1, NULL, 'i' },
     { "out", 1, NULL, 'o' },
     { "polling", 0, NULL, 'p' },
+    { "hybrid-polling", 0, NULL, 'y' },
+    { "sq-polling", 0, NULL, 'q' },
+    { "sq-cpu", 1, NULL, 'c' },
     { "o-direct", 0, NULL, 'd' },
+    { "event-fd", 0, NULL, 'e' },
+    { "fixed-buffers", 0, NULL, 'b' },
+    { "fixed-files", 0, NULL, 'f' },
+    { "huge-pages", 0, NULL, 'g' },
+    { "linked", 0, NULL, 'l' },
+    { "merge", 0, NULL, 'm' },
+    { "fdatasync", 0, NULL, 'n' },
+    { "no-sparse", 0, NULL, 'z' },
+    { "no-reflink", 0, NULL, 'k' },
+    { "no-copy-file-range", 0, NULL, 'x' },
+    { "no-splice", 0, NULL, 'j' },
+    { "detect-zeroes", 0, NULL, 'Z' },
+    { "checksum", 1, NULL, 'C' },
+    { "manifest", 1, NULL, 'M' },
+    { "verify", 1, NULL, 'V' },
+    { "progress", 0, NULL, 'a' },
+    { "iops-limit", 1, NULL, 'r' },
+    { "bandwidth-limit", 1, NULL, 'w' },
+    { "stats", 0, NULL, 's' },
     { "help", 0, NULL, 'h' },
     { NULL, 0, 0, 0 }
   };
@@ -192,9 +288,25 @@ int main(int argc, char *argv[]) {
   char *inPath = NULL;
   char *outPath = NULL;
 
-  bool usePolling = false;
+  XcpIoQueueOptions options;
+  xcp_io_queue_options_init(&options, QUEUE_CAPACITY);
+  options.flags |= XcpIoQueueFlagNoEventFd;
+
+  XcpIoCopyOptions copyOptions;
+  xcp_io_copy_options_init(&copyOptions);
+  copyOptions.blockSize = QUEUE_BLOCK_SIZE;
+  copyOptions.tenant = COPY_TENANT;
+  unsigned int lastPermille = UINT_MAX;
+  copyOptions.progressUserArg = &lastPermille;
+
+  XcpIoRateLimit rateLimit = { 0, 0, 0, 0 };
+  bool printStats = false;
   int flags = 0;
 
+  XcpIoChecksum checksum = XcpIoChecksumNone;
+  char *manifestPath = NULL;
+  char *verifyPath = NULL;
+
   int option;
   int longindex = 0;
   while ((option = getopt_long_only(argc, argv, "", longopts, &longindex)) != -1) {
@@ -206,11 +318,84 @@ int main(int argc, char *argv[]) {
         outPath = optarg;
         break;
       case 'p':
-        usePolling = true;
+        options.flags |= XcpIoQueueFlagIoPoll;
+        break;
+      case 'y':
+        options.flags |= XcpIoQueueFlagHybridPoll;
+        break;
+      case 'q':
+        options.flags |= XcpIoQueueFlagSqPoll;
+        break;
+      case 'c':
+        options.sqThreadCpu = atoi(optarg);
         break;
       case 'd':
         flags |= O_DIRECT;
         break;
+      case 'e':
+        options.flags &= ~(unsigned int)XcpIoQueueFlagNoEventFd;
+        break;
+      case 'b':
+        copyOptions.flags |= XcpIoCopyFlagFixedBuffers;
+        break;
+      case 'f':
+        copyOptions.flags |= XcpIoCopyFlagFixedFiles;
+        break;
+      case 'g':
+        copyOptions.flags |= XcpIoCopyFlagHugePages;
+        break;
+      case 'l':
+        copyOptions.flags |= XcpIoCopyFlagLinks;
+        break;
+      case 'm':
+        options.flags |= XcpIoQueueFlagMerge;
+        break;
+      case 'n':
+        copyOptions.flags |= XcpIoCopyFlagFdatasync;
+        break;
+      case 'z':
+        copyOptions.flags |= XcpIoCopyFlagNoSparse;
+        break;
+      case 'k':
+        copyOptions.flags |= XcpIoCopyFlagNoReflink;
+        break;
+      case 'x':
+        copyOptions.flags |= XcpIoCopyFlagNoCopyFileRange;
+        break;
+      case 'j':
+        copyOptions.flags |= XcpIoCopyFlagNoSplice;
+        break;
+      case 'Z':
+        copyOptions.flags |= XcpIoCopyFlagDetectZeroes;
+        break;
+      case 'C':
+        if (!strcmp(optarg, xcp_io_checksum_to_str(XcpIoChecksumCrc32c)))
+          checksum = XcpIoChecksumCrc32c;
+        else if (!strcmp(optarg, xcp_io_checksum_to_str(XcpIoChecksumXxh3)))
+          checksum = XcpIoChecksumXxh3;
+        else {
+          fprintf(stderr, "Unknown checksum: `%s`.\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'M':
+        manifestPath = optarg;
+        break;
+      case 'V':
+        verifyPath = optarg;
+        break;
+      case 'a':
+        copyOptions.progressCb = progress_cb;
+        break;
+      case 'r':
+        rateLimit.iops = strtoull(optarg, NULL, 10);
+        break;
+      case 'w':
+        rateLimit.bandwidth = strtoull(optarg, NULL, 10);
+        break;
+      case 's':
+        printStats = true;
+        break;
       case 'h':
         usage(argv[0]);
         return EXIT_SUCCESS;
@@ -229,6 +414,29 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
+  // The blocks of the manifest are the blocks of the copy. The checksum of the verified manifest is used by default.
+  int ret;
+  XcpIoChecksumManifest expected;
+  if (verifyPath) {
+    if ((ret = read_manifest(verifyPath, &expected)) < 0) {
+      fprintf(stderr, "Failed to read manifest: %s\n", strerror(-ret));
+      return EXIT_FAILURE;
+    }
+    if (expected.blockSize != QUEUE_BLOCK_SIZE || (checksum && checksum != expected.checksum)) {
+      fprintf(stderr, "The manifest uses another block size or checksum.\n");
+      return EXIT_FAILURE;
+    }
+    checksum = expected.checksum;
+  }
+
+  XcpIoChecksumManifest manifest;
+  if (!checksum && manifestPath)
+    checksum = XcpIoChecksumXxh3;
+  if (checksum) {
+    xcp_io_checksum_manifest_init(&manifest, checksum, QUEUE_BLOCK_SIZE);
+    copyOptions.manifest = &manifest;
+  }
+
   const int in = open(inPath, flags | O_RDONLY);
   if (in < 0) {
     perror("Failed to open input file");
@@ -247,15 +455,74 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
-  int ret;
-
   XcpIoQueue queue;
-  if ((ret = xcp_io_queue_init(&queue, QUEUE_CAPACITY, usePolling)) < 0) {
+  if ((ret = xcp_io_queue_init_with_options(&queue, &options)) < 0) {
     fprintf(stderr, "Failed to initialize queue: %s\n", strerror(-ret));
     return EXIT_FAILURE;
   }
 
-  ret = copy(&queue, in, out, inSize, flags);
+  if (
+    (rateLimit.iops || rateLimit.bandwidth) &&
+    (ret = xcp_io_queue_set_rate_limit(&queue, COPY_TENANT, &rateLimit)) < 0
+  ) {
+    fprintf(stderr, "Failed to set rate limit: %s\n", strerror(-ret));
+    xcp_io_queue_uninit(&queue);
+    return EXIT_FAILURE;
+  }
+
+  // In linked mode, each block uses two requests.
+  const bool useLinks = copyOptions.flags & XcpIoCopyFlagLinks;
+  copyOptions.depth = useLinks ? QUEUE_CAPACITY / 2 : QUEUE_CAPACITY;
+
+  if (
+    (copyOptions.flags & XcpIoCopyFlagFixedBuffers) &&
+    (ret = xcp_io_queue_register_buffers(&queue, QUEUE_BLOCK_SIZE, copyOptions.depth)) < 0
+  ) {
+    fprintf(stderr, "Failed to register buffers: %s\n", strerror(-ret));
+    xcp_io_queue_uninit(&queue);
+    return EXIT_FAILURE;
+  }
+
+  if ((copyOptions.flags & XcpIoCopyFlagFixedFiles) && (ret = xcp_io_queue_register_file_table(&queue, 2)) < 0) {
+    fprintf(stderr, "Failed to register file table: %s\n", strerror(-ret));
+    xcp_io_queue_uninit(&queue);
+    return EXIT_FAILURE;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  XcpIoCopyProgress progress;
+  if ((ret = xcp_io_copy_range(&queue, in, 0, out, 0, (uint64_t)inSize, &copyOptions, &progress)) < 0)
+    fprintf(stderr, "Copy failed: %s\n", strerror(-ret));
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (copyOptions.progressCb)
+    fputc('\n', stderr);
+  if (printStats)
+    print_stats(&queue, &progress, &start, &end);
+
+  if (copyOptions.manifest && !ret) {
+    printf(
+      "Digest (%s): %016llx\n", xcp_io_checksum_to_str(checksum),
+      (unsigned long long)xcp_io_checksum_manifest_get_digest(&manifest)
+    );
+    if (manifestPath && (ret = write_manifest(manifestPath, &manifest)) < 0)
+      fprintf(stderr, "Failed to write manifest: %s\n", strerror(-ret));
+    if (verifyPath && !ret) {
+      if (!compare_manifests(&expected, &manifest)) {
+        fprintf(stderr, "Verification failed.\n");
+        ret = -EBADMSG;
+      } else
+        printf("Verification succeeded.\n");
+    }
+  }
+  if (copyOptions.manifest)
+    xcp_io_checksum_manifest_uninit(&manifest);
+  if (verifyPath)
+    xcp_io_checksum_manifest_uninit(&expected);
+
   xcp_io_queue_uninit(&queue);
 
   close(in);
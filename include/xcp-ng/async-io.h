@@ -17,8 +17,18 @@
 #ifndef _XCP_NG_ASYNC_H_
 #define _XCP_NG_ASYNC_H_
 
+#include "xcp-ng/async-io/io-cache.h"
+#include "xcp-ng/async-io/io-checksum.h"
+#include "xcp-ng/async-io/io-copy.h"
+#include "xcp-ng/async-io/io-device.h"
+#include "xcp-ng/async-io/io-engine.h"
 #include "xcp-ng/async-io/io-queue.h"
 #include "xcp-ng/async-io/io-req.h"
+#include "xcp-ng/async-io/io-req-pool.h"
+#include "xcp-ng/async-io/io-scheduler.h"
+#include "xcp-ng/async-io/io-stats.h"
+#include "xcp-ng/async-io/io-write-combiner.h"
+#include "xcp-ng/async-io/io-zero.h"
 
 // =============================================================================
 
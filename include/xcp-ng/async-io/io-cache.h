@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_ASYNC_IO_IO_CACHE_H_
+#define _XCP_NG_ASYNC_IO_IO_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xcp-ng/async-io/io-queue.h"
+#include "xcp-ng/async-io/io-req-pool.h"
+
+// =============================================================================
+
+#define XCP_IO_CACHE_DEFAULT_BLOCK_SIZE (64 * 1024)
+#define XCP_IO_CACHE_DEFAULT_SHARD_COUNT 16
+#define XCP_IO_CACHE_DEFAULT_WRITE_COUNT 1024
+
+typedef struct XcpIoCacheOptions {
+  // Memory used by the cached blocks, in bytes.
+  size_t size;
+
+  // Size of the cached blocks, a multiple of XCP_IO_REQ_POOL_DATA_ALIGNMENT. The blocks are aligned on this size
+  // in the files, and the buffers are compatible with O_DIRECT.
+  size_t blockSize;
+
+  // Number of shards, a power of 2. Each shard has its own lock, its own part of the memory and its own
+  // eviction state: use at least one shard per thread using the cache.
+  unsigned int shardCount;
+
+  // Combination of XcpIoReqPoolFlag values used to allocate the blocks.
+  unsigned int reqPoolFlags;
+
+  // Max number of writes inserted with xcp_io_cache_insert and not completed yet.
+  size_t writeCount;
+} XcpIoCacheOptions;
+
+typedef struct XcpIoCacheStats {
+  // Reads copied from a cached block.
+  uint64_t hits;
+
+  // Reads which started the read of a block.
+  uint64_t misses;
+
+  // Reads completed by the read of a block started by another read.
+  uint64_t coalesced;
+
+  // Reads given to the queue without the cache: not contained in one block, linked, using a registered file,
+  // or no block could be evicted.
+  uint64_t bypasses;
+
+  // Blocks evicted to make room for other blocks.
+  uint64_t evictions;
+
+  // Blocks removed because they were written.
+  uint64_t invalidations;
+} XcpIoCacheStats;
+
+// Cache of file blocks in front of queues, shared by all the threads. The eviction policy of each shard is ARC
+// (adaptive replacement cache): recently and frequently used blocks have their own list, and the lists of the
+// evicted blocks adjust the part of the memory given to each one.
+typedef struct XcpIoCache {
+  size_t blockSize;
+  unsigned int shardCount;
+
+  struct {
+    struct XcpIoCacheShard *shards;
+
+    // Block reads: each resident block owns a request and its data slot.
+    XcpIoReqPool reqPool;
+
+    // Writes in progress: the callbacks replaced by the cache.
+    XcpIoReqPool writePool;
+    struct XcpIoCacheWrite *writes;
+  } pImpl; // Private implementation, do not touch!
+} XcpIoCache;
+
+// -----------------------------------------------------------------------------
+
+XCP_DECL_UNUSED static inline void xcp_io_cache_options_init (XcpIoCacheOptions *options, size_t size) {
+  options->size = size;
+  options->blockSize = XCP_IO_CACHE_DEFAULT_BLOCK_SIZE;
+  options->shardCount = XCP_IO_CACHE_DEFAULT_SHARD_COUNT;
+  options->reqPoolFlags = 0;
+  options->writeCount = XCP_IO_CACHE_DEFAULT_WRITE_COUNT;
+}
+
+int xcp_io_cache_init (XcpIoCache *cache, const XcpIoCacheOptions *options);
+
+// The blocks being read must be completed before.
+void xcp_io_cache_uninit (XcpIoCache *cache);
+
+// Replacement of xcp_io_queue_insert for the requests using cached files.
+// A Read contained in one block is served by the cache:
+// - If the block is cached, the data is copied and the callback is called before the function returns.
+// - If the block is being read, the request waits for this read: identical concurrent reads use one SQE.
+//   The callback is called by the thread processing the queue of the block read.
+// - Otherwise the block is read in the queue, then the waiting requests are completed.
+// If a block read fails, the waiting requests are inserted in the queue. The last block of a file is cached with
+// the size read: the requests past its end are inserted in the queue.
+// The writes (Write, WriteV, WriteFixed, Splice and Fallocate) invalidate the blocks of their range when they are
+// inserted and when they are completed: their callback is temporarily replaced. A write at the current file
+// position (offset -1) removes all the blocks of its file. The writes of registered files are not seen by the
+// cache, use xcp_io_cache_invalidate. The queue must not have a batch callback.
+// Returns 0, or -EBUSY if the writes of the chain exceed writeCount: nothing is inserted.
+int xcp_io_cache_insert (XcpIoCache *cache, XcpIoQueue *queue, XcpIoReq *req);
+
+// Remove the blocks of a range, the blocks being read are not kept. len can be UINT64_MAX to remove all the
+// blocks of fd, for example before closing it.
+void xcp_io_cache_invalidate (XcpIoCache *cache, int fd, off_t offset, uint64_t len);
+
+// Sum of the statistics of all the shards.
+void xcp_io_cache_get_stats (XcpIoCache *cache, XcpIoCacheStats *stats);
+
+#endif // ifndef _XCP_NG_ASYNC_IO_IO_CACHE_H_
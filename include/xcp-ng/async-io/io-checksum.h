@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_ASYNC_IO_IO_CHECKSUM_H_
+#define _XCP_NG_ASYNC_IO_IO_CHECKSUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xcp-ng/async-io/io-global.h"
+
+// =============================================================================
+
+typedef enum {
+  XcpIoChecksumNone,
+
+  // CRC-32C (Castagnoli), hardware accelerated with SSE4.2 and PCLMUL.
+  XcpIoChecksumCrc32c,
+
+  // XXH3 64 bits with the default secret and seed, vectorized with AVX2.
+  XcpIoChecksumXxh3
+} XcpIoChecksum;
+
+XCP_DECL_UNUSED static inline const char *xcp_io_checksum_to_str (XcpIoChecksum checksum) {
+  switch (checksum) {
+    case XcpIoChecksumNone: return "none";
+    case XcpIoChecksumCrc32c: return "crc32c";
+    case XcpIoChecksumXxh3: return "xxh3";
+  }
+  return "unknown";
+}
+
+// -----------------------------------------------------------------------------
+
+// Update the CRC-32C crc with size bytes of buf, the first crc is 0.
+uint32_t xcp_io_crc32c (uint32_t crc, const void *buf, size_t size);
+
+// Returns the CRC-32C of A + B from crc1 (CRC of A), crc2 (CRC of B) and the size of B.
+uint32_t xcp_io_crc32c_combine (uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+uint64_t xcp_io_xxh3 (const void *buf, size_t size);
+
+// Returns the hash of buf, a CRC-32C is returned in the lower 32 bits.
+uint64_t xcp_io_checksum_compute (XcpIoChecksum checksum, const void *buf, size_t size);
+
+// -----------------------------------------------------------------------------
+
+// Hashes of the consecutive blocks of a range. The last block can be smaller than the others.
+typedef struct XcpIoChecksumManifest {
+  XcpIoChecksum checksum;
+
+  // Size of the blocks and of the range.
+  size_t blockSize;
+  uint64_t size;
+
+  // Hash of each block, ordered by offset.
+  size_t blockCount;
+  uint64_t *hashes;
+} XcpIoChecksumManifest;
+
+void xcp_io_checksum_manifest_init (XcpIoChecksumManifest *manifest, XcpIoChecksum checksum, size_t blockSize);
+void xcp_io_checksum_manifest_uninit (XcpIoChecksumManifest *manifest);
+
+// Set the size of the range, the hashes are reset to 0.
+int xcp_io_checksum_manifest_set_size (XcpIoChecksumManifest *manifest, uint64_t size);
+
+// Returns the hash of the whole range, computed from the block hashes in offset order:
+// the CRC-32C of the range with XcpIoChecksumCrc32c, the XXH3 of the block hash list
+// (little endian 64-bit values) with XcpIoChecksumXxh3.
+uint64_t xcp_io_checksum_manifest_get_digest (const XcpIoChecksumManifest *manifest);
+
+XCP_DECL_UNUSED static inline size_t xcp_io_checksum_manifest_get_block_size (
+  const XcpIoChecksumManifest *manifest, size_t index
+) {
+  const uint64_t offset = (uint64_t)index * manifest->blockSize;
+  return manifest->size - offset < manifest->blockSize ? (size_t)(manifest->size - offset) : manifest->blockSize;
+}
+
+#endif // ifndef _XCP_NG_ASYNC_IO_IO_CHECKSUM_H_
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_ASYNC_IO_IO_COPY_H_
+#define _XCP_NG_ASYNC_IO_IO_COPY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xcp-ng/async-io/io-checksum.h"
+#include "xcp-ng/async-io/io-queue.h"
+
+// =============================================================================
+
+#define XCP_IO_COPY_DEFAULT_DEPTH 64
+#define XCP_IO_COPY_DEFAULT_BLOCK_SIZE (32 * 1024)
+
+// The copy uses the first working method, in this order:
+// 1. A clone of the range (FICLONERANGE): the data is shared on reflink filesystems like XFS or btrfs.
+// 2. copy_file_range(2): the kernel copies the data, the filesystem or the server can offload it.
+// 3. Splice requests through a pipe per block: the data is moved in the kernel, but through the queue.
+// 4. Read and write requests with buffers (the buffered copy).
+// The first two are synchronous syscalls, copy_file_range is not used if the queue has rate limits.
+typedef enum {
+  // Use the registered buffers of the queue (see xcp_io_queue_register_buffers), they must be large enough
+  // to contain a block. Otherwise the copy allocates its own buffers. Buffered copy only.
+  XcpIoCopyFlagFixedBuffers = 1 << 0,
+
+  // Add in and out in the registered file table of the queue during the copy, the table must have two free slots.
+  XcpIoCopyFlagFixedFiles = 1 << 1,
+
+  // Link each read to its write in the kernel: a block is copied without going back to user space.
+  // Buffered copy only.
+  XcpIoCopyFlagLinks = 1 << 2,
+
+  // Flush the output data after the last write.
+  XcpIoCopyFlagFdatasync = 1 << 3,
+
+  // Copy the holes of the input like data. Useful if the input does not support SEEK_DATA correctly.
+  XcpIoCopyFlagNoSparse = 1 << 4,
+
+  // Allocate the requests and buffers of the copy with huge pages, see XcpIoReqPoolFlagHugePages.
+  XcpIoCopyFlagHugePages = 1 << 5,
+
+  // Disable a copy method.
+  XcpIoCopyFlagNoReflink = 1 << 6,
+  XcpIoCopyFlagNoCopyFileRange = 1 << 7,
+  XcpIoCopyFlagNoSplice = 1 << 8,
+
+  // Check if the read blocks only contain zeros (see xcp_io_req_set_zero_check): they are punched in out
+  // (or zeroed with fallocate if punching is not supported) instead of being written, so the output is sparse
+  // even if the input is not.
+  // Buffered copy without XcpIoCopyFlagLinks only: copy_file_range and splice are not used with this flag.
+  XcpIoCopyFlagDetectZeroes = 1 << 9
+} XcpIoCopyFlag;
+
+typedef struct XcpIoCopyProgress {
+  // Size of the copied range.
+  uint64_t size;
+
+  // Bytes read and written.
+  uint64_t copiedBytes;
+
+  // Part of copiedBytes copied without user space buffers: cloned, copied by copy_file_range or spliced.
+  uint64_t offloadedBytes;
+
+  // Bytes in the holes of the input: they are not read, the output contains holes (or zeros) at the same place.
+  uint64_t skippedBytes;
+
+  // Part of copiedBytes read as zeros and not written, see XcpIoCopyFlagDetectZeroes.
+  uint64_t zeroBytes;
+} XcpIoCopyProgress;
+
+typedef void (*XcpIoCopyProgressCb)(const XcpIoCopyProgress *progress, void *userArg);
+
+typedef struct XcpIoCopyOptions {
+  // Max number of blocks copied at the same time.
+  size_t depth;
+
+  // Max size of the reads and writes.
+  size_t blockSize;
+
+  // Combination of XcpIoCopyFlag values.
+  unsigned int flags;
+
+  // Tenant of the requests (see xcp_io_req_set_tenant), 0 to use the fds.
+  uint32_t tenant;
+
+  // Called from xcp_io_copy_range when the progress changes, can be NULL.
+  XcpIoCopyProgressCb progressCb;
+  void *progressUserArg;
+
+  // If not NULL, each block of the input is hashed by the queue when it's read, and the manifest is resized
+  // to the copied range. The holes get the hash of a block of zeros. The manifest checksum and block size must
+  // be set, the block size must be equal to blockSize. Buffered copy only: the other methods are not used.
+  XcpIoChecksumManifest *manifest;
+} XcpIoCopyOptions;
+
+// -----------------------------------------------------------------------------
+
+XCP_DECL_UNUSED static inline void xcp_io_copy_options_init (XcpIoCopyOptions *options) {
+  options->depth = XCP_IO_COPY_DEFAULT_DEPTH;
+  options->blockSize = XCP_IO_COPY_DEFAULT_BLOCK_SIZE;
+  options->flags = 0;
+  options->tenant = 0;
+  options->progressCb = NULL;
+  options->progressUserArg = NULL;
+  options->manifest = NULL;
+}
+
+// Copy len bytes of in at inOffset in out at outOffset, using the queue. Returns when the copy is done.
+// If the range can't be cloned, the data extents of in are found with SEEK_DATA/SEEK_HOLE (the file position
+// of in is changed), only them are read and written. The holes are punched in out if it already contains data
+// at this place, zeroed if punching is not supported, and copied like data otherwise. A regular output file
+// is extended to the end of the range first, so the copy of a sparse file in a new file is sparse.
+// len is reduced if the input is smaller. The queue can be used by other users at the same time, but it must
+// not have a batch callback (see xcp_io_queue_set_batch_cb).
+// Returns 0 or the negative errno of the first failure, progress (can be NULL) contains the copied size.
+int xcp_io_copy_range (
+  XcpIoQueue *queue, int in, off_t inOffset, int out, off_t outOffset, uint64_t len,
+  const XcpIoCopyOptions *options, XcpIoCopyProgress *progress
+);
+
+#endif // ifndef _XCP_NG_ASYNC_IO_IO_COPY_H_
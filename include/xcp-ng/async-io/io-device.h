@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_ASYNC_IO_IO_DEVICE_H_
+#define _XCP_NG_ASYNC_IO_IO_DEVICE_H_
+
+#include <stddef.h>
+
+#include "xcp-ng/async-io/io-global.h"
+
+// =============================================================================
+
+// Request limits of a block device, see xcp_io_queue_set_device_limits.
+typedef struct XcpIoDeviceLimits {
+  // Max size in bytes of one request (queue/max_sectors_kb), 0 means no limit.
+  size_t maxTransferSize;
+
+  // Max number of iovecs of one request (queue/max_segments), 0 means IOV_MAX.
+  size_t maxSegmentCount;
+
+  // Smallest addressable unit of the device (queue/logical_block_size), a power of 2.
+  size_t logicalBlockSize;
+
+  // Preferred request size (queue/optimal_io_size), a stripe size of a RAID device for example. 0 if unknown.
+  size_t optimalTransferSize;
+} XcpIoDeviceLimits;
+
+// Read the limits of the block device of fd, or of the device containing the file of fd, from sysfs.
+// The logical block size of a block device is read with BLKSSZGET. Unknown limits are set to their default
+// values: no size limit, IOV_MAX segments and 512 bytes blocks (files of virtual filesystems for example).
+// Returns 0 or a negative errno if fd is invalid.
+int xcp_io_device_limits_init (XcpIoDeviceLimits *limits, int fd);
+
+#endif // ifndef _XCP_NG_ASYNC_IO_IO_DEVICE_H_
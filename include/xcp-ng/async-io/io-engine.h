@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_ASYNC_IO_IO_ENGINE_H_
+#define _XCP_NG_ASYNC_IO_IO_ENGINE_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "xcp-ng/async-io/io-queue.h"
+#include "xcp-ng/async-io/io-req.h"
+
+// =============================================================================
+
+typedef enum {
+  // Use the queue of the CPU calling xcp_io_engine_submit instead of the queue associated to the request fd.
+  XcpIoEngineFlagSteerByCpu = 1 << 0,
+
+  // Don't pin the queue threads.
+  XcpIoEngineFlagNoAffinity = 1 << 1
+} XcpIoEngineFlag;
+
+typedef struct XcpIoEngineOptions {
+  // Options of each queue. Fixed files and buffers are not supported because they are queue specific.
+  XcpIoQueueOptions queueOptions;
+
+  // Number of queues, 0 means one queue per CPU of the process affinity mask.
+  unsigned int queueCount;
+
+  // Combination of XcpIoEngineFlag values.
+  unsigned int flags;
+} XcpIoEngineOptions;
+
+typedef struct XcpIoEngine XcpIoEngine;
+
+// One queue of the engine, owned by one thread.
+typedef struct XcpIoEngineQueue {
+  XcpIoEngine *engine;
+  XcpIoQueue queue;
+
+  // CPU of the thread, -1 if the thread is not pinned.
+  int cpu;
+
+  struct {
+    pthread_t thread;
+
+    // Inbox: lock-free LIFO filled by the producers, reversed by the thread to keep the submission order.
+    // Requests are linked with pImpl.next, only chain heads are pushed.
+    _Atomic(XcpIoReq *) inbox;
+
+    // Requests fetched from the inbox, inserted in the queue when there is room.
+    STAILQ_HEAD(, XcpIoReq) backlog;
+
+    // Written by the producers when the inbox was empty, polled in the ring to wake up the thread.
+    int wakeFd;
+    XcpIoReq wakeReq;
+  } pImpl; // Private implementation, do not touch!
+} XcpIoEngineQueue;
+
+// Set of queues, each one is processed by a thread pinned to one CPU.
+// Requests can be submitted from any thread, the completion callbacks are called by the queue threads.
+typedef struct XcpIoEngine {
+  unsigned int queueCount;
+  XcpIoEngineQueue *queues;
+
+  // Combination of XcpIoEngineFlag values.
+  unsigned int flags;
+
+  struct {
+    _Atomic bool stopping;
+
+    // Queue index of each CPU, used by XcpIoEngineFlagSteerByCpu.
+    unsigned int *cpuQueues;
+    unsigned int cpuCount;
+  } pImpl; // Private implementation, do not touch!
+} XcpIoEngine;
+
+// -----------------------------------------------------------------------------
+
+XCP_DECL_UNUSED static inline void xcp_io_engine_options_init (XcpIoEngineOptions *options, size_t capacity) {
+  xcp_io_queue_options_init(&options->queueOptions, capacity);
+  options->queueCount = 0;
+  options->flags = 0;
+}
+
+int xcp_io_engine_init (XcpIoEngine *engine, const XcpIoEngineOptions *options);
+
+// Wait the completion of all the submitted requests and stop the threads.
+void xcp_io_engine_uninit (XcpIoEngine *engine);
+
+// Submit a request (or a chain) from any thread, the queue is chosen by xcp_io_engine_get_queue_index.
+// The request is inserted in the queue and submitted by the queue thread asynchronously.
+void xcp_io_engine_submit (XcpIoEngine *engine, XcpIoReq *req);
+
+// Submit a request (or a chain) to a specific queue.
+void xcp_io_engine_submit_to_queue (XcpIoEngine *engine, unsigned int queueIndex, XcpIoReq *req);
+
+// Returns the queue used by xcp_io_engine_submit for a request.
+// Requests on the same fd use the same queue, so they are submitted in order.
+unsigned int xcp_io_engine_get_queue_index (const XcpIoEngine *engine, const XcpIoReq *req);
+
+XCP_DECL_UNUSED static inline unsigned int xcp_io_engine_get_queue_count (const XcpIoEngine *engine) {
+  return engine->queueCount;
+}
+
+#endif // ifndef _XCP_NG_ASYNC_IO_IO_ENGINE_H_
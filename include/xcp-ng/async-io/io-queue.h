@@ -17,15 +17,128 @@
 #ifndef _XCP_NG_ASYNC_IO_IO_QUEUE_H_
 #define _XCP_NG_ASYNC_IO_IO_QUEUE_H_
 
+#include <linux/time_types.h>
 #include <liburing.h>
+#include <stdint.h>
 #include <sys/queue.h>
+#include <time.h>
 
+#include "xcp-ng/async-io/io-device.h"
 #include "xcp-ng/async-io/io-global.h"
+#include "xcp-ng/async-io/io-scheduler.h"
+#include "xcp-ng/async-io/io-stats.h"
 
 // =============================================================================
 
 typedef struct XcpIoReq XcpIoReq;
 
+typedef enum {
+  // Busy-wait for completions instead of using interrupts (IORING_SETUP_IOPOLL).
+  // Used on specific devices like NVMe, files must be opened with O_DIRECT.
+  XcpIoQueueFlagIoPoll = 1 << 0,
+
+  // A kernel thread polls the submission queue (IORING_SETUP_SQPOLL), so
+  // xcp_io_queue_submit doesn't need a syscall while this thread is awake.
+  // Note: Before Linux 5.11, it requires CAP_SYS_ADMIN and registered files.
+  XcpIoQueueFlagSqPoll = 1 << 1,
+
+  // Do not create an event fd. Useful if xcp_io_queue_submit_and_wait is used or if
+  // the ring fd is directly polled by an event loop (see xcp_io_queue_get_ring_fd):
+  // xcp_io_queue_process_responses doesn't read the event fd in this case.
+  XcpIoQueueFlagNoEventFd = 1 << 2,
+
+  // xcp_io_queue_process_responses waits for at least one response: it spins on the
+  // completion ring during a budget tuned from the recently observed wait times, then
+  // sleeps in the kernel. No event fd is created. Ignored if IoPoll is used.
+  XcpIoQueueFlagHybridPoll = 1 << 3,
+
+  // Merge contiguous pending reads (or writes) on the same fd in one vectored request at submission.
+  // Only Read, Write, ReadV and WriteV requests with an offset, without link, barrier or timeout are merged.
+  // Merged requests are completed one by one with their callback, see XcpIoQueueOptions.maxMergeSize.
+  XcpIoQueueFlagMerge = 1 << 4
+} XcpIoQueueFlag;
+
+typedef struct XcpIoQueueOptions {
+  // Max number of requests that can be processed at the same time.
+  size_t capacity;
+
+  // Combination of XcpIoQueueFlag values.
+  unsigned int flags;
+
+  // SQPOLL only: idle time in milliseconds before the kernel thread sleeps.
+  // If 0, the kernel default is used.
+  unsigned int sqThreadIdle;
+
+  // SQPOLL only: CPU of the kernel thread, or -1 to not pin it.
+  int sqThreadCpu;
+
+  // HybridPoll only: max spin time in microseconds.
+  // If 0, XCP_IO_QUEUE_DEFAULT_MAX_SPIN_TIME is used.
+  unsigned int maxSpinTime;
+
+  // If not NULL, share the async workers of this queue instead of creating a new pool (IORING_SETUP_ATTACH_WQ).
+  // The parent must be uninitialized after this queue.
+  const struct XcpIoQueue *parent;
+
+  // Max number of async workers for bounded work (regular files, block devices) and unbounded work
+  // (sockets, pipes...). If 0, the current limit is kept. See: xcp_io_queue_set_max_workers.
+  unsigned int maxBoundedWorkers;
+  unsigned int maxUnboundedWorkers;
+
+  // Merge only: max size in bytes of a merged request.
+  // If 0, XCP_IO_QUEUE_DEFAULT_MAX_MERGE_SIZE is used.
+  size_t maxMergeSize;
+} XcpIoQueueOptions;
+
+#define XCP_IO_QUEUE_DEFAULT_MAX_SPIN_TIME 50
+#define XCP_IO_QUEUE_DEFAULT_MAX_MERGE_SIZE (128 * 1024)
+
+typedef struct XcpIoQueueCounters {
+  // HybridPoll only: number of waits ended while spinning or after sleeping.
+  uint64_t spinHits;
+  uint64_t spinMisses;
+
+  // Number of short reads/writes resubmitted by the queue to transfer the remaining data. The rest of a
+  // partially transferred iovec of a ReadV or WriteV is resubmitted alone, then the next iovecs.
+  uint64_t shortTransfers;
+
+  // Merge only: number of merged requests submitted and number of requests they contain.
+  uint64_t merges;
+  uint64_t mergedRequests;
+
+  // Number of requests delayed by a rate limit, see xcp_io_queue_set_rate_limit.
+  uint64_t throttledRequests;
+
+  // Number of requests split because they exceed their device limits, and number of child requests created.
+  uint64_t splits;
+  uint64_t splitRequests;
+} XcpIoQueueCounters;
+
+// Token bucket limits of a tenant or a fd, see xcp_io_queue_set_rate_limit.
+typedef struct XcpIoRateLimit {
+  // Max number of requests and bytes per second, 0 means no limit.
+  // Values greater than XCP_IO_RATE_LIMIT_MAX are not supported.
+  uint64_t iops;
+  uint64_t bandwidth;
+
+  // Number of requests and bytes that can be submitted at once after an idle period.
+  // If 0, requests are spaced out evenly.
+  uint64_t iopsBurst;
+  uint64_t bandwidthBurst;
+} XcpIoRateLimit;
+
+#define XCP_IO_RATE_LIMIT_MAX (UINT64_MAX / 1000000000)
+
+typedef struct XcpIoResponse {
+  XcpIoReq *req;
+  int err;
+} XcpIoResponse;
+
+typedef struct XcpIoQueue XcpIoQueue;
+
+// Called with all the responses fetched in one processing cycle (see xcp_io_queue_set_batch_cb).
+typedef void (*XcpIoQueueBatchCb)(XcpIoQueue *queue, const XcpIoResponse *responses, size_t count, void *userArg);
+
 typedef struct XcpIoQueue {
   // Max number of requests that can be processed at the same time.
   size_t capacity;
@@ -40,30 +153,217 @@ typedef struct XcpIoQueue {
   size_t pendingCount;
 
   // Event fd to be notified when there is a change in the ring.
-  // Note: unusable if polling is activated.
+  // Note: unusable if polling is activated or if XcpIoQueueFlagNoEventFd is used.
   int eventFd;
 
   // Used on specific devices like NVMe.
   bool usePolling;
 
+  // Combination of XcpIoQueueFlag values.
+  unsigned int flags;
+
+  XcpIoQueueCounters counters;
+
   struct {
     struct io_uring ring;
+
+    // Hybrid polling state, all times are in nanoseconds.
+    struct {
+      uint64_t maxSpinTime;
+      uint64_t spinBudget;
+      uint64_t avgWaitTime;
+    } hybridPoll;
+
+    // Batch completion, see xcp_io_queue_set_batch_cb.
+    struct {
+      XcpIoQueueBatchCb cb;
+      void *userArg;
+      XcpIoResponse *responses;
+      size_t size;
+      size_t count;
+    } batch;
+
+    // Registered buffers, see xcp_io_queue_register_buffers.
+    struct {
+      void *arena;
+      size_t arenaSize;
+      size_t size;
+      size_t stride;
+      uint16_t *freeIndexes;
+      uint16_t freeCount;
+      uint16_t count;
+    } buffers;
+
+    // Registered files, see xcp_io_queue_register_file_table.
+    struct {
+      int *fds;
+      unsigned int *freeIndexes;
+      unsigned int freeCount;
+      unsigned int size;
+    } files;
+
+    // Merge state, groups are preallocated at init.
+    struct {
+      struct XcpIoMergeGroup *groups;
+      struct XcpIoMergeGroup *freeGroups;
+      size_t maxSize;
+    } merge;
+
+    // Optional scheduler of the pending requests, see xcp_io_queue_set_scheduler.
+    struct {
+      XcpIoScheduler *scheduler;
+      size_t reqCount; // Number of requests in the scheduler, included in pendingCount.
+    } sched;
+
+    // Rate limits, see xcp_io_queue_set_rate_limit.
+    struct {
+      struct XcpIoRateLimiter **limiters; // Sorted by key.
+      size_t count;
+      size_t reqCount; // Number of throttled requests, included in pendingCount.
+
+      // Wake up timer (IORING_OP_TIMEOUT) armed at the next release time of the throttled requests.
+      bool timerArmed;
+      uint64_t timerDeadline;
+      struct __kernel_timespec timerSpec;
+    } rateLimit;
+
+    // Device limits used to split the large requests, see xcp_io_queue_set_device_limits.
+    struct {
+      struct XcpIoSplitLimit *limits; // Sorted by fd.
+      size_t count;
+    } split;
+
+    #ifdef XCP_IO_ENABLE_STATS
+      // Statistics written by the queue thread only, see xcp_io_queue_get_stats.
+      struct {
+        XcpIoQueueStats *current;
+        XcpIoQueueStats *baseline; // Values at the last reset.
+        uint64_t completionTime; // Time of the responses being processed.
+      } stats;
+    #endif // ifdef XCP_IO_ENABLE_STATS
   } pImpl; // Private implementation, do not touch!
 } XcpIoQueue;
 
 // -----------------------------------------------------------------------------
 
+XCP_DECL_UNUSED static inline void xcp_io_queue_options_init (XcpIoQueueOptions *options, size_t capacity) {
+  options->capacity = capacity;
+  options->flags = 0;
+  options->sqThreadIdle = 0;
+  options->sqThreadCpu = -1;
+  options->maxSpinTime = 0;
+  options->parent = NULL;
+  options->maxBoundedWorkers = 0;
+  options->maxUnboundedWorkers = 0;
+  options->maxMergeSize = 0;
+}
+
 int xcp_io_queue_init (XcpIoQueue *queue, size_t capacity, bool usePolling);
+int xcp_io_queue_init_with_options (XcpIoQueue *queue, const XcpIoQueueOptions *options);
 void xcp_io_queue_uninit (XcpIoQueue *queue);
 
-void xcp_io_queue_insert (XcpIoQueue *queue, XcpIoReq *req);
+// Limit the number of async workers (io_uring_register_iowq_max_workers).
+// The limits apply to the workers of the calling thread, shared by all its queues, and to the SQPOLL thread.
+// If a value is 0, the limit is not changed. On success, bounded and unbounded contain the previous limits.
+int xcp_io_queue_set_max_workers (XcpIoQueue *queue, unsigned int *bounded, unsigned int *unbounded);
+
+// Add a request in the pending list. If req is the head of a chain, the whole chain is added.
+// A chain can't be longer than the ring, a request with a timeout uses two ring entries.
+// A data request which exceeds the limits of its fd (see xcp_io_queue_set_device_limits), IOV_MAX iovecs
+// or 4 GiB (fixed buffers) is split in child requests executed in parallel and counted in the pending
+// and inflight requests. The request is completed once all its children are completed: with the first
+// error of the children (the others may have transferred their data), or with 0. If children are short,
+// the result is the size transferred before the first short child.
+// Chains, barriers and requests using the current file position (offset -1) are never split.
+// Returns 0, or -ENOMEM if the children of a request to split can't be allocated: the request is not inserted.
+int xcp_io_queue_insert (XcpIoQueue *queue, XcpIoReq *req);
 
 int xcp_io_queue_submit (XcpIoQueue *queue);
+
+// Complete all the pending requests with -EIO, inflight requests are not affected.
+// Returns the number of canceled requests.
 int xcp_io_queue_cancel (XcpIoQueue *queue);
 
+// Cancel one request given to xcp_io_queue_insert.
+// If the request is pending, it is removed from the queue with the rest of its chain and completed
+// with -ECANCELED immediately. If it is inflight, an asynchronous cancellation is submitted: the request
+// is completed with -ECANCELED if it can be aborted, otherwise it is completed normally.
+// Returns 0, -ENOENT if the request is not in the queue, -EBUSY if the ring is full or if the request
+// is in a chain given to a scheduler (only the head can be canceled), or a negative errno.
+int xcp_io_req_cancel (XcpIoQueue *queue, XcpIoReq *req);
+
+// Submit pending requests, wait for at least minComplete responses and process them.
+// Submission and wait are done with one syscall. If timeout is NULL, there is no time limit.
+// Returns the number of processed responses or a negative errno.
+int xcp_io_queue_submit_and_wait (XcpIoQueue *queue, unsigned int minComplete, const struct timespec *timeout);
+
+// Use a scheduler to choose the pending requests that fill the free slots of the submission ring.
+// Inserted requests are given to the scheduler, and are dequeued at submission only when they can be submitted.
+// Without scheduler (NULL), the pending list is FIFO. Returns -EBUSY if the scheduler contains requests.
+int xcp_io_queue_set_scheduler (XcpIoQueue *queue, XcpIoScheduler *scheduler);
+
+// Limit the requests of a key: a tenant or a fd, see xcp_io_req_get_key. A chain is charged to the key of its head.
+// Requests over their budget wait in the queue and are submitted by the next xcp_io_queue_submit calls once
+// enough tokens are available. Without IoPoll, a timer wakes up the ring (xcp_io_queue_submit_and_wait,
+// event fd...) when throttled requests can be submitted again.
+// If limit is NULL or if it has no rate, the limit is removed: its throttled requests are pending again.
+// Returns 0, -EINVAL if a rate is too large, or -ENOMEM.
+int xcp_io_queue_set_rate_limit (XcpIoQueue *queue, uint32_t key, const XcpIoRateLimit *limit);
+
+// Split the data requests of fd (or of a registered file of fd) which exceed the limits of its device, the
+// children are aligned on the max transfer size in the file. The size of the children is the max transfer
+// size rounded down to a multiple of the optimal transfer size and of the logical block size.
+// See xcp_io_device_limits_init to get the limits of a device. If limits is NULL, the limits of fd are removed.
+// The limits are attached to the fd number, not to the file: they must be removed before closing fd, otherwise
+// the next file opened with this number uses them. Only the requests inserted after the call are affected.
+// Returns 0, -EBADF, -EINVAL if the block size is not a power of 2, or -ENOMEM.
+int xcp_io_queue_set_device_limits (XcpIoQueue *queue, int fd, const XcpIoDeviceLimits *limits);
+
+// Use one callback for all the responses of a processing cycle instead of the request callbacks.
+// It allows users to take locks or update shared state once per batch.
+// If cb is NULL, the request callbacks are used again (default behavior).
+int xcp_io_queue_set_batch_cb (XcpIoQueue *queue, XcpIoQueueBatchCb cb, void *userArg);
+
 // Must be called when a notification is received via event fd.
+// With XcpIoQueueFlagHybridPoll, it waits for at least one response if there are inflight requests.
 int xcp_io_queue_process_responses (XcpIoQueue *queue);
 
+// Submit the pending requests and process at least one response if there are inflight requests, with the wait
+// strategy of the queue: hybrid polling, xcp_io_queue_submit_and_wait without event fd, otherwise poll on the
+// event fd. Returns 0 or a negative errno.
+int xcp_io_queue_process (XcpIoQueue *queue);
+
+// Copy the statistics collected since the last reset. The library must be built with ENABLE_STATS
+// (XCP_IO_ENABLE_STATS), otherwise -ENOTSUP is returned.
+// Can be called from any thread without lock, but not concurrently with xcp_io_queue_reset_stats:
+// the values are read while the queue thread updates them, so a copy can be slightly inconsistent.
+int xcp_io_queue_get_stats (const XcpIoQueue *queue, XcpIoQueueStats *stats);
+int xcp_io_queue_reset_stats (XcpIoQueue *queue);
+
+// Allocate and register a pool of "count" buffers of "size" bytes in the ring.
+// These buffers must be used with the ReadFixed and WriteFixed opcodes, the kernel
+// maps them once instead of pinning/unpinning user pages for each request.
+// Each buffer is page aligned, so it can be used with O_DIRECT.
+int xcp_io_queue_register_buffers (XcpIoQueue *queue, size_t size, size_t count);
+void xcp_io_queue_unregister_buffers (XcpIoQueue *queue);
+
+// Get a free registered buffer, NULL is returned if there is no free buffer.
+void *xcp_io_queue_get_buffer (XcpIoQueue *queue, uint16_t *bufIndex);
+void xcp_io_queue_put_buffer (XcpIoQueue *queue, uint16_t bufIndex);
+
+// Create a sparse table of "size" registered files in the ring.
+// A request using a registered file (see xcp_io_req_set_fixed_file) avoids
+// the fd lookup and the file reference taken by the kernel for each request.
+int xcp_io_queue_register_file_table (XcpIoQueue *queue, unsigned int size);
+void xcp_io_queue_unregister_file_table (XcpIoQueue *queue);
+
+// Add a fd in the registered file table, the returned file index must be used
+// with xcp_io_req_set_fixed_file. A negative errno is returned on failure.
+int xcp_io_queue_register_file (XcpIoQueue *queue, int fd);
+
+// Remove a file from the table. The file must not be used by pending or inflight requests.
+int xcp_io_queue_unregister_file (XcpIoQueue *queue, int fileIndex);
+
 XCP_DECL_UNUSED static inline uint64_t xcp_io_queue_get_inflight_count (const XcpIoQueue *queue) {
   return queue->inflightCount;
 }
@@ -84,8 +384,48 @@ XCP_DECL_UNUSED static inline int xcp_io_queue_get_event_fd (const XcpIoQueue *q
   return queue->eventFd;
 }
 
+// The ring fd is readable when responses are available, it can be used with poll/epoll
+// instead of the event fd.
+XCP_DECL_UNUSED static inline int xcp_io_queue_get_ring_fd (const XcpIoQueue *queue) {
+  return queue->pImpl.ring.ring_fd;
+}
+
 XCP_DECL_UNUSED static inline bool xcp_io_queue_polling_enabled (const XcpIoQueue *queue) {
   return queue->usePolling;
 }
 
+XCP_DECL_UNUSED static inline bool xcp_io_queue_sq_polling_enabled (const XcpIoQueue *queue) {
+  return queue->flags & XcpIoQueueFlagSqPoll;
+}
+
+XCP_DECL_UNUSED static inline bool xcp_io_queue_hybrid_polling_enabled (const XcpIoQueue *queue) {
+  return (queue->flags & XcpIoQueueFlagHybridPoll) && !queue->usePolling;
+}
+
+// Returns true if a batch callback is set, see xcp_io_queue_set_batch_cb.
+XCP_DECL_UNUSED static inline bool xcp_io_queue_has_batch_cb (const XcpIoQueue *queue) {
+  return queue->pImpl.batch.cb;
+}
+
+// Returns true if at least one rate limit is set, see xcp_io_queue_set_rate_limit.
+XCP_DECL_UNUSED static inline bool xcp_io_queue_has_rate_limits (const XcpIoQueue *queue) {
+  return queue->pImpl.rateLimit.count;
+}
+
+XCP_DECL_UNUSED static inline const XcpIoQueueCounters *xcp_io_queue_get_counters (const XcpIoQueue *queue) {
+  return &queue->counters;
+}
+
+XCP_DECL_UNUSED static inline size_t xcp_io_queue_get_buffer_size (const XcpIoQueue *queue) {
+  return queue->pImpl.buffers.size;
+}
+
+XCP_DECL_UNUSED static inline size_t xcp_io_queue_get_free_buffer_count (const XcpIoQueue *queue) {
+  return queue->pImpl.buffers.freeCount;
+}
+
+XCP_DECL_UNUSED static inline unsigned int xcp_io_queue_get_free_file_count (const XcpIoQueue *queue) {
+  return queue->pImpl.files.freeCount;
+}
+
 #endif // ifndef _XCP_NG_ASYNC_IO_IO_QUEUE_H_
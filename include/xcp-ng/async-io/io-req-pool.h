@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_ASYNC_IO_IO_REQ_POOL_H_
+#define _XCP_NG_ASYNC_IO_IO_REQ_POOL_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xcp-ng/async-io/io-req.h"
+
+// =============================================================================
+
+// Alignment of the data slots, compatible with O_DIRECT.
+#define XCP_IO_REQ_POOL_DATA_ALIGNMENT 4096
+
+// Alignment of the request headers.
+#define XCP_IO_REQ_POOL_REQ_ALIGNMENT 64
+
+typedef enum {
+  // Use huge pages to back the pool if possible, transparent huge pages otherwise.
+  XcpIoReqPoolFlagHugePages = 1 << 0
+} XcpIoReqPoolFlag;
+
+// Pool of preallocated requests, each request is associated to a data slot.
+// All the memory is allocated and faulted at init, get and put are O(1) and lock-free,
+// so they can be called from any thread.
+typedef struct XcpIoReqPool {
+  // Number of requests.
+  size_t count;
+
+  // Size of the data slot of each request, can be 0.
+  size_t dataSize;
+
+  struct {
+    void *arena;
+    size_t arenaSize;
+
+    char *reqs;
+    size_t reqStride;
+
+    char *data;
+    size_t dataStride;
+
+    // Free list: 32 bits tag (ABA protection) | 32 bits index + 1 of the first free request.
+    _Atomic uint64_t freeHead;
+    _Atomic uint32_t *nextFree;
+  } pImpl; // Private implementation, do not touch!
+} XcpIoReqPool;
+
+// -----------------------------------------------------------------------------
+
+int xcp_io_req_pool_init (XcpIoReqPool *pool, size_t count, size_t dataSize, unsigned int flags);
+void xcp_io_req_pool_uninit (XcpIoReqPool *pool);
+
+// Get a free request, NULL is returned if the pool is empty.
+XcpIoReq *xcp_io_req_pool_get (XcpIoReqPool *pool);
+
+// Give back a request obtained with xcp_io_req_pool_get.
+void xcp_io_req_pool_put (XcpIoReqPool *pool, XcpIoReq *req);
+
+XCP_DECL_UNUSED static inline size_t xcp_io_req_pool_get_index (const XcpIoReqPool *pool, const XcpIoReq *req) {
+  assert((const char *)req >= pool->pImpl.reqs);
+  const size_t index = (size_t)((const char *)req - pool->pImpl.reqs) / pool->pImpl.reqStride;
+  assert(index < pool->count);
+  return index;
+}
+
+// Get the data slot of a request, aligned on XCP_IO_REQ_POOL_DATA_ALIGNMENT.
+XCP_DECL_UNUSED static inline void *xcp_io_req_pool_get_data (const XcpIoReqPool *pool, const XcpIoReq *req) {
+  assert(pool->dataSize);
+  return pool->pImpl.data + xcp_io_req_pool_get_index(pool, req) * pool->pImpl.dataStride;
+}
+
+#endif // ifndef _XCP_NG_ASYNC_IO_IO_REQ_POOL_H_
@@ -18,11 +18,14 @@
 #define _XCP_NG_ASYNC_IO_IO_REQ_H_
 
 #include <assert.h>
+#include <linux/falloc.h>
+#include <linux/time_types.h>
 #include <stdint.h>
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 
+#include "xcp-ng/async-io/io-checksum.h"
 #include "xcp-ng/async-io/io-global.h"
 
 // =============================================================================
@@ -31,18 +34,78 @@ typedef enum {
   XcpIoOpcodeRead = 1 << 0,
   XcpIoOpcodeWrite = 1 << 1,
   XcpIoOpcodeReadV = 1 << 2,
-  XcpIoOpcodeWriteV = 1 << 3
+  XcpIoOpcodeWriteV = 1 << 3,
+  XcpIoOpcodeReadFixed = 1 << 4,
+  XcpIoOpcodeWriteFixed = 1 << 5,
+  XcpIoOpcodeFsync = 1 << 6,
+  XcpIoOpcodeFdatasync = 1 << 7,
+  XcpIoOpcodeSyncFileRange = 1 << 8,
+  XcpIoOpcodePoll = 1 << 9,
+  XcpIoOpcodeSplice = 1 << 10,
+  XcpIoOpcodeFallocate = 1 << 11
 } XcpIoOpcode;
 
+#define XCP_IO_OPCODE_COUNT 12
+
+// Returns the index of an opcode, between 0 and XCP_IO_OPCODE_COUNT - 1.
+XCP_DECL_UNUSED static inline unsigned int xcp_io_opcode_get_index (XcpIoOpcode opcode) {
+  return (unsigned int)__builtin_ctz((unsigned int)opcode);
+}
+
 XCP_DECL_UNUSED static inline const char *xcp_io_opcode_to_str (XcpIoOpcode opcode) {
   switch (opcode) {
     case XcpIoOpcodeRead: return "read";
     case XcpIoOpcodeWrite: return "write";
     case XcpIoOpcodeReadV: return "readv";
     case XcpIoOpcodeWriteV: return "writev";
+    case XcpIoOpcodeReadFixed: return "read-fixed";
+    case XcpIoOpcodeWriteFixed: return "write-fixed";
+    case XcpIoOpcodeFsync: return "fsync";
+    case XcpIoOpcodeFdatasync: return "fdatasync";
+    case XcpIoOpcodeSyncFileRange: return "sync-file-range";
+    case XcpIoOpcodePoll: return "poll";
+    case XcpIoOpcodeSplice: return "splice";
+    case XcpIoOpcodeFallocate: return "fallocate";
   }
+  return "unknown";
+}
+
+// Returns true if the opcode transfers data: in this case the result is the transferred size.
+XCP_DECL_UNUSED static inline bool xcp_io_opcode_has_data (XcpIoOpcode opcode) {
+  return opcode & (
+    XcpIoOpcodeRead | XcpIoOpcodeWrite |
+    XcpIoOpcodeReadV | XcpIoOpcodeWriteV |
+    XcpIoOpcodeReadFixed | XcpIoOpcodeWriteFixed
+  );
 }
 
+typedef enum {
+  // The fd field is an index in the registered file table of the queue.
+  // See: xcp_io_queue_register_file.
+  XcpIoReqFlagFixedFile = 1 << 0,
+
+  // The next request of the chain is executed only after the completion of this one.
+  // See: xcp_io_req_link.
+  XcpIoReqFlagLink = 1 << 1,
+  XcpIoReqFlagHardLink = 1 << 2,
+
+  // The request starts only when all the previous requests of the queue are completed,
+  // and the next requests start only when it is completed (IOSQE_IO_DRAIN).
+  // Note: To order requests on one fd without stalling the whole queue, prefer xcp_io_req_link.
+  XcpIoReqFlagBarrier = 1 << 3
+} XcpIoReqFlag;
+
+// I/O priority classes, see ioprio_set(2).
+typedef enum {
+  XcpIoPrioClassNone = 0,
+  XcpIoPrioClassRealTime = 1,
+  XcpIoPrioClassBestEffort = 2,
+  XcpIoPrioClassIdle = 3
+} XcpIoPrioClass;
+
+#define XCP_IO_PRIO_CLASS_SHIFT 13
+#define XCP_IO_PRIO_LEVEL_COUNT 8
+
 // -----------------------------------------------------------------------------
 
 typedef struct XcpIoReq XcpIoReq;
@@ -55,14 +118,77 @@ typedef struct XcpIoReq {
 
   XcpIoOpcode opcode;
   int fd;
+  uint8_t flags; // Combination of XcpIoReqFlag values.
 
-  // If opcode is either Read or Write, this field contains the addr buf and the buf size.
+  // If opcode is either Read, Write, ReadFixed or WriteFixed, this field contains the addr buf and the buf size.
   // Otherwise (ReadV or WriteV), it contains an iovec and the iovec length.
   struct iovec iov;
   off_t offset;
 
+  // Index of the registered buffer containing iov, only used by ReadFixed and WriteFixed.
+  // See: xcp_io_queue_register_buffers.
+  uint16_t bufIndex;
+
+  // Opcode specific flags: sync_file_range flags for SyncFileRange, poll events for Poll,
+  // splice flags for Splice, mode for Fallocate.
+  uint32_t opFlags;
+
+  // Source of a Splice request, the destination is fd/offset.
+  int inFd;
+  off_t inOffset;
+
+  // Max execution time in microseconds once submitted, 0 means no timeout.
+  // See: xcp_io_req_set_timeout.
+  uint64_t timeout;
+
+  // I/O priority given to the kernel: class and level (0 is the highest), see xcp_io_req_set_priority.
+  // Also used by the queue scheduler (if any) to order requests.
+  uint16_t ioprio;
+
+  // Key used by the queue scheduler and rate limits (if any) to identify tenants (like VDIs).
+  // If 0, the fd is used. See xcp_io_req_get_key.
+  uint32_t tenant;
+
+  // Hash of the buffer computed by the queue when the request succeeds (XcpIoChecksum value).
+  // See: xcp_io_req_set_checksum.
+  uint8_t checksum;
+
+  // Check if the buffer only contains zeros when the request succeeds, see xcp_io_req_set_zero_check.
+  bool zeroCheck;
+
   struct {
     STAILQ_ENTRY(XcpIoReq) next; // Next request to schedule.
+    XcpIoReq *link; // Next request of the chain.
+
+    struct __kernel_timespec timeoutSpec; // Read by the kernel at submission.
+    int res; // Result of the request, valid when all the CQEs are received.
+
+    // Short transfer continuation: size transferred by the previous submissions, index of the first iovec
+    // not fully transferred (ReadV and WriteV) and rest of this iovec if it's partially transferred.
+    // The iovecs of the request are never modified, they can be shared.
+    size_t transferred;
+    uint32_t iovIndex;
+    struct iovec partialIov;
+
+    XcpIoReq *group; // Merged request containing this request, see XcpIoQueueFlagMerge.
+
+    // Split of this request in child requests, or split containing this request (child).
+    // See: xcp_io_queue_set_device_limits.
+    struct XcpIoSplit *split;
+
+    uint64_t hash; // Result of the checksum, valid in the completion callback.
+    bool isZero; // Result of the zero check, valid in the completion callback.
+
+    uint64_t schedTag; // Scheduler specific value.
+
+    #ifdef XCP_IO_ENABLE_STATS
+      // Monotonic times in nanoseconds, submitTime is 0 before the first submission.
+      uint64_t insertTime;
+      uint64_t submitTime;
+    #endif // ifdef XCP_IO_ENABLE_STATS
+
+    uint8_t cqeCount; // Number of CQEs to receive before the completion.
+    uint8_t state;
   } pImpl; // Private implementation, do not touch!
 } XcpIoReq;
 
@@ -71,11 +197,153 @@ XCP_DECL_UNUSED static inline void xcp_io_req_prep_rw (
 ) {
   req->opcode = opcode;
   req->fd = fd;
+  req->flags = 0;
+  req->timeout = 0;
+  req->ioprio = 0;
+  req->tenant = 0;
+  req->checksum = XcpIoChecksumNone;
+  req->zeroCheck = false;
+  req->pImpl.link = NULL;
+  req->pImpl.group = NULL;
+  req->pImpl.split = NULL;
   req->iov.iov_base = addr;
   req->iov.iov_len = len;
   req->offset = offset;
 }
 
+// Prepare a request using a buffer given by xcp_io_queue_get_buffer.
+// The [addr, addr + len[ range must be contained in this buffer.
+XCP_DECL_UNUSED static inline void xcp_io_req_prep_rw_fixed (
+  XcpIoReq *req, XcpIoOpcode opcode, int fd, void *addr, size_t len, off_t offset, uint16_t bufIndex
+) {
+  assert(opcode == XcpIoOpcodeReadFixed || opcode == XcpIoOpcodeWriteFixed);
+  xcp_io_req_prep_rw(req, opcode, fd, addr, len, offset);
+  req->bufIndex = bufIndex;
+}
+
+// Prepare a Fsync request, or a Fdatasync request if dataOnly is true.
+XCP_DECL_UNUSED static inline void xcp_io_req_prep_fsync (XcpIoReq *req, int fd, bool dataOnly) {
+  xcp_io_req_prep_rw(req, dataOnly ? XcpIoOpcodeFdatasync : XcpIoOpcodeFsync, fd, NULL, 0, 0);
+}
+
+// Prepare a SyncFileRange request, see sync_file_range(2) for the flags.
+XCP_DECL_UNUSED static inline void xcp_io_req_prep_sync_file_range (
+  XcpIoReq *req, int fd, off_t offset, size_t len, uint32_t flags
+) {
+  xcp_io_req_prep_rw(req, XcpIoOpcodeSyncFileRange, fd, NULL, len, offset);
+  req->opFlags = flags;
+}
+
+// Prepare a Poll request completed when one of the given poll(2) events is available on fd.
+XCP_DECL_UNUSED static inline void xcp_io_req_prep_poll (XcpIoReq *req, int fd, uint32_t events) {
+  xcp_io_req_prep_rw(req, XcpIoOpcodePoll, fd, NULL, 0, 0);
+  req->opFlags = events;
+}
+
+// Prepare a Splice request moving len bytes from inFd to fd, one of them must be a pipe.
+// The offset of a pipe must be -1. If inFd is a registered file, SPLICE_F_FD_IN_FIXED must be in flags.
+// A Splice request is not continued after a short transfer: the moved size is given by xcp_io_req_get_result.
+XCP_DECL_UNUSED static inline void xcp_io_req_prep_splice (
+  XcpIoReq *req, int inFd, off_t inOffset, int fd, off_t offset, size_t len, uint32_t flags
+) {
+  xcp_io_req_prep_rw(req, XcpIoOpcodeSplice, fd, NULL, len, offset);
+  req->inFd = inFd;
+  req->inOffset = inOffset;
+  req->opFlags = flags;
+}
+
+// Prepare a Fallocate request, see fallocate(2) for the modes.
+XCP_DECL_UNUSED static inline void xcp_io_req_prep_fallocate (
+  XcpIoReq *req, int fd, uint32_t mode, off_t offset, size_t len
+) {
+  xcp_io_req_prep_rw(req, XcpIoOpcodeFallocate, fd, NULL, len, offset);
+  req->opFlags = mode;
+}
+
+// Deallocate a range, the file size is not changed. A regular file gets a hole. A block device zeroes
+// the range with write zeroes commands (the device may unmap it), without fallback: -EOPNOTSUPP is returned
+// if the device doesn't support them.
+XCP_DECL_UNUSED static inline void xcp_io_req_prep_discard (XcpIoReq *req, int fd, off_t offset, size_t len) {
+  xcp_io_req_prep_fallocate(req, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+// Zero a range without transferring data, the file size is not changed. A regular file keeps its
+// blocks allocated, a block device uses write zeroes commands (or writes zero pages if not supported).
+XCP_DECL_UNUSED static inline void xcp_io_req_prep_write_zeroes (XcpIoReq *req, int fd, off_t offset, size_t len) {
+  xcp_io_req_prep_fallocate(req, fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+// Mark a request as a barrier, see XcpIoReqFlagBarrier.
+// Must be called after the prep functions.
+XCP_DECL_UNUSED static inline void xcp_io_req_set_barrier (XcpIoReq *req) {
+  req->flags |= XcpIoReqFlagBarrier;
+}
+
+// Use a file registered with xcp_io_queue_register_file instead of a fd.
+// Must be called after the prep functions.
+XCP_DECL_UNUSED static inline void xcp_io_req_set_fixed_file (XcpIoReq *req, int fileIndex) {
+  req->fd = fileIndex;
+  req->flags |= XcpIoReqFlagFixedFile;
+}
+
+// Set the I/O priority class and level (0 to XCP_IO_PRIO_LEVEL_COUNT - 1, 0 is the highest).
+// Must be called after the prep functions.
+XCP_DECL_UNUSED static inline void xcp_io_req_set_priority (
+  XcpIoReq *req, XcpIoPrioClass prioClass, unsigned int level
+) {
+  assert(level < XCP_IO_PRIO_LEVEL_COUNT);
+  req->ioprio = (uint16_t)(((unsigned int)prioClass << XCP_IO_PRIO_CLASS_SHIFT) | level);
+}
+
+XCP_DECL_UNUSED static inline XcpIoPrioClass xcp_io_req_get_priority_class (const XcpIoReq *req) {
+  return (XcpIoPrioClass)(req->ioprio >> XCP_IO_PRIO_CLASS_SHIFT);
+}
+
+// Must be called after the prep functions.
+XCP_DECL_UNUSED static inline void xcp_io_req_set_tenant (XcpIoReq *req, uint32_t tenant) {
+  req->tenant = tenant;
+}
+
+// Hash the buffer when the request succeeds, before the completion callback: the data of a read
+// is hashed while it's still in the CPU cache. Only valid for Read, Write, ReadFixed and WriteFixed.
+// Must be called after the prep functions.
+XCP_DECL_UNUSED static inline void xcp_io_req_set_checksum (XcpIoReq *req, XcpIoChecksum checksum) {
+  assert(req->opcode & (XcpIoOpcodeRead | XcpIoOpcodeWrite | XcpIoOpcodeReadFixed | XcpIoOpcodeWriteFixed));
+  req->checksum = (uint8_t)checksum;
+}
+
+// Check if the buffer only contains zeros when the request succeeds, before the completion callback,
+// like xcp_io_req_set_checksum. Only valid for Read, Write, ReadFixed and WriteFixed.
+// Must be called after the prep functions.
+XCP_DECL_UNUSED static inline void xcp_io_req_set_zero_check (XcpIoReq *req) {
+  assert(req->opcode & (XcpIoOpcodeRead | XcpIoOpcodeWrite | XcpIoOpcodeReadFixed | XcpIoOpcodeWriteFixed));
+  req->zeroCheck = true;
+}
+
+// Returns the key used to classify a request by the scheduler and the rate limits of a queue:
+// the tenant, or the fd if the tenant is 0.
+XCP_DECL_UNUSED static inline uint32_t xcp_io_req_get_key (const XcpIoReq *req) {
+  return req->tenant ? req->tenant : (uint32_t)req->fd;
+}
+
+// Cancel the request if it is not completed after timeout microseconds in the kernel.
+// If a short transfer is continued by the queue, the timeout is restarted.
+// In this case the completion callback receives -ETIMEDOUT, the next requests of the chain (if any)
+// are canceled with -ECANCELED. Not supported with XcpIoQueueFlagIoPoll.
+// Must be called after the prep functions.
+XCP_DECL_UNUSED static inline void xcp_io_req_set_timeout (XcpIoReq *req, uint64_t timeout) {
+  req->timeout = timeout;
+}
+
+// Execute next only after the completion of req, in the kernel, without user/kernel round trip.
+// If req fails (a short transfer is a failure and is not continued), next and the rest of the chain are canceled with
+// -ECANCELED, unless hard is true: in this case next is executed regardless of the result of req.
+// Only the chain head must be given to xcp_io_queue_insert. Must be called after the prep functions.
+XCP_DECL_UNUSED static inline void xcp_io_req_link (XcpIoReq *req, XcpIoReq *next, bool hard) {
+  req->flags |= hard ? XcpIoReqFlagHardLink : XcpIoReqFlagLink;
+  req->pImpl.link = next;
+}
+
 XCP_DECL_UNUSED static inline void xcp_io_req_set_cb (XcpIoReq *req, XcpIoReqCb cb) {
   req->cb = cb;
 }
@@ -84,34 +352,45 @@ XCP_DECL_UNUSED static inline void xcp_io_req_set_user_data (XcpIoReq *req, void
   req->userData = userData;
 }
 
+// Returns the result given by the kernel for the last execution of a request: the moved size of a Splice,
+// the events of a Poll... Only valid in the completion callback. After a short transfer which can't be
+// continued (-EIO, like a read at the end of a file), it's the transferred size.
+XCP_DECL_UNUSED static inline int xcp_io_req_get_result (const XcpIoReq *req) {
+  return req->pImpl.res;
+}
+
+// Returns the hash of the buffer, see xcp_io_req_set_checksum. Only valid in the completion callback.
+XCP_DECL_UNUSED static inline uint64_t xcp_io_req_get_hash (const XcpIoReq *req) {
+  return req->pImpl.hash;
+}
+
+// Returns true if the buffer only contains zeros, see xcp_io_req_set_zero_check. Only valid in the completion callback.
+XCP_DECL_UNUSED static inline bool xcp_io_req_is_zero (const XcpIoReq *req) {
+  return req->pImpl.isZero;
+}
+
 XCP_DECL_UNUSED static inline void *xcp_io_req_get_addr (const XcpIoReq *req) {
-  const uint8_t opcode = req->opcode;
-  XCP_UNUSED(opcode);
-  assert(
-    opcode == XcpIoOpcodeRead ||
-    opcode == XcpIoOpcodeWrite ||
-    opcode == XcpIoOpcodeReadV ||
-    opcode == XcpIoOpcodeWriteV
-  );
+  assert(xcp_io_opcode_has_data(req->opcode));
   return req->iov.iov_base;
 }
 
 XCP_DECL_UNUSED static inline off_t xcp_io_req_get_offset (const XcpIoReq *req) {
-  const uint8_t opcode = req->opcode;
-  XCP_UNUSED(opcode);
   assert(
-    opcode == XcpIoOpcodeRead ||
-    opcode == XcpIoOpcodeWrite ||
-    opcode == XcpIoOpcodeReadV ||
-    opcode == XcpIoOpcodeWriteV
+    xcp_io_opcode_has_data(req->opcode) ||
+    (req->opcode & (XcpIoOpcodeSyncFileRange | XcpIoOpcodeSplice | XcpIoOpcodeFallocate))
   );
   return req->offset;
 }
 
+// Returns the size to transfer (or to allocate), only valid for the opcodes with data, Splice and Fallocate.
 XCP_DECL_UNUSED static inline size_t xcp_io_req_get_size (const XcpIoReq *req) {
   switch (req->opcode) {
     case XcpIoOpcodeRead:
     case XcpIoOpcodeWrite:
+    case XcpIoOpcodeReadFixed:
+    case XcpIoOpcodeWriteFixed:
+    case XcpIoOpcodeSplice:
+    case XcpIoOpcodeFallocate:
       return req->iov.iov_len;
 
     case XcpIoOpcodeReadV:
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_ASYNC_IO_IO_SCHEDULER_H_
+#define _XCP_NG_ASYNC_IO_IO_SCHEDULER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xcp-ng/async-io/io-req.h"
+
+// =============================================================================
+
+typedef struct XcpIoScheduler XcpIoScheduler;
+
+// A scheduler orders the pending requests of a queue, see xcp_io_queue_set_scheduler.
+// The queue gives only single requests or chain heads: a chain is scheduled as one request.
+// Requests can be linked with pImpl.next and can use pImpl.schedTag while they are in the scheduler.
+typedef struct XcpIoSchedulerOps {
+  void (*enqueue)(XcpIoScheduler *scheduler, XcpIoReq *req);
+
+  // Returns the next request to submit, or NULL if the scheduler is empty.
+  XcpIoReq *(*dequeue)(XcpIoScheduler *scheduler);
+
+  // Remove a request given to enqueue, returns false if the request is not in the scheduler.
+  bool (*remove)(XcpIoScheduler *scheduler, XcpIoReq *req);
+} XcpIoSchedulerOps;
+
+struct XcpIoScheduler {
+  const XcpIoSchedulerOps *ops;
+};
+
+// -----------------------------------------------------------------------------
+
+#define XCP_IO_WFQ_DEFAULT_WEIGHT 100
+
+// Weighted fair queueing scheduler (start-time fair queueing).
+// Requests are classified in flows using their tenant, or their fd if the tenant is 0. The bandwidth is
+// shared between the active flows proportionally to their weight, each request costs its size.
+// Priority classes are strict: real-time requests are dequeued first, idle requests last. In each class,
+// the priority level weights the cost of the request.
+// There is a fixed number of flows: two keys with the same hash share the same flow.
+typedef struct XcpIoWfqScheduler {
+  XcpIoScheduler base;
+
+  struct {
+    struct XcpIoWfqFlow *flows;
+    unsigned int flowCount; // Power of 2.
+
+    // Min-heap of the flows containing requests, ordered by class and start tag of their first request.
+    unsigned int *heap;
+    unsigned int heapSize;
+
+    // Virtual time: start tag of the last dequeued request.
+    uint64_t virtualTime;
+  } pImpl; // Private implementation, do not touch!
+} XcpIoWfqScheduler;
+
+// Init a scheduler with at least flowCount flows.
+int xcp_io_wfq_scheduler_init (XcpIoWfqScheduler *scheduler, unsigned int flowCount);
+void xcp_io_wfq_scheduler_uninit (XcpIoWfqScheduler *scheduler);
+
+// Set the weight of the flow of a key (tenant or fd). Must not be 0.
+void xcp_io_wfq_scheduler_set_weight (XcpIoWfqScheduler *scheduler, uint32_t key, unsigned int weight);
+
+XCP_DECL_UNUSED static inline XcpIoScheduler *xcp_io_wfq_scheduler_get_base (XcpIoWfqScheduler *scheduler) {
+  return &scheduler->base;
+}
+
+#endif // ifndef _XCP_NG_ASYNC_IO_IO_SCHEDULER_H_
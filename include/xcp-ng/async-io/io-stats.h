@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_ASYNC_IO_IO_STATS_H_
+#define _XCP_NG_ASYNC_IO_IO_STATS_H_
+
+#include <stdint.h>
+
+#include "xcp-ng/async-io/io-global.h"
+#include "xcp-ng/async-io/io-req.h"
+
+// =============================================================================
+
+// Log-linear histogram (like HDR histograms): each power of 2 is split in 2^XCP_IO_HISTOGRAM_SUB_BUCKET_BITS
+// linear buckets, so the relative error of a value is at most 12.5%. Values lower than 16 are exact,
+// values greater than or equal to 2^XCP_IO_HISTOGRAM_MAX_BITS are stored in the last bucket.
+#define XCP_IO_HISTOGRAM_SUB_BUCKET_BITS 3
+#define XCP_IO_HISTOGRAM_MAX_BITS 40
+#define XCP_IO_HISTOGRAM_BUCKET_COUNT \
+  ((XCP_IO_HISTOGRAM_MAX_BITS - XCP_IO_HISTOGRAM_SUB_BUCKET_BITS + 1) << XCP_IO_HISTOGRAM_SUB_BUCKET_BITS)
+
+typedef struct XcpIoHistogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t buckets[XCP_IO_HISTOGRAM_BUCKET_COUNT];
+} XcpIoHistogram;
+
+XCP_DECL_UNUSED static inline unsigned int xcp_io_histogram_get_bucket_index (uint64_t value) {
+  if (XCP_UNLIKELY(value >> XCP_IO_HISTOGRAM_MAX_BITS))
+    value = (UINT64_C(1) << XCP_IO_HISTOGRAM_MAX_BITS) - 1;
+  if (value < (2u << XCP_IO_HISTOGRAM_SUB_BUCKET_BITS))
+    return (unsigned int)value;
+
+  const unsigned int shift = 63u - (unsigned int)__builtin_clzll(value) - XCP_IO_HISTOGRAM_SUB_BUCKET_BITS;
+  return (shift << XCP_IO_HISTOGRAM_SUB_BUCKET_BITS) + (unsigned int)(value >> shift);
+}
+
+// Record a value, not thread safe.
+XCP_DECL_UNUSED static inline void xcp_io_histogram_record (XcpIoHistogram *histogram, uint64_t value) {
+  ++histogram->count;
+  histogram->sum += value;
+  ++histogram->buckets[xcp_io_histogram_get_bucket_index(value)];
+}
+
+// Returns the highest value of a bucket.
+uint64_t xcp_io_histogram_get_bucket_max (unsigned int index);
+
+// Returns the value below which the given percentage (0 to 100) of the values fall, rounded up to the
+// highest value of its bucket. Returns 0 if the histogram is empty.
+uint64_t xcp_io_histogram_get_percentile (const XcpIoHistogram *histogram, double percentile);
+
+XCP_DECL_UNUSED static inline uint64_t xcp_io_histogram_get_mean (const XcpIoHistogram *histogram) {
+  return histogram->count ? histogram->sum / histogram->count : 0;
+}
+
+void xcp_io_histogram_reset (XcpIoHistogram *histogram);
+
+// Add the values of src in dst.
+void xcp_io_histogram_merge (XcpIoHistogram *dst, const XcpIoHistogram *src);
+
+// -----------------------------------------------------------------------------
+
+// Statistics of one opcode, all times are in nanoseconds.
+typedef struct XcpIoOpStats {
+  // Number of completed requests, failed requests (including cancellations) and bytes transferred.
+  uint64_t count;
+  uint64_t errors;
+  uint64_t bytes;
+
+  // Number of short reads/writes continued by the queue.
+  uint64_t shortTransfers;
+
+  // Time between the insertion and the first submission (wait in the pending list, scheduler, rate limits).
+  XcpIoHistogram queueTime;
+
+  // Time between the first submission and the completion (kernel and device time).
+  XcpIoHistogram serviceTime;
+} XcpIoOpStats;
+
+// Number of fds with their own statistics in a queue, the last slot gathers the other fds.
+#define XCP_IO_STATS_FD_COUNT 16
+
+typedef struct XcpIoFdStats {
+  // Fd (or registered file index) of the slot, -1 for the last slot or an unused slot.
+  int fd;
+
+  uint64_t count;
+  uint64_t errors;
+  uint64_t bytes;
+  XcpIoHistogram serviceTime;
+} XcpIoFdStats;
+
+// Statistics of a queue, see xcp_io_queue_get_stats.
+typedef struct XcpIoQueueStats {
+  // Indexed by xcp_io_opcode_get_index.
+  XcpIoOpStats ops[XCP_IO_OPCODE_COUNT];
+
+  // Slots are given to the fds in order of first completion, they are never released.
+  XcpIoFdStats fds[XCP_IO_STATS_FD_COUNT];
+
+  // Number of requests moved in the submission ring by each submission.
+  XcpIoHistogram batchSizes;
+} XcpIoQueueStats;
+
+#endif // ifndef _XCP_NG_ASYNC_IO_IO_STATS_H_
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_ASYNC_IO_IO_WRITE_COMBINER_H_
+#define _XCP_NG_ASYNC_IO_IO_WRITE_COMBINER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include "xcp-ng/async-io/io-queue.h"
+#include "xcp-ng/async-io/io-req.h"
+
+// =============================================================================
+
+#define XCP_IO_WRITE_COMBINER_DEFAULT_EXTENT_SIZE (256 * 1024)
+#define XCP_IO_WRITE_COMBINER_DEFAULT_EXTENT_COUNT 16
+#define XCP_IO_WRITE_COMBINER_DEFAULT_SECTOR_SIZE 4096
+#define XCP_IO_WRITE_COMBINER_DEFAULT_MAX_FLUSH_SIZE (1024 * 1024)
+#define XCP_IO_WRITE_COMBINER_DEFAULT_MAX_AGE 1000
+
+typedef struct XcpIoWriteCombinerOptions {
+  // Size of the staging extents, a multiple of sectorSize and of XCP_IO_REQ_POOL_DATA_ALIGNMENT.
+  // The extents are aligned on this size in the file. Smaller writes are staged, larger ones are given to the queue.
+  size_t extentSize;
+
+  // Number of staging extents, the memory used is extentCount * extentSize.
+  size_t extentCount;
+
+  // Unit of the flushes, a power of 2 between 512 and XCP_IO_REQ_POOL_DATA_ALIGNMENT: use at least the logical
+  // block size of the device with O_DIRECT. A staged write which covers a sector partially reads it first.
+  size_t sectorSize;
+
+  // Max size in bytes of a flush write, contiguous dirty sectors of adjacent extents are written with one WriteV.
+  size_t maxFlushSize;
+
+  // Max time in microseconds between the first staged write of an extent and its flush,
+  // see xcp_io_write_combiner_flush_expired. If 0, the extents are flushed only when they are full,
+  // when their memory is needed, or by a sync.
+  uint64_t maxAge;
+} XcpIoWriteCombinerOptions;
+
+typedef struct XcpIoWriteCombinerCounters {
+  // Writes copied in the extents and writes given to the queue.
+  uint64_t stagedWrites;
+  uint64_t directWrites;
+
+  // Sectors read to complete a partial write.
+  uint64_t readModifyWrites;
+
+  // Writes submitted to flush the extents, and their size in bytes.
+  uint64_t flushes;
+  uint64_t flushedBytes;
+
+  // Requests which waited for a flush, a sector read or a free extent.
+  uint64_t blockedRequests;
+} XcpIoWriteCombinerCounters;
+
+// Write-back staging of the small writes of one fd, in front of a queue. Staged writes are completed as soon as they
+// are copied, and are written later by large aligned writes: flush errors are reported by the next sync.
+// Not thread safe, must be used by the thread processing the queue.
+typedef struct XcpIoWriteCombiner {
+  XcpIoQueue *queue;
+  int fd;
+
+  size_t extentSize;
+  size_t sectorSize;
+  size_t maxFlushSize;
+  uint64_t maxAge;
+
+  // The fd uses O_DIRECT: the writes which are not staged must be aligned on sectorSize.
+  bool directIo;
+
+  XcpIoWriteCombinerCounters counters;
+
+  struct {
+    struct XcpIoWriteCombinerExtent *extents;
+    size_t extentCount;
+    size_t usedCount; // Number of extents not in the free list.
+    char *arena;
+    uint64_t *bitmaps;
+
+    struct XcpIoWriteCombinerExtent **buckets;
+    size_t bucketMask;
+
+    TAILQ_HEAD(, XcpIoWriteCombinerExtent) freeExtents;
+    TAILQ_HEAD(, XcpIoWriteCombinerExtent) dirtyExtents; // Idle dirty extents, the first one is the oldest.
+
+    // Extents of the flush being prepared.
+    struct XcpIoWriteCombinerExtent **batch;
+    struct iovec *iovs;
+
+    // Requests waiting for a flush, a sector read or a free extent, processed in order.
+    STAILQ_HEAD(, XcpIoReq) blocked;
+    bool replaying;
+
+    // Writes given to the queue, the staged writes can't overlap them.
+    TAILQ_HEAD(, XcpIoWriteCombinerWrite) directWrites;
+
+    // Logical size of the file, the flushes don't write past it (unless O_DIRECT is used).
+    uint64_t fileSize;
+
+    // First error of the flushes since the last sync.
+    int flushError;
+  } pImpl; // Private implementation, do not touch!
+} XcpIoWriteCombiner;
+
+// -----------------------------------------------------------------------------
+
+XCP_DECL_UNUSED static inline void xcp_io_write_combiner_options_init (XcpIoWriteCombinerOptions *options) {
+  options->extentSize = XCP_IO_WRITE_COMBINER_DEFAULT_EXTENT_SIZE;
+  options->extentCount = XCP_IO_WRITE_COMBINER_DEFAULT_EXTENT_COUNT;
+  options->sectorSize = XCP_IO_WRITE_COMBINER_DEFAULT_SECTOR_SIZE;
+  options->maxFlushSize = XCP_IO_WRITE_COMBINER_DEFAULT_MAX_FLUSH_SIZE;
+  options->maxAge = XCP_IO_WRITE_COMBINER_DEFAULT_MAX_AGE;
+}
+
+// The file must not be modified by other means while the combiner is used.
+int xcp_io_write_combiner_init (
+  XcpIoWriteCombiner *combiner, XcpIoQueue *queue, int fd, const XcpIoWriteCombinerOptions *options
+);
+
+// The combiner must be empty, see xcp_io_write_combiner_is_empty.
+void xcp_io_write_combiner_uninit (XcpIoWriteCombiner *combiner);
+
+// Replacement of xcp_io_queue_insert for the requests of the queue, only the requests of fd are processed:
+// - A Write, WriteV or WriteFixed smaller than an extent is staged: its callback is called when its data is copied,
+//   before the function returns, or after the read of its partial sectors.
+// - The other writes of fd are given to the queue after the flush of the staged data of their range. With O_DIRECT,
+//   they must be aligned on the sector size, otherwise they fail with -EINVAL.
+// - A read is given to the queue after the flush of the staged data of its range.
+// - Fsync, Fdatasync, SyncFileRange, chains and barriers are given to the queue after the flush of all the extents.
+//   Fsync and Fdatasync fail with the first flush error since the previous sync, if any.
+// Requests which have to wait are processed later in insertion order, by the completions of the queue.
+void xcp_io_write_combiner_insert (XcpIoWriteCombiner *combiner, XcpIoReq *req);
+
+// Flush all the dirty extents which are not being read.
+void xcp_io_write_combiner_flush (XcpIoWriteCombiner *combiner);
+
+// Flush the extents dirty for at least maxAge, must be called regularly (also done by xcp_io_write_combiner_insert).
+// Returns the time in microseconds before the next expiration, or UINT64_MAX if no extent is dirty.
+uint64_t xcp_io_write_combiner_flush_expired (XcpIoWriteCombiner *combiner);
+
+// Returns true if no data is staged and no request is waiting or being written.
+XCP_DECL_UNUSED static inline bool xcp_io_write_combiner_is_empty (const XcpIoWriteCombiner *combiner) {
+  return !combiner->pImpl.usedCount &&
+    STAILQ_EMPTY(&combiner->pImpl.blocked) &&
+    TAILQ_EMPTY(&combiner->pImpl.directWrites);
+}
+
+XCP_DECL_UNUSED static inline const XcpIoWriteCombinerCounters *xcp_io_write_combiner_get_counters (
+  const XcpIoWriteCombiner *combiner
+) {
+  return &combiner->counters;
+}
+
+#endif // ifndef _XCP_NG_ASYNC_IO_IO_WRITE_COMBINER_H_
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_ASYNC_IO_IO_ZERO_H_
+#define _XCP_NG_ASYNC_IO_IO_ZERO_H_
+
+#include <stddef.h>
+
+#include "xcp-ng/async-io/io-global.h"
+
+// =============================================================================
+
+// Returns true if the size bytes of buf are zeros. The best implementation for the CPU is chosen at the
+// first call: AVX2 or SSE2 on x86-64, NEON on AArch64, a portable version otherwise.
+// Non-zero buffers usually return after the first bytes.
+bool xcp_io_is_zero_buffer (const void *buf, size_t size);
+
+#endif // ifndef _XCP_NG_ASYNC_IO_IO_ZERO_H_
@@ -0,0 +1,625 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "xcp-ng/async-io/io-cache.h"
+#include "io-req-internal.h"
+
+// =============================================================================
+
+#define SHARD_ALIGNMENT 64
+
+// ARC lists: T1 and T2 contain the resident blocks used once and several times, B1 and B2 contain the keys of
+// the blocks evicted from T1 and T2 (ghosts).
+typedef enum {
+  ListT1,
+  ListT2,
+  ListB1,
+  ListB2,
+  ListFree,
+
+  ListCount
+} List;
+
+typedef enum {
+  EntryStateValid,
+  EntryStateFilling,
+  EntryStateStale // Written while filling: the data is given to the waiting requests, but it's not kept.
+} EntryState;
+
+// Operations which can modify the data of the cached files.
+#define WRITE_OPCODES \
+  (XcpIoOpcodeWrite | XcpIoOpcodeWriteV | XcpIoOpcodeWriteFixed | XcpIoOpcodeSplice | XcpIoOpcodeFallocate)
+
+typedef struct XcpIoCacheEntry XcpIoCacheEntry;
+typedef struct XcpIoCacheShard XcpIoCacheShard;
+
+struct XcpIoCacheEntry {
+  TAILQ_ENTRY(XcpIoCacheEntry) next; // Position in the list, the first entry is the LRU one.
+  XcpIoCacheEntry *hashNext;
+  XcpIoCacheShard *shard;
+
+  int fd;
+  uint64_t block;
+
+  uint8_t list;
+  uint8_t state;
+
+  // Read of the block, its data slot contains the block. NULL for a ghost.
+  XcpIoReq *req;
+  size_t size; // Size of the data read, smaller than the block at the end of a file.
+
+  // Requests waiting for the read, and the queue of the read.
+  STAILQ_HEAD(, XcpIoReq) waiters;
+  XcpIoQueue *queue;
+};
+
+TAILQ_HEAD(XcpIoCacheEntryList, XcpIoCacheEntry);
+
+struct XcpIoCacheShard {
+  pthread_mutex_t mutex;
+  XcpIoCache *cache;
+
+  // Max number of resident blocks (c) and target size of T1 (p).
+  size_t capacity;
+  size_t target;
+
+  struct XcpIoCacheEntryList lists[ListCount];
+  size_t counts[ListCount];
+
+  XcpIoCacheEntry **buckets;
+  size_t bucketMask;
+  XcpIoCacheEntry *entries;
+
+  XcpIoCacheStats stats;
+} __attribute__((__aligned__(SHARD_ALIGNMENT)));
+
+// Callback and user data of a write, replaced to invalidate the range after the completion. The entries are
+// allocated with the requests of the write pool: slot is the request giving the index of the entry.
+typedef struct XcpIoCacheWrite {
+  XcpIoCache *cache;
+  XcpIoReq *slot;
+  XcpIoReqCb cb;
+  void *userData;
+} XcpIoCacheWrite;
+
+// -----------------------------------------------------------------------------
+
+static inline uint64_t hash_key (int fd, uint64_t block) {
+  uint64_t hash = ((uint64_t)(uint32_t)fd << 40) ^ block;
+  hash *= UINT64_C(0x9e3779b97f4a7c15);
+  return hash ^ (hash >> 29);
+}
+
+static inline XcpIoCacheShard *get_shard (const XcpIoCache *cache, uint64_t hash) {
+  return &cache->pImpl.shards[(hash >> 32) & (cache->shardCount - 1)];
+}
+
+static inline XcpIoCacheEntry *find_entry (const XcpIoCacheShard *shard, int fd, uint64_t block, uint64_t hash) {
+  XcpIoCacheEntry *entry = shard->buckets[hash & shard->bucketMask];
+  while (entry && (entry->fd != fd || entry->block != block))
+    entry = entry->hashNext;
+  return entry;
+}
+
+static inline void remove_from_bucket (XcpIoCacheShard *shard, XcpIoCacheEntry *entry) {
+  XcpIoCacheEntry **it = &shard->buckets[hash_key(entry->fd, entry->block) & shard->bucketMask];
+  while (*it != entry)
+    it = &(*it)->hashNext;
+  *it = entry->hashNext;
+}
+
+static inline bool is_resident (const XcpIoCacheEntry *entry) {
+  return entry->list == ListT1 || entry->list == ListT2;
+}
+
+// Move an entry at the MRU position of a list.
+static inline void move_entry (XcpIoCacheShard *shard, XcpIoCacheEntry *entry, List list) {
+  TAILQ_REMOVE(&shard->lists[entry->list], entry, next);
+  --shard->counts[entry->list];
+  TAILQ_INSERT_TAIL(&shard->lists[list], entry, next);
+  ++shard->counts[list];
+  entry->list = (uint8_t)list;
+}
+
+static inline void release_block (XcpIoCacheShard *shard, XcpIoCacheEntry *entry) {
+  if (entry->req) {
+    xcp_io_req_pool_put(&shard->cache->pImpl.reqPool, entry->req);
+    entry->req = NULL;
+  }
+}
+
+static inline void free_entry (XcpIoCacheShard *shard, XcpIoCacheEntry *entry) {
+  remove_from_bucket(shard, entry);
+  release_block(shard, entry);
+  move_entry(shard, entry, ListFree);
+}
+
+// Returns the LRU block of a resident list which is not being read.
+static inline XcpIoCacheEntry *find_victim (const XcpIoCacheShard *shard, List list) {
+  XcpIoCacheEntry *entry;
+  TAILQ_FOREACH(entry, &shard->lists[list], next) {
+    if (entry->state == EntryStateValid)
+      return entry;
+  }
+  return NULL;
+}
+
+// ARC replacement: evict the LRU block of T1 or T2 to make room for one block, its key goes in B1 or B2.
+// Returns false if all the blocks are being read.
+static bool replace (XcpIoCacheShard *shard, bool inB2) {
+  const size_t t1Count = shard->counts[ListT1];
+  bool fromT1 = t1Count && (t1Count > shard->target || (inB2 && t1Count == shard->target));
+
+  XcpIoCacheEntry *victim = find_victim(shard, fromT1 ? ListT1 : ListT2);
+  if (!victim) {
+    fromT1 = !fromT1;
+    if (!(victim = find_victim(shard, fromT1 ? ListT1 : ListT2)))
+      return false;
+  }
+
+  release_block(shard, victim);
+  move_entry(shard, victim, fromT1 ? ListB1 : ListB2);
+  ++shard->stats.evictions;
+  return true;
+}
+
+static inline size_t get_resident_count (const XcpIoCacheShard *shard) {
+  return shard->counts[ListT1] + shard->counts[ListT2];
+}
+
+// Find an entry for a block which is not resident, and make room for it. Returns NULL if it's not possible.
+static XcpIoCacheEntry *admit_block (XcpIoCacheShard *shard, XcpIoCacheEntry *entry, int fd, uint64_t block) {
+  const size_t capacity = shard->capacity;
+
+  if (entry) {
+    // Ghost hit: the lost block would have been kept by a larger T1 (B1) or a larger T2 (B2).
+    const size_t b1Count = shard->counts[ListB1];
+    const size_t b2Count = shard->counts[ListB2];
+    const bool inB2 = entry->list == ListB2;
+    if (!inB2) {
+      const size_t delta = b1Count >= b2Count ? 1 : b2Count / b1Count;
+      shard->target = capacity - shard->target < delta ? capacity : shard->target + delta;
+    } else {
+      const size_t delta = b2Count >= b1Count ? 1 : b1Count / b2Count;
+      shard->target = shard->target < delta ? 0 : shard->target - delta;
+    }
+
+    if (get_resident_count(shard) >= capacity && !replace(shard, inB2))
+      return NULL;
+    move_entry(shard, entry, ListT2);
+    return entry;
+  }
+
+  const size_t l1Count = shard->counts[ListT1] + shard->counts[ListB1];
+  if (l1Count >= capacity) {
+    if (shard->counts[ListT1] < capacity) {
+      free_entry(shard, TAILQ_FIRST(&shard->lists[ListB1]));
+      if (get_resident_count(shard) >= capacity && !replace(shard, false))
+        return NULL;
+    } else {
+      // T1 contains all the blocks: drop its LRU block without keeping its key.
+      XcpIoCacheEntry *victim = find_victim(shard, ListT1);
+      if (!victim)
+        return NULL;
+      free_entry(shard, victim);
+      ++shard->stats.evictions;
+    }
+  } else if (l1Count + shard->counts[ListT2] + shard->counts[ListB2] >= capacity) {
+    if (shard->counts[ListB2] && l1Count + shard->counts[ListT2] + shard->counts[ListB2] >= 2 * capacity)
+      free_entry(shard, TAILQ_FIRST(&shard->lists[ListB2]));
+    if (get_resident_count(shard) >= capacity && !replace(shard, false))
+      return NULL;
+  }
+
+  if (!(entry = TAILQ_FIRST(&shard->lists[ListFree])))
+    return NULL;
+
+  entry->fd = fd;
+  entry->block = block;
+  XcpIoCacheEntry **bucket = &shard->buckets[hash_key(fd, block) & shard->bucketMask];
+  entry->hashNext = *bucket;
+  *bucket = entry;
+  move_entry(shard, entry, ListT1);
+  return entry;
+}
+
+// -----------------------------------------------------------------------------
+
+// Complete a read with the data of a block, like the queue does.
+static inline void copy_from_block (XcpIoReq *req, const char *data) {
+  memcpy(req->iov.iov_base, data, req->iov.iov_len);
+  req->pImpl.res = (int)req->iov.iov_len;
+  xcp_io_req_process_buffer(req, 0);
+}
+
+static inline bool is_in_block (const XcpIoCache *cache, const XcpIoReq *req, size_t size) {
+  return (uint64_t)req->offset % cache->blockSize + req->iov.iov_len <= size;
+}
+
+static void block_read_completion_cb (XcpIoReq *blockReq, int err, void *userArg) {
+  XcpIoCacheEntry *entry = userArg;
+  XcpIoCacheShard *shard = entry->shard;
+  XcpIoCache *cache = shard->cache;
+  XcpIoQueue *queue = entry->queue;
+
+  // The last block of a file is read short: it's kept with its size, the reads past its end go to the queue.
+  size_t size = cache->blockSize;
+  if (err == -EIO && xcp_io_req_get_result(blockReq) >= 0) {
+    size = (size_t)xcp_io_req_get_result(blockReq);
+    err = 0;
+  }
+
+  pthread_mutex_lock(&shard->mutex);
+
+  XcpIoReq *waiters = STAILQ_FIRST(&entry->waiters);
+  STAILQ_INIT(&entry->waiters);
+
+  if (!err) {
+    const char *data = xcp_io_req_pool_get_data(&cache->pImpl.reqPool, blockReq);
+    for (XcpIoReq *req = waiters; req; req = STAILQ_NEXT(req, pImpl.next)) {
+      if (is_in_block(cache, req, size))
+        copy_from_block(req, data + (uint64_t)req->offset % cache->blockSize);
+    }
+    entry->size = size;
+  }
+
+  if (!err && entry->state == EntryStateFilling)
+    entry->state = EntryStateValid;
+  else {
+    entry->state = EntryStateValid;
+    free_entry(shard, entry);
+  }
+
+  pthread_mutex_unlock(&shard->mutex);
+
+  // The callbacks can reuse the requests.
+  while (waiters) {
+    XcpIoReq *req = waiters;
+    waiters = STAILQ_NEXT(req, pImpl.next);
+    if (err || !is_in_block(cache, req, size))
+      xcp_io_queue_insert_or_complete(queue, req);
+    else if (XCP_LIKELY(req->cb))
+      req->cb(req, 0, req->userData);
+  }
+}
+
+static inline bool is_cacheable (const XcpIoCache *cache, const XcpIoReq *req) {
+  return req->opcode == XcpIoOpcodeRead &&
+    !(req->flags & (XcpIoReqFlagFixedFile | XcpIoReqFlagLink | XcpIoReqFlagHardLink)) &&
+    req->offset >= 0 &&
+    req->iov.iov_len &&
+    (uint64_t)req->offset % cache->blockSize + req->iov.iov_len <= cache->blockSize;
+}
+
+static void read_block (XcpIoCache *cache, XcpIoQueue *queue, XcpIoReq *req) {
+  const uint64_t block = (uint64_t)req->offset / cache->blockSize;
+  const uint64_t hash = hash_key(req->fd, block);
+  XcpIoCacheShard *shard = get_shard(cache, hash);
+
+  pthread_mutex_lock(&shard->mutex);
+
+  XcpIoCacheEntry *entry = find_entry(shard, req->fd, block, hash);
+  if (entry && is_resident(entry)) {
+    if (entry->state == EntryStateValid && is_in_block(cache, req, entry->size)) {
+      const char *data = xcp_io_req_pool_get_data(&cache->pImpl.reqPool, entry->req);
+      copy_from_block(req, data + (uint64_t)req->offset % cache->blockSize);
+      move_entry(shard, entry, ListT2);
+      ++shard->stats.hits;
+      pthread_mutex_unlock(&shard->mutex);
+
+      if (XCP_LIKELY(req->cb))
+        req->cb(req, 0, req->userData);
+      return;
+    }
+
+    if (entry->state == EntryStateFilling) {
+      STAILQ_INSERT_TAIL(&entry->waiters, req, pImpl.next);
+      ++shard->stats.coalesced;
+      pthread_mutex_unlock(&shard->mutex);
+      return;
+    }
+
+    // Stale (the block is being written), or read past the end of a short block.
+    goto bypass;
+  }
+
+  if (!(entry = admit_block(shard, entry, req->fd, block)))
+    goto bypass;
+
+  // The pool contains one request per resident block of each shard.
+  entry->req = xcp_io_req_pool_get(&cache->pImpl.reqPool);
+  assert(entry->req);
+  entry->state = EntryStateFilling;
+  entry->queue = queue;
+  STAILQ_INIT(&entry->waiters);
+  STAILQ_INSERT_TAIL(&entry->waiters, req, pImpl.next);
+  ++shard->stats.misses;
+
+  XcpIoReq *blockReq = entry->req;
+  pthread_mutex_unlock(&shard->mutex);
+
+  xcp_io_req_prep_rw(
+    blockReq, XcpIoOpcodeRead, req->fd, xcp_io_req_pool_get_data(&cache->pImpl.reqPool, blockReq), cache->blockSize,
+    (off_t)(block * cache->blockSize)
+  );
+  blockReq->ioprio = req->ioprio;
+  xcp_io_req_set_tenant(blockReq, req->tenant);
+  xcp_io_req_set_cb(blockReq, block_read_completion_cb);
+  xcp_io_req_set_user_data(blockReq, entry);
+  xcp_io_queue_insert_or_complete(queue, blockReq);
+  return;
+
+bypass:
+  ++shard->stats.bypasses;
+  pthread_mutex_unlock(&shard->mutex);
+  xcp_io_queue_insert_or_complete(queue, req);
+}
+
+// -----------------------------------------------------------------------------
+
+static void invalidate_entry (XcpIoCacheShard *shard, XcpIoCacheEntry *entry) {
+  if (!is_resident(entry))
+    return;
+
+  ++shard->stats.invalidations;
+  if (entry->state == EntryStateValid)
+    free_entry(shard, entry);
+  else
+    entry->state = EntryStateStale;
+}
+
+static inline uint64_t get_write_size (const XcpIoReq *req) {
+  // A Fallocate without KEEP_SIZE can change the end of the file.
+  return req->opcode == XcpIoOpcodeFallocate ? UINT64_MAX : xcp_io_req_get_size(req);
+}
+
+static inline bool is_write (const XcpIoReq *req) {
+  return (req->opcode & WRITE_OPCODES) && !(req->flags & XcpIoReqFlagFixedFile);
+}
+
+static void invalidate_write (XcpIoCache *cache, const XcpIoReq *req) {
+  // The current file position (offset -1) is unknown: all the blocks of the file are removed.
+  if (req->offset < 0)
+    xcp_io_cache_invalidate(cache, req->fd, 0, UINT64_MAX);
+  else
+    xcp_io_cache_invalidate(cache, req->fd, req->offset, get_write_size(req));
+}
+
+static void write_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XcpIoCacheWrite *write = userArg;
+  XcpIoCache *cache = write->cache;
+  req->cb = write->cb;
+  req->userData = write->userData;
+  xcp_io_req_pool_put(&cache->pImpl.writePool, write->slot);
+
+  invalidate_write(cache, req);
+  if (XCP_LIKELY(req->cb))
+    req->cb(req, err, req->userData);
+}
+
+// -----------------------------------------------------------------------------
+
+static int init_shard (XcpIoCache *cache, XcpIoCacheShard *shard, size_t capacity, size_t bucketCount) {
+  shard->cache = cache;
+  shard->capacity = capacity;
+  shard->bucketMask = bucketCount - 1;
+  for (int list = 0; list < ListCount; ++list)
+    TAILQ_INIT(&shard->lists[list]);
+
+  // The directory contains at most 2c entries: c resident blocks and c ghosts.
+  int ret = -ENOMEM;
+  if (!(shard->buckets = calloc(bucketCount, sizeof *shard->buckets)))
+    return ret;
+  if (!(shard->entries = calloc(2 * capacity, sizeof *shard->entries)))
+    goto fail;
+
+  for (size_t i = 0; i < 2 * capacity; ++i) {
+    XcpIoCacheEntry *entry = &shard->entries[i];
+    entry->shard = shard;
+    entry->list = ListFree;
+    TAILQ_INSERT_TAIL(&shard->lists[ListFree], entry, next);
+  }
+  shard->counts[ListFree] = 2 * capacity;
+
+  if (!(ret = -pthread_mutex_init(&shard->mutex, NULL)))
+    return 0;
+
+fail:
+  free(shard->entries);
+  free(shard->buckets);
+  return ret;
+}
+
+static void uninit_shard (XcpIoCacheShard *shard) {
+  pthread_mutex_destroy(&shard->mutex);
+  free(shard->entries);
+  free(shard->buckets);
+}
+
+// -----------------------------------------------------------------------------
+
+int xcp_io_cache_init (XcpIoCache *cache, const XcpIoCacheOptions *options) {
+  const unsigned int shardCount = options->shardCount;
+  const size_t blockSize = options->blockSize;
+  if (
+    !shardCount || (shardCount & (shardCount - 1)) ||
+    !blockSize || blockSize % XCP_IO_REQ_POOL_DATA_ALIGNMENT || options->size / blockSize < shardCount ||
+    !options->writeCount
+  )
+    return -EINVAL;
+
+  const size_t capacity = options->size / blockSize / shardCount;
+  size_t bucketCount = 1;
+  while (bucketCount < 2 * capacity)
+    bucketCount <<= 1;
+
+  cache->blockSize = blockSize;
+  cache->shardCount = shardCount;
+
+  int ret = xcp_io_req_pool_init(&cache->pImpl.reqPool, capacity * shardCount, blockSize, options->reqPoolFlags);
+  if (ret < 0)
+    return ret;
+
+  // The write pool has no data slot: its requests only give the indexes of the write entries.
+  if ((ret = xcp_io_req_pool_init(&cache->pImpl.writePool, options->writeCount, 0, 0)) < 0)
+    goto failReqPool;
+
+  ret = -ENOMEM;
+  if (!(cache->pImpl.writes = calloc(options->writeCount, sizeof *cache->pImpl.writes)))
+    goto failWritePool;
+
+  XcpIoCacheShard *shards = aligned_alloc(SHARD_ALIGNMENT, shardCount * sizeof *shards);
+  if (!shards)
+    goto failWrites;
+  memset(shards, 0, shardCount * sizeof *shards);
+
+  for (unsigned int i = 0; i < shardCount; ++i) {
+    if ((ret = init_shard(cache, &shards[i], capacity, bucketCount)) < 0) {
+      while (i--)
+        uninit_shard(&shards[i]);
+      free(shards);
+      goto failWrites;
+    }
+  }
+
+  cache->pImpl.shards = shards;
+  return 0;
+
+failWrites:
+  free(cache->pImpl.writes);
+failWritePool:
+  xcp_io_req_pool_uninit(&cache->pImpl.writePool);
+failReqPool:
+  xcp_io_req_pool_uninit(&cache->pImpl.reqPool);
+  return ret;
+}
+
+void xcp_io_cache_uninit (XcpIoCache *cache) {
+  for (unsigned int i = 0; i < cache->shardCount; ++i)
+    uninit_shard(&cache->pImpl.shards[i]);
+  free(cache->pImpl.shards);
+  free(cache->pImpl.writes);
+  xcp_io_req_pool_uninit(&cache->pImpl.writePool);
+  xcp_io_req_pool_uninit(&cache->pImpl.reqPool);
+}
+
+int xcp_io_cache_insert (XcpIoCache *cache, XcpIoQueue *queue, XcpIoReq *req) {
+  assert(!xcp_io_queue_has_batch_cb(queue));
+
+  if (is_cacheable(cache, req)) {
+    read_block(cache, queue, req);
+    return 0;
+  }
+
+  // 1. Take the write entries of the whole chain: nothing is modified if one is missing.
+  XcpIoReqPool *writePool = &cache->pImpl.writePool;
+  for (XcpIoReq *it = req; it; it = it->pImpl.link) {
+    if (!is_write(it))
+      continue;
+
+    XcpIoReq *slot = xcp_io_req_pool_get(writePool);
+    if (XCP_UNLIKELY(!slot)) {
+      for (XcpIoReq *prev = req; prev != it; prev = prev->pImpl.link) {
+        if (!is_write(prev))
+          continue;
+        XcpIoCacheWrite *write = prev->userData;
+        prev->userData = write->userData;
+        xcp_io_req_pool_put(writePool, write->slot);
+      }
+      return -EBUSY;
+    }
+
+    XcpIoCacheWrite *write = &cache->pImpl.writes[xcp_io_req_pool_get_index(writePool, slot)];
+    write->slot = slot;
+    write->userData = it->userData;
+    it->userData = write;
+  }
+
+  // 2. Invalidate and replace the callbacks.
+  for (XcpIoReq *it = req; it; it = it->pImpl.link) {
+    if (!is_write(it))
+      continue;
+
+    invalidate_write(cache, it);
+
+    XcpIoCacheWrite *write = it->userData;
+    write->cache = cache;
+    write->cb = it->cb;
+    it->cb = write_completion_cb;
+  }
+
+  xcp_io_queue_insert_or_complete(queue, req);
+  return 0;
+}
+
+void xcp_io_cache_invalidate (XcpIoCache *cache, int fd, off_t offset, uint64_t len) {
+  if (!len || offset < 0)
+    return;
+
+  const uint64_t first = (uint64_t)offset / cache->blockSize;
+  const uint64_t last = len > UINT64_MAX - (uint64_t)offset
+    ? UINT64_MAX / cache->blockSize
+    : ((uint64_t)offset + len - 1) / cache->blockSize;
+
+  // Large ranges: scan the directories instead of looking up each block.
+  const size_t entryCount = 2 * cache->pImpl.shards[0].capacity * cache->shardCount;
+  if (last - first >= entryCount) {
+    for (unsigned int i = 0; i < cache->shardCount; ++i) {
+      XcpIoCacheShard *shard = &cache->pImpl.shards[i];
+      pthread_mutex_lock(&shard->mutex);
+      for (size_t j = 0; j < 2 * shard->capacity; ++j) {
+        XcpIoCacheEntry *entry = &shard->entries[j];
+        if (entry->list != ListFree && entry->fd == fd && entry->block >= first && entry->block <= last)
+          invalidate_entry(shard, entry);
+      }
+      pthread_mutex_unlock(&shard->mutex);
+    }
+    return;
+  }
+
+  for (uint64_t block = first; block <= last; ++block) {
+    const uint64_t hash = hash_key(fd, block);
+    XcpIoCacheShard *shard = get_shard(cache, hash);
+    pthread_mutex_lock(&shard->mutex);
+    XcpIoCacheEntry *entry = find_entry(shard, fd, block, hash);
+    if (entry)
+      invalidate_entry(shard, entry);
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
+
+void xcp_io_cache_get_stats (XcpIoCache *cache, XcpIoCacheStats *stats) {
+  memset(stats, 0, sizeof *stats);
+  for (unsigned int i = 0; i < cache->shardCount; ++i) {
+    XcpIoCacheShard *shard = &cache->pImpl.shards[i];
+    pthread_mutex_lock(&shard->mutex);
+    stats->hits += shard->stats.hits;
+    stats->misses += shard->stats.misses;
+    stats->coalesced += shard->stats.coalesced;
+    stats->bypasses += shard->stats.bypasses;
+    stats->evictions += shard->stats.evictions;
+    stats->invalidations += shard->stats.invalidations;
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
@@ -0,0 +1,558 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+  #include <immintrin.h>
+#endif
+
+#include "xcp-ng/async-io/io-checksum.h"
+
+// =============================================================================
+// Helpers.
+// =============================================================================
+
+static inline uint32_t read_le32 (const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof value);
+  #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+  #endif
+  return value;
+}
+
+static inline uint64_t read_le64 (const unsigned char *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof value);
+  #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+  #endif
+  return value;
+}
+
+static inline void write_le64 (unsigned char *p, uint64_t value) {
+  #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+  #endif
+  memcpy(p, &value, sizeof value);
+}
+
+// =============================================================================
+// CRC-32C.
+// =============================================================================
+
+// Reflected Castagnoli polynomial.
+#define CRC32C_POLY 0x82f63b78
+
+// Bytes per stream of the hardware implementation: three streams are computed in parallel
+// to hide the latency of the crc32 instruction, then folded with carry-less multiplications.
+#define CRC32C_STREAM_SIZE 4096
+
+// The CRCs below are raw: without the initial and final inversions.
+typedef uint32_t (*Crc32cUpdateFn)(uint32_t crc, const unsigned char *buf, size_t size);
+
+static struct {
+  pthread_once_t once;
+  Crc32cUpdateFn update;
+
+  // Slicing-by-8 tables of the generic implementation.
+  uint32_t table[8][256];
+
+  // x^(2^n) mod P, used to shift a CRC by a number of bytes.
+  uint32_t x2nTable[64];
+
+  // Constants of the hardware implementation to shift the first stream by two stream sizes,
+  // and the second stream by one stream size.
+  uint64_t fold2;
+  uint64_t fold1;
+} Crc32c = { .once = PTHREAD_ONCE_INIT };
+
+// Multiply a and b modulo P, in the reflected representation: x^0 is the highest bit.
+static uint32_t mult_mod_p (uint32_t a, uint32_t b) {
+  uint32_t m = UINT32_C(1) << 31;
+  uint32_t p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if (!(a & (m - 1)))
+        break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+// Returns x^n mod P.
+static uint32_t x_pow_mod_p (uint64_t n) {
+  uint32_t p = UINT32_C(1) << 31;
+  for (unsigned int k = 0; n; n >>= 1, ++k) {
+    if (n & 1)
+      p = mult_mod_p(Crc32c.x2nTable[k], p);
+  }
+  return p;
+}
+
+static uint32_t crc32c_update_generic (uint32_t crc, const unsigned char *buf, size_t size) {
+  for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), buf += sizeof(uint64_t)) {
+    const uint64_t value = read_le64(buf) ^ crc;
+    crc = Crc32c.table[7][value & 0xff] ^
+      Crc32c.table[6][(value >> 8) & 0xff] ^
+      Crc32c.table[5][(value >> 16) & 0xff] ^
+      Crc32c.table[4][(value >> 24) & 0xff] ^
+      Crc32c.table[3][(value >> 32) & 0xff] ^
+      Crc32c.table[2][(value >> 40) & 0xff] ^
+      Crc32c.table[1][(value >> 48) & 0xff] ^
+      Crc32c.table[0][value >> 56];
+  }
+
+  while (size--)
+    crc = (crc >> 8) ^ Crc32c.table[0][(crc ^ *buf++) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+  // Multiply crc by the fold constant with PCLMUL, the crc32 instruction reduces the product modulo P.
+  __attribute__((__target__("sse4.2,pclmul")))
+  static inline uint64_t crc32c_fold (uint64_t crc, uint64_t constant) {
+    const __m128i product = _mm_clmulepi64_si128(
+      _mm_cvtsi64_si128((long long)crc), _mm_cvtsi64_si128((long long)constant), 0
+    );
+    return _mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(product));
+  }
+
+  __attribute__((__target__("sse4.2,pclmul")))
+  static uint32_t crc32c_update_sse42 (uint32_t crc, const unsigned char *buf, size_t size) {
+    uint64_t crc0 = crc;
+    for (; size >= 3 * CRC32C_STREAM_SIZE; size -= 3 * CRC32C_STREAM_SIZE, buf += 3 * CRC32C_STREAM_SIZE) {
+      uint64_t crc1 = 0;
+      uint64_t crc2 = 0;
+      for (size_t i = 0; i < CRC32C_STREAM_SIZE; i += sizeof(uint64_t)) {
+        crc0 = _mm_crc32_u64(crc0, read_le64(buf + i));
+        crc1 = _mm_crc32_u64(crc1, read_le64(buf + CRC32C_STREAM_SIZE + i));
+        crc2 = _mm_crc32_u64(crc2, read_le64(buf + 2 * CRC32C_STREAM_SIZE + i));
+      }
+      crc0 = crc32c_fold(crc0, Crc32c.fold2) ^ crc32c_fold(crc1, Crc32c.fold1) ^ crc2;
+    }
+
+    for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), buf += sizeof(uint64_t))
+      crc0 = _mm_crc32_u64(crc0, read_le64(buf));
+
+    uint32_t result = (uint32_t)crc0;
+    while (size--)
+      result = _mm_crc32_u8(result, *buf++);
+    return result;
+  }
+#endif
+
+static void crc32c_init (void) {
+  for (uint32_t n = 0; n < 256; ++n) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; ++k)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    Crc32c.table[0][n] = crc;
+  }
+  for (uint32_t n = 0; n < 256; ++n) {
+    for (int k = 1; k < 8; ++k)
+      Crc32c.table[k][n] = (Crc32c.table[k - 1][n] >> 8) ^ Crc32c.table[0][Crc32c.table[k - 1][n] & 0xff];
+  }
+
+  uint32_t p = UINT32_C(1) << 30; // x^1
+  Crc32c.x2nTable[0] = p;
+  for (int n = 1; n < 64; ++n)
+    Crc32c.x2nTable[n] = p = mult_mod_p(p, p);
+
+  Crc32c.update = crc32c_update_generic;
+
+  #if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+      // The product of two reflected 32-bit values is shifted by one bit, and the crc32 instruction
+      // multiplies it by x^32: x^(8 * size - 33) shifts a CRC by size bytes.
+      Crc32c.fold2 = x_pow_mod_p(8 * 2 * CRC32C_STREAM_SIZE - 33);
+      Crc32c.fold1 = x_pow_mod_p(8 * CRC32C_STREAM_SIZE - 33);
+      Crc32c.update = crc32c_update_sse42;
+    }
+  #endif
+}
+
+// -----------------------------------------------------------------------------
+
+uint32_t xcp_io_crc32c (uint32_t crc, const void *buf, size_t size) {
+  pthread_once(&Crc32c.once, crc32c_init);
+  return ~Crc32c.update(~crc, buf, size);
+}
+
+uint32_t xcp_io_crc32c_combine (uint32_t crc1, uint32_t crc2, uint64_t size2) {
+  pthread_once(&Crc32c.once, crc32c_init);
+  return mult_mod_p(x_pow_mod_p(8 * size2), crc1) ^ crc2;
+}
+
+// =============================================================================
+// XXH3.
+// =============================================================================
+
+#define XXH_PRIME32_1 UINT32_C(0x9e3779b1)
+#define XXH_PRIME32_2 UINT32_C(0x85ebca77)
+#define XXH_PRIME32_3 UINT32_C(0xc2b2ae3d)
+
+#define XXH_PRIME64_1 UINT64_C(0x9e3779b185ebca87)
+#define XXH_PRIME64_2 UINT64_C(0xc2b2ae3d27d4eb4f)
+#define XXH_PRIME64_3 UINT64_C(0x165667b19e3779f9)
+#define XXH_PRIME64_4 UINT64_C(0x85ebca77c2b2ae63)
+#define XXH_PRIME64_5 UINT64_C(0x27d4eb2f165667c5)
+
+#define XXH3_STRIPE_SIZE 64
+#define XXH3_SECRET_CONSUME_RATE 8
+#define XXH3_ACC_COUNT 8
+#define XXH3_SECRET_SIZE 192
+#define XXH3_STRIPES_PER_BLOCK ((XXH3_SECRET_SIZE - XXH3_STRIPE_SIZE) / XXH3_SECRET_CONSUME_RATE)
+#define XXH3_BLOCK_SIZE (XXH3_STRIPE_SIZE * XXH3_STRIPES_PER_BLOCK)
+#define XXH3_SECRET_LASTACC_START 7
+#define XXH3_SECRET_MERGEACCS_START 11
+#define XXH3_MID_SIZE_MAX 240
+
+static const unsigned char Xxh3Secret[XXH3_SECRET_SIZE] = {
+  0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+  0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+  0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+  0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+  0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+  0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+  0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+  0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+  0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+  0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+  0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+  0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+typedef void (*Xxh3AccumulateFn)(uint64_t *acc, const unsigned char *buf, size_t size);
+
+static inline uint64_t rotl64 (uint64_t value, unsigned int shift) {
+  return (value << shift) | (value >> (64 - shift));
+}
+
+static inline uint64_t mul128_fold64 (uint64_t a, uint64_t b) {
+  #ifdef __SIZEOF_INT128__
+    const unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+  #else
+    const uint64_t lolo = (a & 0xffffffff) * (b & 0xffffffff);
+    const uint64_t hilo = (a >> 32) * (b & 0xffffffff);
+    const uint64_t lohi = (a & 0xffffffff) * (b >> 32);
+    const uint64_t hihi = (a >> 32) * (b >> 32);
+    const uint64_t cross = (lolo >> 32) + (hilo & 0xffffffff) + lohi;
+    const uint64_t upper = (hilo >> 32) + (cross >> 32) + hihi;
+    const uint64_t lower = (cross << 32) | (lolo & 0xffffffff);
+    return lower ^ upper;
+  #endif
+}
+
+static inline uint64_t xxh64_avalanche (uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= XXH_PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= XXH_PRIME64_3;
+  return hash ^ (hash >> 32);
+}
+
+static inline uint64_t xxh3_avalanche (uint64_t hash) {
+  hash ^= hash >> 37;
+  hash *= UINT64_C(0x165667919e3779f9);
+  return hash ^ (hash >> 32);
+}
+
+static inline uint64_t xxh3_rrmxmx (uint64_t hash, uint64_t size) {
+  hash ^= rotl64(hash, 49) ^ rotl64(hash, 24);
+  hash *= UINT64_C(0x9fb21c651e98df25);
+  hash ^= (hash >> 35) + size;
+  hash *= UINT64_C(0x9fb21c651e98df25);
+  return hash ^ (hash >> 28);
+}
+
+static inline uint64_t xxh3_mix16 (const unsigned char *buf, const unsigned char *secret) {
+  return mul128_fold64(read_le64(buf) ^ read_le64(secret), read_le64(buf + 8) ^ read_le64(secret + 8));
+}
+
+static uint64_t xxh3_hash_0_to_16 (const unsigned char *buf, size_t size) {
+  const unsigned char *secret = Xxh3Secret;
+  if (size > 8) {
+    const uint64_t low = read_le64(buf) ^ (read_le64(secret + 24) ^ read_le64(secret + 32));
+    const uint64_t high = read_le64(buf + size - 8) ^ (read_le64(secret + 40) ^ read_le64(secret + 48));
+    return xxh3_avalanche(size + __builtin_bswap64(low) + high + mul128_fold64(low, high));
+  }
+
+  if (size >= 4) {
+    const uint64_t value = read_le32(buf + size - 4) + ((uint64_t)read_le32(buf) << 32);
+    return xxh3_rrmxmx(value ^ (read_le64(secret + 8) ^ read_le64(secret + 16)), size);
+  }
+
+  if (size) {
+    const uint32_t combined = ((uint32_t)buf[0] << 16) | ((uint32_t)buf[size >> 1] << 24) |
+      (uint32_t)buf[size - 1] | ((uint32_t)size << 8);
+    return xxh64_avalanche(combined ^ (uint64_t)(read_le32(secret) ^ read_le32(secret + 4)));
+  }
+
+  return xxh64_avalanche(read_le64(secret + 56) ^ read_le64(secret + 64));
+}
+
+static uint64_t xxh3_hash_17_to_128 (const unsigned char *buf, size_t size) {
+  const unsigned char *secret = Xxh3Secret;
+  uint64_t acc = size * XXH_PRIME64_1;
+  if (size > 32) {
+    if (size > 64) {
+      if (size > 96) {
+        acc += xxh3_mix16(buf + 48, secret + 96);
+        acc += xxh3_mix16(buf + size - 64, secret + 112);
+      }
+      acc += xxh3_mix16(buf + 32, secret + 64);
+      acc += xxh3_mix16(buf + size - 48, secret + 80);
+    }
+    acc += xxh3_mix16(buf + 16, secret + 32);
+    acc += xxh3_mix16(buf + size - 32, secret + 48);
+  }
+  acc += xxh3_mix16(buf, secret);
+  acc += xxh3_mix16(buf + size - 16, secret + 16);
+  return xxh3_avalanche(acc);
+}
+
+static uint64_t xxh3_hash_129_to_240 (const unsigned char *buf, size_t size) {
+  const unsigned char *secret = Xxh3Secret;
+  uint64_t acc = size * XXH_PRIME64_1;
+
+  size_t i = 0;
+  for (; i < 8; ++i)
+    acc += xxh3_mix16(buf + 16 * i, secret + 16 * i);
+  acc = xxh3_avalanche(acc);
+
+  for (; i < size / 16; ++i)
+    acc += xxh3_mix16(buf + 16 * i, secret + 16 * (i - 8) + 3);
+  acc += xxh3_mix16(buf + size - 16, secret + 136 - 17);
+  return xxh3_avalanche(acc);
+}
+
+static inline void xxh3_accumulate_512 (uint64_t *acc, const unsigned char *buf, const unsigned char *secret) {
+  for (size_t i = 0; i < XXH3_ACC_COUNT; ++i) {
+    const uint64_t value = read_le64(buf + 8 * i);
+    const uint64_t key = value ^ read_le64(secret + 8 * i);
+    acc[i ^ 1] += value;
+    acc[i] += (key & 0xffffffff) * (key >> 32);
+  }
+}
+
+static inline void xxh3_scramble (uint64_t *acc, const unsigned char *secret) {
+  for (size_t i = 0; i < XXH3_ACC_COUNT; ++i)
+    acc[i] = (acc[i] ^ (acc[i] >> 47) ^ read_le64(secret + 8 * i)) * XXH_PRIME32_1;
+}
+
+// Accumulate the stripes of an input larger than XXH3_MID_SIZE_MAX.
+static void xxh3_accumulate_generic (uint64_t *acc, const unsigned char *buf, size_t size) {
+  const size_t blockCount = (size - 1) / XXH3_BLOCK_SIZE;
+  for (size_t i = 0; i < blockCount; ++i) {
+    const unsigned char *block = buf + i * XXH3_BLOCK_SIZE;
+    for (size_t j = 0; j < XXH3_STRIPES_PER_BLOCK; ++j)
+      xxh3_accumulate_512(acc, block + j * XXH3_STRIPE_SIZE, Xxh3Secret + j * XXH3_SECRET_CONSUME_RATE);
+    xxh3_scramble(acc, Xxh3Secret + XXH3_SECRET_SIZE - XXH3_STRIPE_SIZE);
+  }
+
+  const unsigned char *block = buf + blockCount * XXH3_BLOCK_SIZE;
+  const size_t stripeCount = (size - 1 - blockCount * XXH3_BLOCK_SIZE) / XXH3_STRIPE_SIZE;
+  for (size_t j = 0; j < stripeCount; ++j)
+    xxh3_accumulate_512(acc, block + j * XXH3_STRIPE_SIZE, Xxh3Secret + j * XXH3_SECRET_CONSUME_RATE);
+
+  xxh3_accumulate_512(
+    acc, buf + size - XXH3_STRIPE_SIZE, Xxh3Secret + XXH3_SECRET_SIZE - XXH3_STRIPE_SIZE - XXH3_SECRET_LASTACC_START
+  );
+}
+
+#if defined(__x86_64__)
+  __attribute__((__target__("avx2")))
+  static inline void xxh3_accumulate_512_avx2 (__m256i *acc, const unsigned char *buf, const unsigned char *secret) {
+    for (int i = 0; i < 2; ++i) {
+      const __m256i value = _mm256_loadu_si256((const __m256i *)buf + i);
+      const __m256i key = _mm256_xor_si256(value, _mm256_loadu_si256((const __m256i *)secret + i));
+      const __m256i product = _mm256_mul_epu32(key, _mm256_srli_epi64(key, 32));
+      const __m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+      acc[i] = _mm256_add_epi64(_mm256_add_epi64(acc[i], swapped), product);
+    }
+  }
+
+  __attribute__((__target__("avx2")))
+  static inline void xxh3_scramble_avx2 (__m256i *acc, const unsigned char *secret) {
+    const __m256i prime = _mm256_set1_epi32((int)XXH_PRIME32_1);
+    for (int i = 0; i < 2; ++i) {
+      const __m256i key = _mm256_xor_si256(
+        _mm256_xor_si256(acc[i], _mm256_srli_epi64(acc[i], 47)),
+        _mm256_loadu_si256((const __m256i *)secret + i)
+      );
+      const __m256i low = _mm256_mul_epu32(key, prime);
+      const __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(key, 32), prime);
+      acc[i] = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+    }
+  }
+
+  __attribute__((__target__("avx2")))
+  static void xxh3_accumulate_avx2 (uint64_t *acc, const unsigned char *buf, size_t size) {
+    __m256i vacc[2] = { _mm256_loadu_si256((const __m256i *)acc), _mm256_loadu_si256((const __m256i *)acc + 1) };
+
+    const size_t blockCount = (size - 1) / XXH3_BLOCK_SIZE;
+    for (size_t i = 0; i < blockCount; ++i) {
+      const unsigned char *block = buf + i * XXH3_BLOCK_SIZE;
+      for (size_t j = 0; j < XXH3_STRIPES_PER_BLOCK; ++j)
+        xxh3_accumulate_512_avx2(vacc, block + j * XXH3_STRIPE_SIZE, Xxh3Secret + j * XXH3_SECRET_CONSUME_RATE);
+      xxh3_scramble_avx2(vacc, Xxh3Secret + XXH3_SECRET_SIZE - XXH3_STRIPE_SIZE);
+    }
+
+    const unsigned char *block = buf + blockCount * XXH3_BLOCK_SIZE;
+    const size_t stripeCount = (size - 1 - blockCount * XXH3_BLOCK_SIZE) / XXH3_STRIPE_SIZE;
+    for (size_t j = 0; j < stripeCount; ++j)
+      xxh3_accumulate_512_avx2(vacc, block + j * XXH3_STRIPE_SIZE, Xxh3Secret + j * XXH3_SECRET_CONSUME_RATE);
+
+    xxh3_accumulate_512_avx2(
+      vacc, buf + size - XXH3_STRIPE_SIZE, Xxh3Secret + XXH3_SECRET_SIZE - XXH3_STRIPE_SIZE - XXH3_SECRET_LASTACC_START
+    );
+
+    _mm256_storeu_si256((__m256i *)acc, vacc[0]);
+    _mm256_storeu_si256((__m256i *)acc + 1, vacc[1]);
+  }
+#endif
+
+static Xxh3AccumulateFn resolve_xxh3_accumulate (void) {
+  #if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return xxh3_accumulate_avx2;
+  #endif
+  return xxh3_accumulate_generic;
+}
+
+static uint64_t xxh3_hash_long (const unsigned char *buf, size_t size) {
+  // Concurrent first calls store the same value.
+  static Xxh3AccumulateFn accumulate;
+  Xxh3AccumulateFn fn = __atomic_load_n(&accumulate, __ATOMIC_RELAXED);
+  if (XCP_UNLIKELY(!fn)) {
+    fn = resolve_xxh3_accumulate();
+    __atomic_store_n(&accumulate, fn, __ATOMIC_RELAXED);
+  }
+
+  uint64_t acc[XXH3_ACC_COUNT] = {
+    XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+    XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1
+  };
+  fn(acc, buf, size);
+
+  uint64_t result = size * XXH_PRIME64_1;
+  const unsigned char *secret = Xxh3Secret + XXH3_SECRET_MERGEACCS_START;
+  for (size_t i = 0; i < XXH3_ACC_COUNT / 2; ++i)
+    result += mul128_fold64(acc[2 * i] ^ read_le64(secret + 16 * i), acc[2 * i + 1] ^ read_le64(secret + 16 * i + 8));
+  return xxh3_avalanche(result);
+}
+
+// -----------------------------------------------------------------------------
+
+uint64_t xcp_io_xxh3 (const void *buf, size_t size) {
+  if (size <= 16)
+    return xxh3_hash_0_to_16(buf, size);
+  if (size <= 128)
+    return xxh3_hash_17_to_128(buf, size);
+  if (size <= XXH3_MID_SIZE_MAX)
+    return xxh3_hash_129_to_240(buf, size);
+  return xxh3_hash_long(buf, size);
+}
+
+uint64_t xcp_io_checksum_compute (XcpIoChecksum checksum, const void *buf, size_t size) {
+  switch (checksum) {
+    case XcpIoChecksumNone:
+      break;
+    case XcpIoChecksumCrc32c:
+      return xcp_io_crc32c(0, buf, size);
+    case XcpIoChecksumXxh3:
+      return xcp_io_xxh3(buf, size);
+  }
+  return 0;
+}
+
+// =============================================================================
+// Manifest.
+// =============================================================================
+
+void xcp_io_checksum_manifest_init (XcpIoChecksumManifest *manifest, XcpIoChecksum checksum, size_t blockSize) {
+  manifest->checksum = checksum;
+  manifest->blockSize = blockSize;
+  manifest->size = 0;
+  manifest->blockCount = 0;
+  manifest->hashes = NULL;
+}
+
+void xcp_io_checksum_manifest_uninit (XcpIoChecksumManifest *manifest) {
+  free(manifest->hashes);
+  manifest->hashes = NULL;
+  manifest->blockCount = 0;
+  manifest->size = 0;
+}
+
+int xcp_io_checksum_manifest_set_size (XcpIoChecksumManifest *manifest, uint64_t size) {
+  if (!manifest->blockSize)
+    return -EINVAL;
+
+  const uint64_t blockCount = size / manifest->blockSize + (size % manifest->blockSize ? 1 : 0);
+  if (blockCount > SIZE_MAX / sizeof *manifest->hashes)
+    return -ENOMEM;
+
+  uint64_t *hashes = NULL;
+  if (blockCount && !(hashes = calloc((size_t)blockCount, sizeof *hashes)))
+    return -ENOMEM;
+
+  free(manifest->hashes);
+  manifest->hashes = hashes;
+  manifest->blockCount = (size_t)blockCount;
+  manifest->size = size;
+  return 0;
+}
+
+uint64_t xcp_io_checksum_manifest_get_digest (const XcpIoChecksumManifest *manifest) {
+  if (manifest->checksum == XcpIoChecksumCrc32c) {
+    uint32_t crc = 0;
+    for (size_t i = 0; i < manifest->blockCount; ++i) {
+      crc = xcp_io_crc32c_combine(
+        crc, (uint32_t)manifest->hashes[i], xcp_io_checksum_manifest_get_block_size(manifest, i)
+      );
+    }
+    return crc;
+  }
+
+  if (manifest->checksum == XcpIoChecksumXxh3) {
+    #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return xcp_io_xxh3(manifest->hashes, manifest->blockCount * sizeof *manifest->hashes);
+    #else
+      unsigned char *list = malloc(manifest->blockCount * sizeof *manifest->hashes);
+      if (!list)
+        return 0;
+      for (size_t i = 0; i < manifest->blockCount; ++i)
+        write_le64(list + i * sizeof *manifest->hashes, manifest->hashes[i]);
+      const uint64_t digest = xcp_io_xxh3(list, manifest->blockCount * sizeof *manifest->hashes);
+      free(list);
+      return digest;
+    #endif
+  }
+
+  return 0;
+}
@@ -0,0 +1,885 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xcp-ng/async-io/io-copy.h"
+#include "xcp-ng/async-io/io-req-pool.h"
+#include "io-req-internal.h"
+
+// =============================================================================
+
+// State of a block copied with splice requests: in -> pipe, then pipe -> out until the block is moved.
+// A block of zeros of the buffered copy only uses buf.
+typedef struct XcpIoCopyBlock {
+  off_t inOffset;
+  size_t size;
+  size_t done;  // Bytes written in out.
+  size_t piped; // Bytes in the pipe.
+  int pipe[2];
+
+  void *buf; // Buffer of a block of zeros, written if the range can't be cleared.
+} XcpIoCopyBlock;
+
+typedef enum {
+  SpliceStateUnknown,
+  SpliceStateSupported,
+  SpliceStateUnsupported
+} SpliceState;
+
+// How the blocks of zeros are written in out, the next mode is used if one is not supported.
+typedef enum {
+  ZeroModeDiscard,
+  ZeroModeWriteZeroes,
+  ZeroModeWrite
+} ZeroMode;
+
+typedef struct XcpIoCopy {
+  XcpIoQueue *queue;
+  const XcpIoCopyOptions *options;
+
+  // Requests of the blocks, allocated only if a copy method uses the queue.
+  XcpIoReqPool reqPool;
+  bool hasReqPool;
+
+  // State of each request, indexed by pool index.
+  XcpIoCopyBlock *blocks;
+  SpliceState spliceState;
+
+  bool useCopyFileRange;
+
+  bool detectZeroes;
+  ZeroMode zeroMode;
+
+  // Hashes of the input blocks, NULL if the copy has no manifest.
+  XcpIoChecksumManifest *manifest;
+  off_t inStart;
+
+  // Hashes of the blocks in the holes of the input, computed at the first hole.
+  bool hasZeroHashes;
+  uint64_t zeroHash;
+  uint64_t lastZeroHash; // Hash of the last block, it can be smaller.
+
+  // Fds used by the requests: file indexes with XcpIoCopyFlagFixedFiles.
+  int in;
+  int out;
+
+  // Fds used by the syscalls.
+  int inFd;
+  int outFd;
+
+  // Difference between the output and input offsets of a block.
+  off_t outDelta;
+
+  // Initial size of out, INT64_MAX if it's not a regular file.
+  off_t outSize;
+
+  // Number of blocks being copied.
+  size_t blockCount;
+
+  // First error, no block is started after it.
+  int err;
+
+  XcpIoCopyProgress progress;
+  bool progressChanged;
+} XcpIoCopy;
+
+// -----------------------------------------------------------------------------
+
+static inline int get_file_size (int fd, off_t *size) {
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return -errno;
+
+  if (S_ISREG(st.st_mode)) {
+    *size = st.st_size;
+    return 0;
+  }
+  if (S_ISBLK(st.st_mode))
+    return ioctl(fd, BLKGETSIZE64, size) ? -errno : 0;
+
+  return -EINVAL;
+}
+
+// Find the first data extent of [offset, end[ in [*dataStart, *dataEnd[.
+// If the file has no data in this range, *dataStart is equal to end.
+static inline void find_data_extent (int fd, off_t offset, off_t end, off_t *dataStart, off_t *dataEnd) {
+  off_t start = lseek(fd, offset, SEEK_DATA);
+  if (start < 0) {
+    // ENXIO: no data after offset. Otherwise SEEK_DATA is not supported, all the range is data.
+    start = errno == ENXIO ? end : offset;
+    *dataStart = start;
+    *dataEnd = end;
+    return;
+  }
+
+  if (start >= end) {
+    *dataStart = *dataEnd = end;
+    return;
+  }
+
+  off_t hole = lseek(fd, start, SEEK_HOLE);
+  *dataStart = start;
+  *dataEnd = hole < 0 || hole > end ? end : hole;
+}
+
+// Make sure a range of out reads as zeros without writing it.
+// Returns false if the range must be written.
+static inline bool clear_range (int fd, off_t offset, off_t len) {
+  if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len))
+    return true;
+
+  // Punching is not supported, try to zero the range.
+  if (errno == EINVAL || errno == EOPNOTSUPP || errno == ENODEV)
+    return !fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len);
+  return false;
+}
+
+// Returns true if an offload syscall failed because it can't be used with these files.
+static inline bool is_unsupported_error (int err) {
+  return err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == ENOSYS || err == ENOTTY || err == EBADF;
+}
+
+static inline void close_pipe (int pipe[2]) {
+  if (pipe[0] >= 0) {
+    close(pipe[0]);
+    close(pipe[1]);
+    pipe[0] = pipe[1] = -1;
+  }
+}
+
+// Open a pipe large enough to contain a block if possible, a smaller pipe only increases the splice count.
+static inline int open_pipe (int pipe[2], size_t size) {
+  if (pipe2(pipe, O_CLOEXEC) < 0)
+    return -errno;
+  if (size <= INT_MAX)
+    fcntl(pipe[0], F_SETPIPE_SZ, (int)size);
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+static inline void set_error (XcpIoCopy *copy, int err) {
+  if (!copy->err)
+    copy->err = err;
+}
+
+static inline XcpIoCopyBlock *get_block (XcpIoCopy *copy, const XcpIoReq *req) {
+  return &copy->blocks[xcp_io_req_pool_get_index(&copy->reqPool, req)];
+}
+
+static void prep_req (
+  XcpIoCopy *copy, XcpIoReq *req, bool isRead, void *buf, size_t size, off_t offset, uint16_t bufIndex
+) {
+  const bool useFixedBuffers = copy->options->flags & XcpIoCopyFlagFixedBuffers;
+  const int fd = isRead ? copy->in : copy->out;
+  if (useFixedBuffers)
+    xcp_io_req_prep_rw_fixed(
+      req, isRead ? XcpIoOpcodeReadFixed : XcpIoOpcodeWriteFixed, fd, buf, size, offset, bufIndex
+    );
+  else
+    xcp_io_req_prep_rw(req, isRead ? XcpIoOpcodeRead : XcpIoOpcodeWrite, fd, buf, size, offset);
+
+  if (copy->options->flags & XcpIoCopyFlagFixedFiles)
+    xcp_io_req_set_fixed_file(req, fd);
+  xcp_io_req_set_tenant(req, copy->options->tenant);
+  xcp_io_req_set_user_data(req, copy);
+}
+
+static void release_block (XcpIoCopy *copy, XcpIoReq *req) {
+  if (copy->options->flags & XcpIoCopyFlagFixedBuffers)
+    xcp_io_queue_put_buffer(copy->queue, req->bufIndex);
+  xcp_io_req_pool_put(&copy->reqPool, req);
+  --copy->blockCount;
+}
+
+static inline void set_block_hash (XcpIoCopy *copy, const XcpIoReq *req) {
+  if (copy->manifest) {
+    const uint64_t offset = (uint64_t)(xcp_io_req_get_offset(req) - copy->inStart);
+    copy->manifest->hashes[offset / copy->manifest->blockSize] = xcp_io_req_get_hash(req);
+  }
+}
+
+// Set the hashes of the blocks of a hole, [offset, offset + len[ is relative to the range and aligned
+// on the manifest blocks (except at the end of the range).
+static int set_hole_hashes (XcpIoCopy *copy, off_t offset, off_t len) {
+  XcpIoChecksumManifest *manifest = copy->manifest;
+  const size_t blockSize = manifest->blockSize;
+  if (!copy->hasZeroHashes) {
+    void *zeros = calloc(1, blockSize);
+    if (!zeros)
+      return -ENOMEM;
+    copy->zeroHash = xcp_io_checksum_compute(manifest->checksum, zeros, blockSize);
+    copy->lastZeroHash = xcp_io_checksum_compute(
+      manifest->checksum, zeros, xcp_io_checksum_manifest_get_block_size(manifest, manifest->blockCount - 1)
+    );
+    copy->hasZeroHashes = true;
+    free(zeros);
+  }
+
+  const size_t end = (size_t)(((uint64_t)(offset + len) + blockSize - 1) / blockSize);
+  for (size_t i = (size_t)offset / blockSize; i < end; ++i)
+    manifest->hashes[i] = i == manifest->blockCount - 1 ? copy->lastZeroHash : copy->zeroHash;
+  return 0;
+}
+
+static void write_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XcpIoCopy *copy = userArg;
+
+  // -ECANCELED in linked mode: the read failed and its error is already set.
+  if (err)
+    set_error(copy, err);
+  else {
+    copy->progress.copiedBytes += xcp_io_req_get_size(req);
+    copy->progressChanged = true;
+  }
+  release_block(copy, req);
+}
+
+// Linked mode: the buffer belongs to the write request, so the read request can be released first.
+static void linked_read_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XcpIoCopy *copy = userArg;
+  if (err)
+    set_error(copy, err);
+  else
+    set_block_hash(copy, req);
+  xcp_io_req_pool_put(&copy->reqPool, req);
+}
+
+static void zero_completion_cb (XcpIoReq *req, int err, void *userArg);
+
+// Clear a block of zeros in out with the current zero mode, or write it.
+static void submit_zero_block (XcpIoCopy *copy, XcpIoReq *req, void *buf, size_t size, off_t outOffset) {
+  if (copy->zeroMode == ZeroModeWrite) {
+    prep_req(copy, req, false, buf, size, outOffset, req->bufIndex);
+    xcp_io_req_set_cb(req, write_completion_cb);
+  } else {
+    get_block(copy, req)->buf = buf;
+    if (copy->zeroMode == ZeroModeDiscard)
+      xcp_io_req_prep_discard(req, copy->out, outOffset, size);
+    else
+      xcp_io_req_prep_write_zeroes(req, copy->out, outOffset, size);
+    if (copy->options->flags & XcpIoCopyFlagFixedFiles)
+      xcp_io_req_set_fixed_file(req, copy->out);
+    xcp_io_req_set_tenant(req, copy->options->tenant);
+    xcp_io_req_set_cb(req, zero_completion_cb);
+    xcp_io_req_set_user_data(req, copy);
+  }
+  xcp_io_queue_insert_or_complete(copy->queue, req);
+}
+
+static inline void add_zero_bytes (XcpIoCopy *copy, size_t size) {
+  copy->progress.copiedBytes += size;
+  copy->progress.zeroBytes += size;
+  copy->progressChanged = true;
+}
+
+static void zero_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XcpIoCopy *copy = userArg;
+  if (!err) {
+    add_zero_bytes(copy, xcp_io_req_get_size(req));
+    release_block(copy, req);
+    return;
+  }
+
+  if (err != -EINVAL && err != -EOPNOTSUPP && err != -ENODEV) {
+    set_error(copy, err);
+    release_block(copy, req);
+    return;
+  }
+
+  // The mode of this request is not supported, other requests may already use the next one.
+  const ZeroMode mode = req->opFlags & FALLOC_FL_PUNCH_HOLE ? ZeroModeDiscard : ZeroModeWriteZeroes;
+  if (copy->zeroMode == mode)
+    copy->zeroMode = mode == ZeroModeDiscard ? ZeroModeWriteZeroes : ZeroModeWrite;
+  submit_zero_block(copy, req, get_block(copy, req)->buf, xcp_io_req_get_size(req), xcp_io_req_get_offset(req));
+}
+
+static void read_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XcpIoCopy *copy = userArg;
+  if (err) {
+    set_error(copy, err);
+    release_block(copy, req);
+    return;
+  }
+
+  set_block_hash(copy, req);
+  if (copy->detectZeroes && xcp_io_req_is_zero(req)) {
+    const off_t outOffset = xcp_io_req_get_offset(req) + copy->outDelta;
+
+    // After the initial end of out, the range is already a hole.
+    if (outOffset >= copy->outSize) {
+      add_zero_bytes(copy, xcp_io_req_get_size(req));
+      release_block(copy, req);
+    } else
+      submit_zero_block(copy, req, xcp_io_req_get_addr(req), xcp_io_req_get_size(req), outOffset);
+    return;
+  }
+
+  // Reuse the read request to write the block.
+  prep_req(
+    copy, req, false, xcp_io_req_get_addr(req), xcp_io_req_get_size(req), xcp_io_req_get_offset(req) + copy->outDelta,
+    req->bufIndex
+  );
+  xcp_io_req_set_cb(req, write_completion_cb);
+  xcp_io_queue_insert_or_complete(copy->queue, req);
+}
+
+// Start the copy of one block. Returns false if no buffer is available.
+static bool copy_block (XcpIoCopy *copy, off_t inOffset, size_t size) {
+  const bool useLinks = copy->options->flags & XcpIoCopyFlagLinks;
+
+  void *buf = NULL;
+  uint16_t bufIndex = 0;
+  if (copy->options->flags & XcpIoCopyFlagFixedBuffers) {
+    if (!(buf = xcp_io_queue_get_buffer(copy->queue, &bufIndex)))
+      return false;
+  }
+
+  // Request count is equal to the depth multiplied by the number of requests per block.
+  XcpIoReq *req = xcp_io_req_pool_get(&copy->reqPool);
+  XcpIoReq *writeReq = useLinks ? xcp_io_req_pool_get(&copy->reqPool) : NULL;
+  assert(req && (writeReq || !useLinks));
+
+  if (!(copy->options->flags & XcpIoCopyFlagFixedBuffers))
+    buf = xcp_io_req_pool_get_data(&copy->reqPool, writeReq ? writeReq : req);
+
+  prep_req(copy, req, true, buf, size, inOffset, bufIndex);
+  if (copy->manifest)
+    xcp_io_req_set_checksum(req, copy->manifest->checksum);
+  if (copy->detectZeroes)
+    xcp_io_req_set_zero_check(req);
+  if (!writeReq)
+    xcp_io_req_set_cb(req, read_completion_cb);
+  else {
+    prep_req(copy, writeReq, false, buf, size, inOffset + copy->outDelta, bufIndex);
+    xcp_io_req_set_cb(writeReq, write_completion_cb);
+    xcp_io_req_set_cb(req, linked_read_completion_cb);
+    xcp_io_req_link(req, writeReq, false);
+  }
+
+  ++copy->blockCount;
+  xcp_io_queue_insert_or_complete(copy->queue, req);
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+
+static void splice_in_completion_cb (XcpIoReq *req, int err, void *userArg);
+static void splice_out_completion_cb (XcpIoReq *req, int err, void *userArg);
+
+static void submit_splice_in (XcpIoCopy *copy, XcpIoReq *req, const XcpIoCopyBlock *splice) {
+  const uint32_t flags = copy->options->flags & XcpIoCopyFlagFixedFiles ? SPLICE_F_FD_IN_FIXED : 0;
+  xcp_io_req_prep_splice(
+    req, copy->in, splice->inOffset + (off_t)splice->done, splice->pipe[1], -1, splice->size - splice->done, flags
+  );
+  xcp_io_req_set_tenant(req, copy->options->tenant);
+  xcp_io_req_set_cb(req, splice_in_completion_cb);
+  xcp_io_req_set_user_data(req, copy);
+  xcp_io_queue_insert_or_complete(copy->queue, req);
+}
+
+static void submit_splice_out (XcpIoCopy *copy, XcpIoReq *req, const XcpIoCopyBlock *splice) {
+  xcp_io_req_prep_splice(
+    req, splice->pipe[0], -1, copy->out, splice->inOffset + (off_t)splice->done + copy->outDelta, splice->piped, 0
+  );
+  if (copy->options->flags & XcpIoCopyFlagFixedFiles)
+    xcp_io_req_set_fixed_file(req, copy->out);
+  xcp_io_req_set_tenant(req, copy->options->tenant);
+  xcp_io_req_set_cb(req, splice_out_completion_cb);
+  xcp_io_req_set_user_data(req, copy);
+  xcp_io_queue_insert_or_complete(copy->queue, req);
+}
+
+// The pipe may contain data of the failed block, it's closed and reopened by the next block.
+static void fail_splice (XcpIoCopy *copy, XcpIoReq *req, XcpIoCopyBlock *splice, int err) {
+  set_error(copy, err);
+  close_pipe(splice->pipe);
+  xcp_io_req_pool_put(&copy->reqPool, req);
+  --copy->blockCount;
+}
+
+static void splice_in_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XcpIoCopy *copy = userArg;
+  XcpIoCopyBlock *splice = get_block(copy, req);
+
+  // 0: end of file, the input is smaller than expected.
+  const int res = err ? err : xcp_io_req_get_result(req);
+  if (res <= 0) {
+    fail_splice(copy, req, splice, res ? res : -EIO);
+    return;
+  }
+
+  splice->piped = (size_t)res;
+  submit_splice_out(copy, req, splice);
+}
+
+static void splice_out_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XcpIoCopy *copy = userArg;
+  XcpIoCopyBlock *splice = get_block(copy, req);
+
+  const int res = err ? err : xcp_io_req_get_result(req);
+  if (res <= 0) {
+    fail_splice(copy, req, splice, res ? res : -EIO);
+    return;
+  }
+
+  splice->piped -= (size_t)res;
+  splice->done += (size_t)res;
+  copy->progress.copiedBytes += (uint64_t)res;
+  copy->progress.offloadedBytes += (uint64_t)res;
+  copy->progressChanged = true;
+
+  // Continue short transfers: empty the pipe, then fill it with the rest of the block.
+  if (splice->piped)
+    submit_splice_out(copy, req, splice);
+  else if (splice->done < splice->size)
+    submit_splice_in(copy, req, splice);
+  else {
+    xcp_io_req_pool_put(&copy->reqPool, req);
+    --copy->blockCount;
+  }
+}
+
+// Start the copy of one block with splice requests.
+static int splice_block (XcpIoCopy *copy, off_t inOffset, size_t size) {
+  XcpIoReq *req = xcp_io_req_pool_get(&copy->reqPool);
+  assert(req);
+
+  XcpIoCopyBlock *splice = get_block(copy, req);
+  if (splice->pipe[0] < 0) {
+    const int ret = open_pipe(splice->pipe, copy->options->blockSize);
+    if (ret < 0) {
+      xcp_io_req_pool_put(&copy->reqPool, req);
+      return ret;
+    }
+  }
+
+  splice->inOffset = inOffset;
+  splice->size = size;
+  splice->done = 0;
+  splice->piped = 0;
+
+  ++copy->blockCount;
+  submit_splice_in(copy, req, splice);
+  return 0;
+}
+
+// Copy a block with the splice syscall to know if splice can be used with in and out.
+// Returns the copied size, 0 if splice is not supported, or a negative errno.
+static ssize_t probe_splice (XcpIoCopy *copy, off_t inOffset, size_t size) {
+  int pipe[2];
+  int ret;
+  if ((ret = open_pipe(pipe, size)) < 0)
+    return ret;
+
+  off_t outOffset = inOffset + copy->outDelta;
+  size_t done = 0;
+  while (done < size) {
+    ssize_t piped = splice(copy->inFd, &inOffset, pipe[1], NULL, size - done, 0);
+    if (piped <= 0) {
+      ret = piped ? -errno : -EIO;
+      goto end;
+    }
+
+    while (piped) {
+      const ssize_t written = splice(pipe[0], NULL, copy->outFd, &outOffset, (size_t)piped, 0);
+      if (written <= 0) {
+        ret = written ? -errno : -EIO;
+        goto end;
+      }
+      piped -= written;
+      done += (size_t)written;
+    }
+  }
+
+end:
+  close_pipe(pipe);
+
+  // After a partial copy, the next splice requests report the error (if it persists).
+  if (done)
+    return (ssize_t)done;
+  return is_unsupported_error(-ret) ? 0 : ret;
+}
+
+// Copy a part of an extent with copy_file_range.
+// Returns the copied size, 0 if copy_file_range is not supported, or a negative errno.
+static ssize_t copy_file_range_chunk (XcpIoCopy *copy, off_t inOffset, size_t size) {
+  off_t outOffset = inOffset + copy->outDelta;
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t ret = copy_file_range(copy->inFd, &inOffset, copy->outFd, &outOffset, size - done, 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      if (!done && !copy->progress.offloadedBytes && is_unsupported_error(errno))
+        return 0;
+      return -errno;
+    }
+    if (!ret)
+      return -EIO; // The input is smaller than expected.
+    done += (size_t)ret;
+  }
+  return (ssize_t)done;
+}
+
+// -----------------------------------------------------------------------------
+
+static inline void notify_progress (XcpIoCopy *copy) {
+  if (copy->progressChanged && copy->options->progressCb)
+    copy->options->progressCb(&copy->progress, copy->options->progressUserArg);
+  copy->progressChanged = false;
+}
+
+// Wait until all the started blocks are copied.
+// Returns false if the queue is broken: the inflight requests are abandoned.
+static bool drain_blocks (XcpIoCopy *copy) {
+  bool failed = false;
+  while (copy->blockCount) {
+    const int ret = xcp_io_queue_process(copy->queue);
+    if (!ret) {
+      failed = false;
+      notify_progress(copy);
+      continue;
+    }
+
+    // Cancel the pending requests and retry once before giving up.
+    set_error(copy, ret);
+    if (failed)
+      return false;
+    failed = true;
+    xcp_io_queue_cancel(copy->queue);
+  }
+  return true;
+}
+
+static void sync_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XcpIoCopy *copy = userArg;
+  if (err)
+    set_error(copy, err);
+  xcp_io_req_pool_put(&copy->reqPool, req);
+  --copy->blockCount;
+}
+
+// Allocate the requests of the blocks. The fsync uses the request of a block.
+static int init_req_pool (XcpIoCopy *copy) {
+  const XcpIoCopyOptions *options = copy->options;
+  const size_t count = options->depth * (options->flags & XcpIoCopyFlagLinks ? 2 : 1);
+  const size_t dataSize = options->flags & XcpIoCopyFlagFixedBuffers ? 0 : options->blockSize;
+  const unsigned int reqPoolFlags = options->flags & XcpIoCopyFlagHugePages ? XcpIoReqPoolFlagHugePages : 0;
+
+  if (!(copy->blocks = malloc(count * sizeof *copy->blocks)))
+    return -ENOMEM;
+  for (size_t i = 0; i < count; ++i)
+    copy->blocks[i].pipe[0] = copy->blocks[i].pipe[1] = -1;
+
+  const int ret = xcp_io_req_pool_init(&copy->reqPool, count, dataSize, reqPoolFlags);
+  if (ret < 0) {
+    free(copy->blocks);
+    copy->blocks = NULL;
+    return ret;
+  }
+
+  copy->hasReqPool = true;
+  return 0;
+}
+
+static void uninit_req_pool (XcpIoCopy *copy) {
+  if (!copy->hasReqPool)
+    return;
+
+  for (size_t i = 0; i < copy->reqPool.count; ++i)
+    close_pipe(copy->blocks[i].pipe);
+  free(copy->blocks);
+  xcp_io_req_pool_uninit(&copy->reqPool);
+}
+
+// Share the extents of the range between in and out. Fails if the files are not on the same reflink
+// filesystem, or if the range is not aligned on the filesystem block size (except at the end of in).
+static inline bool clone_range (const XcpIoCopy *copy, off_t inOffset, uint64_t len) {
+  struct file_clone_range range;
+  range.src_fd = copy->inFd;
+  range.src_offset = (uint64_t)inOffset;
+  range.src_length = len;
+  range.dest_offset = (uint64_t)(inOffset + copy->outDelta);
+  return !ioctl(copy->outFd, FICLONERANGE, &range);
+}
+
+// Copy [offset, end[ (relative to the range) with the blocks of copy.
+// Holes are skipped if the initial size of out is not reached, or if they can be cleared.
+static void copy_extents (XcpIoCopy *copy, int in, off_t inOffset, int out, off_t outOffset, off_t len) {
+  const off_t outSize = copy->outSize;
+  const XcpIoCopyOptions *options = copy->options;
+  const bool sparse = !(options->flags & XcpIoCopyFlagNoSparse);
+  bool canClear = true;
+
+  off_t offset = 0;
+  off_t extentEnd = 0;
+  while (offset < len && !copy->err) {
+    // 1. Find the next data extent, the holes before it are skipped.
+    if (offset == extentEnd) {
+      if (!sparse)
+        extentEnd = len;
+      else {
+        off_t dataStart, dataEnd;
+        find_data_extent(in, inOffset + offset, inOffset + len, &dataStart, &dataEnd);
+        dataStart -= inOffset;
+        dataEnd -= inOffset;
+
+        // Each read of a manifest block is hashed: extend the extents to the block limits.
+        if (copy->manifest) {
+          const off_t blockSize = (off_t)options->blockSize;
+          dataStart -= dataStart % blockSize;
+          if (dataEnd % blockSize && (dataEnd += blockSize - dataEnd % blockSize) > len)
+            dataEnd = len;
+        }
+
+        if (dataStart > offset) {
+          const off_t holeLen = dataStart - offset;
+          const off_t holeOffset = outOffset + offset;
+
+          // The part of the hole after the initial end of out is already a hole.
+          const off_t dirtyLen = holeOffset >= outSize
+            ? 0
+            : (outSize - holeOffset < holeLen ? outSize - holeOffset : holeLen);
+          if (dirtyLen && !(canClear = canClear && clear_range(out, holeOffset, dirtyLen))) {
+            // The hole must be written: copy it like data.
+            dataStart = offset;
+          } else {
+            int ret;
+            if (copy->manifest && (ret = set_hole_hashes(copy, offset, holeLen)) < 0) {
+              set_error(copy, ret);
+              break;
+            }
+            copy->progress.skippedBytes += (uint64_t)holeLen;
+            copy->progressChanged = true;
+          }
+        }
+
+        offset = dataStart;
+        extentEnd = dataEnd;
+        continue;
+      }
+    }
+
+    // 2. Copy the extent with the first working method.
+    if (copy->useCopyFileRange) {
+      const size_t maxSize = options->blockSize * options->depth;
+      const ssize_t size = copy_file_range_chunk(
+        copy, inOffset + offset, (size_t)(extentEnd - offset) < maxSize ? (size_t)(extentEnd - offset) : maxSize
+      );
+      if (size < 0) {
+        set_error(copy, (int)size);
+        break;
+      }
+      if (!size)
+        copy->useCopyFileRange = false;
+      else {
+        offset += size;
+        copy->progress.copiedBytes += (uint64_t)size;
+        copy->progress.offloadedBytes += (uint64_t)size;
+        copy->progressChanged = true;
+        notify_progress(copy);
+      }
+      continue;
+    }
+
+    int ret;
+    if (!copy->hasReqPool && (ret = init_req_pool(copy)) < 0) {
+      set_error(copy, ret);
+      break;
+    }
+
+    if (copy->spliceState == SpliceStateUnknown) {
+      const size_t maxSize = options->blockSize;
+      const ssize_t size = probe_splice(
+        copy, inOffset + offset, (size_t)(extentEnd - offset) < maxSize ? (size_t)(extentEnd - offset) : maxSize
+      );
+      if (size < 0) {
+        set_error(copy, (int)size);
+        break;
+      }
+      copy->spliceState = size ? SpliceStateSupported : SpliceStateUnsupported;
+      offset += size;
+      copy->progress.copiedBytes += (uint64_t)size;
+      copy->progress.offloadedBytes += (uint64_t)size;
+      copy->progressChanged = true;
+      continue;
+    }
+
+    while (offset < extentEnd && copy->blockCount < options->depth) {
+      const size_t size = (size_t)(extentEnd - offset) < options->blockSize
+        ? (size_t)(extentEnd - offset)
+        : options->blockSize;
+      if (copy->spliceState == SpliceStateSupported) {
+        if ((ret = splice_block(copy, inOffset + offset, size)) < 0) {
+          set_error(copy, ret);
+          break;
+        }
+      } else if (!copy_block(copy, inOffset + offset, size))
+        break;
+      offset += (off_t)size;
+    }
+
+    // Start the next extent without waiting if the depth is not reached.
+    if (offset == extentEnd)
+      continue;
+
+    // 3. Wait for free blocks.
+    if (!copy->blockCount) {
+      // No buffer and nothing to wait for: the registered buffers are used elsewhere.
+      set_error(copy, -ENOBUFS);
+      break;
+    }
+
+    if ((ret = xcp_io_queue_process(copy->queue)) < 0)
+      set_error(copy, ret);
+    notify_progress(copy);
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+int xcp_io_copy_range (
+  XcpIoQueue *queue, int in, off_t inOffset, int out, off_t outOffset, uint64_t len,
+  const XcpIoCopyOptions *options, XcpIoCopyProgress *progress
+) {
+  if (!options->depth || !options->blockSize || inOffset < 0 || outOffset < 0)
+    return -EINVAL;
+  if (xcp_io_queue_has_batch_cb(queue))
+    return -EBUSY;
+  if ((options->flags & XcpIoCopyFlagFixedBuffers) && xcp_io_queue_get_buffer_size(queue) < options->blockSize)
+    return -EINVAL;
+  if (options->depth > SIZE_MAX / 2 / options->blockSize)
+    return -EINVAL;
+  if (options->manifest && (options->manifest->blockSize != options->blockSize || !options->manifest->checksum))
+    return -EINVAL;
+
+  XcpIoCopy copy;
+  memset(&copy, 0, sizeof copy);
+  copy.queue = queue;
+  copy.options = options;
+  // The blocks of zeros are only detected and hashed by the buffered copy.
+  copy.detectZeroes = (options->flags & XcpIoCopyFlagDetectZeroes) && !(options->flags & XcpIoCopyFlagLinks);
+  copy.manifest = options->manifest;
+  copy.inStart = inOffset;
+  const bool needsBuffers = copy.detectZeroes || copy.manifest;
+  copy.spliceState = (options->flags & XcpIoCopyFlagNoSplice) || needsBuffers
+    ? SpliceStateUnsupported
+    : SpliceStateUnknown;
+  copy.useCopyFileRange = !(options->flags & XcpIoCopyFlagNoCopyFileRange) && !xcp_io_queue_has_rate_limits(queue) &&
+    !needsBuffers;
+  copy.in = copy.inFd = in;
+  copy.out = copy.outFd = out;
+  copy.outDelta = outOffset - inOffset;
+
+  int ret;
+
+  // 1. Reduce the range to the input size, and extend a regular output file to the end of the range.
+  off_t size;
+  if (!get_file_size(in, &size))
+    len = inOffset >= size ? 0 : ((uint64_t)(size - inOffset) < len ? (uint64_t)(size - inOffset) : len);
+
+  if (len > (uint64_t)(INT64_MAX - outOffset))
+    return -EINVAL;
+
+  copy.outSize = INT64_MAX;
+  struct stat st;
+  if (fstat(out, &st) < 0)
+    return -errno;
+  if (S_ISREG(st.st_mode)) {
+    copy.outSize = st.st_size;
+    if (copy.outSize < outOffset + (off_t)len && ftruncate(out, outOffset + (off_t)len) < 0)
+      return -errno;
+  }
+
+  copy.progress.size = len;
+  if (copy.manifest && (ret = xcp_io_checksum_manifest_set_size(copy.manifest, len)) < 0)
+    return ret;
+
+  if (options->flags & XcpIoCopyFlagFixedFiles) {
+    if ((copy.in = xcp_io_queue_register_file(queue, in)) < 0)
+      return copy.in;
+    if ((copy.out = xcp_io_queue_register_file(queue, out)) < 0) {
+      xcp_io_queue_unregister_file(queue, copy.in);
+      return copy.out;
+    }
+  }
+
+  // 2. Copy.
+  if (len && !(options->flags & XcpIoCopyFlagNoReflink) && !copy.manifest && clone_range(&copy, inOffset, len)) {
+    copy.progress.copiedBytes = copy.progress.offloadedBytes = len;
+    copy.progressChanged = true;
+  } else
+    copy_extents(&copy, in, inOffset, out, outOffset, (off_t)len);
+
+  if (!drain_blocks(&copy)) {
+    // The requests can't be released while they are in the queue.
+    ret = copy.err;
+    goto end;
+  }
+
+  // 3. Flush out. The barrier is not necessary if the queue is only used by the copy,
+  // but it ensures the flush is executed after any write in the general case.
+  if ((options->flags & XcpIoCopyFlagFdatasync) && !copy.err) {
+    if (!copy.hasReqPool && (ret = init_req_pool(&copy)) < 0)
+      set_error(&copy, ret);
+    else {
+      XcpIoReq *req = xcp_io_req_pool_get(&copy.reqPool);
+      assert(req);
+
+      xcp_io_req_prep_fsync(req, copy.out, true);
+      if (options->flags & XcpIoCopyFlagFixedFiles)
+        xcp_io_req_set_fixed_file(req, copy.out);
+      xcp_io_req_set_barrier(req);
+      xcp_io_req_set_tenant(req, options->tenant);
+      xcp_io_req_set_cb(req, sync_completion_cb);
+      xcp_io_req_set_user_data(req, &copy);
+
+      ++copy.blockCount;
+      xcp_io_queue_insert_or_complete(queue, req);
+      if (!drain_blocks(&copy)) {
+        ret = copy.err;
+        goto end;
+      }
+    }
+  }
+
+  notify_progress(&copy);
+  ret = copy.err;
+
+  if (options->flags & XcpIoCopyFlagFixedFiles) {
+    xcp_io_queue_unregister_file(queue, copy.out);
+    xcp_io_queue_unregister_file(queue, copy.in);
+  }
+
+  uninit_req_pool(&copy);
+
+end:
+  if (progress)
+    *progress = copy.progress;
+  return ret;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "xcp-ng/async-io/io-device.h"
+
+// =============================================================================
+
+#define DEFAULT_LOGICAL_BLOCK_SIZE 512
+
+// Read an unsigned integer in a sysfs file, returns false if the file doesn't exist or is invalid.
+static bool read_sysfs_value (const char *dir, const char *name, uint64_t *value) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof path, "%s/%s", dir, name) >= (int)sizeof path)
+    return false;
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  char buf[32];
+  const ssize_t size = read(fd, buf, sizeof buf - 1);
+  close(fd);
+  if (size <= 0)
+    return false;
+  buf[size] = '\0';
+
+  char *end;
+  errno = 0;
+  const unsigned long long result = strtoull(buf, &end, 10);
+  if (errno || end == buf || (*end && *end != '\n'))
+    return false;
+
+  *value = (uint64_t)result;
+  return true;
+}
+
+static inline bool is_power_of_2 (uint64_t value) {
+  return value && !(value & (value - 1));
+}
+
+// -----------------------------------------------------------------------------
+
+int xcp_io_device_limits_init (XcpIoDeviceLimits *limits, int fd) {
+  limits->maxTransferSize = 0;
+  limits->maxSegmentCount = IOV_MAX;
+  limits->logicalBlockSize = DEFAULT_LOGICAL_BLOCK_SIZE;
+  limits->optimalTransferSize = 0;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return -errno;
+
+  const bool isBlockDevice = S_ISBLK(st.st_mode);
+  const dev_t dev = isBlockDevice ? st.st_rdev : st.st_dev;
+
+  // 1. Find the queue directory: a partition uses the queue of its disk.
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof dir, "/sys/dev/block/%u:%u", major(dev), minor(dev));
+
+  uint64_t value;
+  if (read_sysfs_value(dir, "partition", &value))
+    snprintf(dir, sizeof dir, "/sys/dev/block/%u:%u/../queue", major(dev), minor(dev));
+  else
+    snprintf(dir, sizeof dir, "/sys/dev/block/%u:%u/queue", major(dev), minor(dev));
+
+  // 2. Read the limits, the invalid values are ignored.
+  if (read_sysfs_value(dir, "max_sectors_kb", &value) && value && value <= SIZE_MAX / 1024)
+    limits->maxTransferSize = (size_t)value * 1024;
+  if (read_sysfs_value(dir, "max_segments", &value) && value && value < IOV_MAX)
+    limits->maxSegmentCount = (size_t)value;
+  if (read_sysfs_value(dir, "logical_block_size", &value) && is_power_of_2(value))
+    limits->logicalBlockSize = (size_t)value;
+  if (read_sysfs_value(dir, "optimal_io_size", &value))
+    limits->optimalTransferSize = (size_t)value;
+
+  // 3. The ioctl gives the block size of the device itself, even without sysfs.
+  int blockSize;
+  if (isBlockDevice && ioctl(fd, BLKSSZGET, &blockSize) == 0 && blockSize > 0 && is_power_of_2((uint64_t)blockSize))
+    limits->logicalBlockSize = (size_t)blockSize;
+
+  return 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "xcp-ng/async-io/io-engine.h"
+#include "io-req-internal.h"
+
+// =============================================================================
+
+// Wake up the thread of a queue, the counter is reset by wake_completion_cb.
+static inline void wake_queue (XcpIoEngineQueue *engineQueue) {
+  const uint64_t value = 1;
+  while (write(engineQueue->pImpl.wakeFd, &value, sizeof value) < 0 && errno == EINTR);
+}
+
+static void wake_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XCP_UNUSED(err);
+
+  XcpIoEngineQueue *engineQueue = userArg;
+
+  // The eventfd is non-blocking, the read can fail if another wake up was processed before.
+  uint64_t value;
+  while (read(engineQueue->pImpl.wakeFd, &value, sizeof value) < 0 && errno == EINTR);
+
+  // Rearm the poll request, so the wake request is always either pending or inflight.
+  xcp_io_queue_insert(&engineQueue->queue, req);
+}
+
+// -----------------------------------------------------------------------------
+
+// Move the inbox content in the backlog.
+static inline void fetch_inbox (XcpIoEngineQueue *engineQueue) {
+  XcpIoReq *reqs = atomic_exchange_explicit(&engineQueue->pImpl.inbox, NULL, memory_order_acquire);
+  if (!reqs)
+    return;
+
+  // The inbox is a LIFO, reverse it to keep the submission order.
+  XcpIoReq *fifo = NULL;
+  while (reqs) {
+    XcpIoReq *nextReq = STAILQ_NEXT(reqs, pImpl.next);
+    STAILQ_NEXT(reqs, pImpl.next) = fifo;
+    fifo = reqs;
+    reqs = nextReq;
+  }
+
+  while (fifo) {
+    XcpIoReq *nextReq = STAILQ_NEXT(fifo, pImpl.next);
+    STAILQ_INSERT_TAIL(&engineQueue->pImpl.backlog, fifo, pImpl.next);
+    fifo = nextReq;
+  }
+}
+
+static inline size_t get_chain_length (const XcpIoReq *req) {
+  size_t length = 1;
+  while ((req = req->pImpl.link))
+    ++length;
+  return length;
+}
+
+// Insert the backlog requests in the queue while it is not full.
+static inline void schedule_backlog (XcpIoEngineQueue *engineQueue) {
+  XcpIoQueue *queue = &engineQueue->queue;
+  XcpIoReq *req;
+  while ((req = STAILQ_FIRST(&engineQueue->pImpl.backlog))) {
+    const size_t used = xcp_io_queue_get_pending_count(queue) + xcp_io_queue_get_inflight_count(queue);
+    if (used + get_chain_length(req) > queue->capacity)
+      break;
+
+    STAILQ_REMOVE_HEAD(&engineQueue->pImpl.backlog, pImpl.next);
+    xcp_io_queue_insert_or_complete(queue, req);
+  }
+}
+
+// Returns true if the queue contains only the wake request and if there is nothing to submit.
+static inline bool is_idle (XcpIoEngineQueue *engineQueue) {
+  const XcpIoQueue *queue = &engineQueue->queue;
+  return xcp_io_queue_get_pending_count(queue) + xcp_io_queue_get_inflight_count(queue) == 1 &&
+    STAILQ_EMPTY(&engineQueue->pImpl.backlog) &&
+    !atomic_load_explicit(&engineQueue->pImpl.inbox, memory_order_acquire);
+}
+
+static void *run_queue (void *arg) {
+  XcpIoEngineQueue *engineQueue = arg;
+  XcpIoEngine *engine = engineQueue->engine;
+  XcpIoQueue *queue = &engineQueue->queue;
+
+  xcp_io_queue_insert(queue, &engineQueue->pImpl.wakeReq);
+  for (;;) {
+    fetch_inbox(engineQueue);
+    schedule_backlog(engineQueue);
+
+    if (atomic_load_explicit(&engine->pImpl.stopping, memory_order_acquire) && is_idle(engineQueue))
+      break;
+
+    // Submit and wait at least one response: a completion or a wake up.
+    // Errors are transient here (no memory, full completion ring...), the next iteration retries.
+    xcp_io_queue_submit_and_wait(queue, 1, NULL);
+  }
+
+  return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+static int init_queue (XcpIoEngineQueue *engineQueue, const XcpIoQueueOptions *options) {
+  int ret;
+  if ((ret = xcp_io_queue_init_with_options(&engineQueue->queue, options)) < 0)
+    return ret;
+
+  if ((engineQueue->pImpl.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    ret = -errno;
+    xcp_io_queue_uninit(&engineQueue->queue);
+    return ret;
+  }
+
+  XcpIoReq *wakeReq = &engineQueue->pImpl.wakeReq;
+  xcp_io_req_prep_poll(wakeReq, engineQueue->pImpl.wakeFd, POLLIN);
+  xcp_io_req_set_cb(wakeReq, wake_completion_cb);
+  xcp_io_req_set_user_data(wakeReq, engineQueue);
+
+  atomic_init(&engineQueue->pImpl.inbox, NULL);
+  STAILQ_INIT(&engineQueue->pImpl.backlog);
+
+  return 0;
+}
+
+static void uninit_queue (XcpIoEngineQueue *engineQueue) {
+  xcp_io_queue_uninit(&engineQueue->queue);
+  close(engineQueue->pImpl.wakeFd);
+}
+
+static int start_queue (XcpIoEngineQueue *engineQueue) {
+  pthread_attr_t attr;
+  int ret;
+  if ((ret = pthread_attr_init(&attr)))
+    return -ret;
+
+  if (engineQueue->cpu >= 0) {
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET((size_t)engineQueue->cpu, &cpuSet);
+    ret = pthread_attr_setaffinity_np(&attr, sizeof cpuSet, &cpuSet);
+  }
+
+  if (!ret)
+    ret = pthread_create(&engineQueue->pImpl.thread, &attr, run_queue, engineQueue);
+
+  pthread_attr_destroy(&attr);
+  return -ret;
+}
+
+// Stop the threads of the count first queues and uninit all the queues.
+static void stop_queues (XcpIoEngine *engine, unsigned int count) {
+  atomic_store_explicit(&engine->pImpl.stopping, true, memory_order_release);
+
+  for (unsigned int i = 0; i < count; ++i)
+    wake_queue(&engine->queues[i]);
+  for (unsigned int i = 0; i < count; ++i)
+    pthread_join(engine->queues[i].pImpl.thread, NULL);
+
+  for (unsigned int i = 0; i < engine->queueCount; ++i)
+    uninit_queue(&engine->queues[i]);
+
+  free(engine->queues);
+  free(engine->pImpl.cpuQueues);
+  engine->queueCount = 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int xcp_io_engine_init (XcpIoEngine *engine, const XcpIoEngineOptions *options) {
+  memset(engine, 0, sizeof *engine);
+
+  // The queue threads use the ring to wait the wake up requests: it's not possible with IOPOLL.
+  // And one entry of each queue is used by the wake up request.
+  if ((options->queueOptions.flags & XcpIoQueueFlagIoPoll) || options->queueOptions.capacity < 2)
+    return -EINVAL;
+
+  // 1. Get the usable CPUs.
+  cpu_set_t cpuSet;
+  if (sched_getaffinity(0, sizeof cpuSet, &cpuSet) < 0)
+    return -errno;
+
+  unsigned int cpus[CPU_SETSIZE];
+  unsigned int cpuCount = 0;
+  for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    if (CPU_ISSET(cpu, &cpuSet))
+      cpus[cpuCount++] = cpu;
+  if (!cpuCount)
+    return -ENODEV;
+
+  const unsigned int queueCount = options->queueCount ? options->queueCount : cpuCount;
+
+  // 2. Allocate queues, queue i is pinned to the CPU i modulo the CPU count.
+  engine->queues = calloc(queueCount, sizeof *engine->queues);
+  engine->pImpl.cpuQueues = malloc(CPU_SETSIZE * sizeof *engine->pImpl.cpuQueues);
+  if (!engine->queues || !engine->pImpl.cpuQueues) {
+    free(engine->queues);
+    free(engine->pImpl.cpuQueues);
+    return -ENOMEM;
+  }
+
+  engine->flags = options->flags;
+  engine->pImpl.cpuCount = CPU_SETSIZE;
+  atomic_init(&engine->pImpl.stopping, false);
+
+  for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    engine->pImpl.cpuQueues[cpu] = cpu % queueCount;
+  for (unsigned int i = queueCount; i-- > 0; )
+    engine->pImpl.cpuQueues[cpus[i % cpuCount]] = i;
+
+  // The wake up requests are polled in the ring, no eventfd is necessary.
+  XcpIoQueueOptions queueOptions = options->queueOptions;
+  queueOptions.flags |= XcpIoQueueFlagNoEventFd;
+
+  int ret;
+  for (unsigned int i = 0; i < queueCount; ++i) {
+    XcpIoEngineQueue *engineQueue = &engine->queues[i];
+    engineQueue->engine = engine;
+    engineQueue->cpu = options->flags & XcpIoEngineFlagNoAffinity ? -1 : (int)cpus[i % cpuCount];
+    if ((ret = init_queue(engineQueue, &queueOptions)) < 0) {
+      stop_queues(engine, 0);
+      return ret;
+    }
+    engine->queueCount = i + 1;
+  }
+
+  // 3. Start threads.
+  for (unsigned int i = 0; i < queueCount; ++i) {
+    if ((ret = start_queue(&engine->queues[i])) < 0) {
+      stop_queues(engine, i);
+      return ret;
+    }
+  }
+
+  return 0;
+}
+
+void xcp_io_engine_uninit (XcpIoEngine *engine) {
+  if (engine->queueCount)
+    stop_queues(engine, engine->queueCount);
+}
+
+void xcp_io_engine_submit (XcpIoEngine *engine, XcpIoReq *req) {
+  xcp_io_engine_submit_to_queue(engine, xcp_io_engine_get_queue_index(engine, req), req);
+}
+
+void xcp_io_engine_submit_to_queue (XcpIoEngine *engine, unsigned int queueIndex, XcpIoReq *req) {
+  assert(queueIndex < engine->queueCount);
+  XcpIoEngineQueue *engineQueue = &engine->queues[queueIndex];
+
+  XcpIoReq *head = atomic_load_explicit(&engineQueue->pImpl.inbox, memory_order_relaxed);
+  do {
+    STAILQ_NEXT(req, pImpl.next) = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+    &engineQueue->pImpl.inbox, &head, req, memory_order_release, memory_order_relaxed
+  ));
+
+  // Only the first producer wakes up the thread, the next ones are seen by the same fetch.
+  if (!head)
+    wake_queue(engineQueue);
+}
+
+unsigned int xcp_io_engine_get_queue_index (const XcpIoEngine *engine, const XcpIoReq *req) {
+  if (engine->flags & XcpIoEngineFlagSteerByCpu) {
+    const int cpu = sched_getcpu();
+    if (XCP_LIKELY(cpu >= 0 && (unsigned int)cpu < engine->pImpl.cpuCount))
+      return engine->pImpl.cpuQueues[cpu];
+  }
+
+  return (unsigned int)req->fd % engine->queueCount;
+}
@@ -14,12 +14,18 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __alpha__
@@ -32,153 +38,1667 @@
   #endif // ifndef __NR_io_uring_enter
 #endif // ifdef __alpha__
 
-#include "xcp-ng/async-io/io-queue.h"
-#include "xcp-ng/async-io/io-req.h"
+#include "xcp-ng/async-io/io-queue.h"
+#include "xcp-ng/async-io/io-req.h"
+#include "io-req-internal.h"
+
+// =============================================================================
+
+// Remove [first, LAST] from HEAD.
+// It's an optimization to avoid one remove per element.
+#define STAILQ_REMOVE_HEAD_UNTIL(HEAD, LAST, FIELD) \
+  do { \
+    assert((LAST)); \
+    if (!((HEAD)->stqh_first = (LAST)->FIELD.stqe_next)) \
+      (HEAD)->stqh_last = &(HEAD)->stqh_first; \
+  } while (false)
+
+// Request states, see XcpIoReq.pImpl.state.
+enum {
+  ReqStatePending = 1 << 0, // In the pending list.
+  ReqStateTimedOut = 1 << 1, // The link timeout expired.
+  ReqStateCanceled = 1 << 2, // An async cancel was submitted.
+  ReqStateGroup = 1 << 3, // Merged request, see XcpIoMergeGroup.
+  ReqStateAdmitted = 1 << 4 // Charged to its rate limit (if any), can be submitted.
+};
+
+// A CQE can be the response of a request or of an internal SQE related to a request.
+// In the last case, a tag is stored in the low bits of the user data.
+enum {
+  CqeTagReq = 0,
+  CqeTagTimeout = 1,
+  CqeTagCancel = 2,
+  CqeTagThrottle = 3, // Rate limit timer, see arm_rate_limit_timer.
+  CqeTagMask = 3
+};
+
+static_assert(_Alignof(XcpIoReq) > CqeTagMask, "Request address can't be tagged");
+
+// Max number of pending requests sorted together to find contiguous requests.
+#define MERGE_WINDOW_SIZE 64
+
+// Max number of iovecs of a merged request.
+#define MERGE_MAX_IOVECS 64
+
+// Request built from contiguous pending requests, see XcpIoQueueFlagMerge.
+typedef struct XcpIoMergeGroup {
+  XcpIoReq req; // Must be the first field: the group is completed from the request address.
+
+  // Merged requests, sorted by offset and linked with pImpl.next.
+  STAILQ_HEAD(, XcpIoReq) members;
+  size_t memberCount;
+
+  struct iovec iovecs[MERGE_MAX_IOVECS];
+
+  struct XcpIoMergeGroup *nextFree;
+} XcpIoMergeGroup;
+
+#define NSEC_PER_SEC 1000000000ull
+
+// Token bucket implemented with the generic cell rate algorithm: instead of a token count, the bucket stores
+// the theoretical arrival time (TAT) of the next request. A request is admitted if the TAT is not later than
+// now plus the burst tolerance, then the TAT is delayed by the request cost. All times are in nanoseconds.
+typedef struct XcpIoRateLimitBucket {
+  uint64_t rate; // Units per second, 0 means no limit.
+  uint64_t tolerance;
+  uint64_t tat;
+} XcpIoRateLimitBucket;
+
+// Rate limit of a key, see xcp_io_queue_set_rate_limit.
+typedef struct XcpIoRateLimiter {
+  uint32_t key;
+  XcpIoRateLimitBucket reqBucket;
+  XcpIoRateLimitBucket byteBucket;
+
+  // Throttled requests in insertion order, linked with pImpl.next. A chain is stored contiguously.
+  STAILQ_HEAD(, XcpIoReq) reqs;
+} XcpIoRateLimiter;
+
+// Max size of a request using a registered buffer: the SQE length is 32 bits.
+#define SPLIT_MAX_FIXED_SIZE ((size_t)UINT32_MAX & ~(size_t)4095)
+
+// Split limits of a fd, see xcp_io_queue_set_device_limits.
+typedef struct XcpIoSplitLimit {
+  int fd;
+  size_t maxSize; // Multiple of the logical block size, SIZE_MAX if there is no limit.
+  size_t maxIovecCount;
+} XcpIoSplitLimit;
+
+// Request split in children executed in parallel, see split_request.
+typedef struct XcpIoSplit {
+  XcpIoReq *parent;
+  size_t remainingCount; // Number of children not completed.
+
+  // First error of the children and result of the failed child. After short transfers,
+  // the size transferred before the first short child.
+  int err;
+  int res;
+
+  size_t childCount;
+  XcpIoReq children[]; // Followed by the iovecs of the children.
+} XcpIoSplit;
+
+
+// Returns the number of user requests represented by a request.
+static inline size_t get_req_count (const XcpIoReq *req) {
+  return XCP_UNLIKELY(req->pImpl.state & ReqStateGroup) ? ((const XcpIoMergeGroup *)req)->memberCount : 1;
+}
+
+// The children of a split request are never merged, otherwise the split would be undone.
+static inline bool is_mergeable (const XcpIoReq *req) {
+  return (req->opcode & (XcpIoOpcodeRead | XcpIoOpcodeWrite | XcpIoOpcodeReadV | XcpIoOpcodeWriteV)) &&
+    req->offset >= 0 &&
+    !(req->flags & ~XcpIoReqFlagFixedFile) &&
+    !req->timeout &&
+    !req->pImpl.transferred &&
+    !req->pImpl.split &&
+    !(req->pImpl.state & ReqStateGroup);
+}
+
+static inline bool is_write (XcpIoOpcode opcode) {
+  return opcode & (XcpIoOpcodeWrite | XcpIoOpcodeWriteV);
+}
+
+// Order requests by fd, direction and offset.
+static inline bool merge_less (const XcpIoReq *a, const XcpIoReq *b) {
+  if (a->fd != b->fd)
+    return a->fd < b->fd;
+  if ((a->flags & XcpIoReqFlagFixedFile) != (b->flags & XcpIoReqFlagFixedFile))
+    return !(a->flags & XcpIoReqFlagFixedFile);
+  if (is_write(a->opcode) != is_write(b->opcode))
+    return !is_write(a->opcode);
+  return a->offset < b->offset;
+}
+
+// Stable insertion sort: sequential streams are usually already sorted, and requests
+// on the same range must keep their order.
+static inline void merge_sort (XcpIoReq **reqs, size_t count) {
+  for (size_t i = 1; i < count; ++i) {
+    XcpIoReq *req = reqs[i];
+    size_t j = i;
+    for (; j > 0 && merge_less(req, reqs[j - 1]); --j)
+      reqs[j] = reqs[j - 1];
+    reqs[j] = req;
+  }
+}
+
+static inline size_t get_iovec_count (const XcpIoReq *req) {
+  return req->opcode & (XcpIoOpcodeReadV | XcpIoOpcodeWriteV) ? req->iov.iov_len : 1;
+}
+
+static inline const struct iovec *get_iovecs (const XcpIoReq *req) {
+  return req->opcode & (XcpIoOpcodeReadV | XcpIoOpcodeWriteV) ? req->iov.iov_base : &req->iov;
+}
+
+// Returns true if next can be added after last in a group of the given size and iovec count.
+static inline bool can_merge (
+  const XcpIoQueue *queue, const XcpIoReq *last, const XcpIoReq *next, size_t size, size_t iovecCount
+) {
+  return last->fd == next->fd &&
+    (last->flags & XcpIoReqFlagFixedFile) == (next->flags & XcpIoReqFlagFixedFile) &&
+    last->ioprio == next->ioprio &&
+    is_write(last->opcode) == is_write(next->opcode) &&
+    last->offset + (off_t)xcp_io_req_get_size(last) == next->offset &&
+    size + xcp_io_req_get_size(next) <= queue->pImpl.merge.maxSize &&
+    iovecCount + get_iovec_count(next) <= MERGE_MAX_IOVECS;
+}
+
+// Build a group from reqs[0, count[, count must be greater than 1.
+static inline XcpIoReq *build_group (XcpIoQueue *queue, XcpIoMergeGroup *group, XcpIoReq **reqs, size_t count) {
+  XcpIoReq *first = reqs[0];
+  size_t iovecCount = 0;
+
+  STAILQ_INIT(&group->members);
+  for (size_t i = 0; i < count; ++i) {
+    XcpIoReq *req = reqs[i];
+    const size_t reqIovecCount = get_iovec_count(req);
+    memcpy(group->iovecs + iovecCount, get_iovecs(req), reqIovecCount * sizeof *group->iovecs);
+    iovecCount += reqIovecCount;
+
+    req->pImpl.group = &group->req;
+    STAILQ_INSERT_TAIL(&group->members, req, pImpl.next);
+  }
+  group->memberCount = count;
+
+  XcpIoReq *groupReq = &group->req;
+  xcp_io_req_prep_rw(
+    groupReq,
+    is_write(first->opcode) ? XcpIoOpcodeWriteV : XcpIoOpcodeReadV,
+    first->fd,
+    group->iovecs,
+    iovecCount,
+    first->offset
+  );
+  groupReq->flags = first->flags & XcpIoReqFlagFixedFile;
+  groupReq->ioprio = first->ioprio;
+  groupReq->pImpl.state = ReqStatePending | ReqStateGroup;
+  groupReq->pImpl.transferred = 0;
+  groupReq->pImpl.iovIndex = 0;
+  groupReq->pImpl.partialIov.iov_len = 0;
+
+  ++queue->counters.merges;
+  queue->counters.mergedRequests += count;
+
+  return groupReq;
+}
+
+// Sort reqs[0, count[ and append them to the list, merging contiguous requests.
+static inline void merge_window (XcpIoQueue *queue, XcpIoReq **reqs, size_t count, XcpIoReq **tail) {
+  merge_sort(reqs, count);
+
+  for (size_t i = 0; i < count; ) {
+    // Find the longest run of contiguous requests.
+    size_t size = xcp_io_req_get_size(reqs[i]);
+    size_t iovecCount = get_iovec_count(reqs[i]);
+    size_t end = i + 1;
+    while (end < count && can_merge(queue, reqs[end - 1], reqs[end], size, iovecCount)) {
+      size += xcp_io_req_get_size(reqs[end]);
+      iovecCount += get_iovec_count(reqs[end]);
+      ++end;
+    }
+
+    XcpIoReq *req = reqs[i];
+    XcpIoMergeGroup *group = queue->pImpl.merge.freeGroups;
+    if (end - i > 1 && group) {
+      queue->pImpl.merge.freeGroups = group->nextFree;
+      req = build_group(queue, group, reqs + i, end - i);
+    } else
+      end = i + 1;
+
+    *tail = req;
+    tail = &STAILQ_NEXT(req, pImpl.next);
+    i = end;
+  }
+  *tail = NULL;
+}
+
+// Merge contiguous requests of the pending list, the other requests (chains, barriers...) are not moved.
+static inline void merge_pending (XcpIoQueue *queue) {
+  XcpIoReq *window[MERGE_WINDOW_SIZE];
+
+  XcpIoReq *req = STAILQ_FIRST(&queue->reqs);
+  XcpIoReq *head = NULL;
+  XcpIoReq **tail = &head;
+  XcpIoReq *last = NULL;
+
+  while (req) {
+    if (!is_mergeable(req)) {
+      // Keep chains together.
+      XcpIoReq *chainLast = req;
+      while (chainLast->pImpl.link)
+        chainLast = chainLast->pImpl.link;
+
+      *tail = req;
+      last = chainLast;
+      tail = &STAILQ_NEXT(chainLast, pImpl.next);
+      req = *tail;
+      continue;
+    }
+
+    size_t count = 0;
+    do {
+      window[count++] = req;
+      req = STAILQ_NEXT(req, pImpl.next);
+    } while (req && count < MERGE_WINDOW_SIZE && is_mergeable(req));
+
+    merge_window(queue, window, count, tail);
+    while (*tail) {
+      last = *tail;
+      tail = &STAILQ_NEXT(last, pImpl.next);
+    }
+  }
+
+  queue->reqs.stqh_first = head;
+  queue->reqs.stqh_last = last ? &STAILQ_NEXT(last, pImpl.next) : &queue->reqs.stqh_first;
+}
+
+// -----------------------------------------------------------------------------
+
+// Append a request and the rest of its chain to the pending list.
+static inline size_t append_chain (XcpIoQueue *queue, XcpIoReq *req) {
+  size_t count = 0;
+  do {
+    STAILQ_INSERT_TAIL(&queue->reqs, req, pImpl.next);
+    ++count;
+  } while (XCP_UNLIKELY(req = req->pImpl.link));
+  return count;
+}
+
+// Move the requests chosen by the scheduler in the pending list, up to the free space of the submission ring.
+static inline void dequeue_scheduled (XcpIoQueue *queue) {
+  XcpIoScheduler *scheduler = queue->pImpl.sched.scheduler;
+  const size_t space = io_uring_sq_space_left(&queue->pImpl.ring);
+
+  XcpIoReq *req;
+  while (
+    queue->pendingCount - queue->pImpl.sched.reqCount - queue->pImpl.rateLimit.reqCount < space &&
+    (req = scheduler->ops->dequeue(scheduler))
+  ) {
+    const size_t count = append_chain(queue, req);
+    assert(queue->pImpl.sched.reqCount >= count);
+    queue->pImpl.sched.reqCount -= count;
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+static inline uint64_t get_monotonic_time (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+// Returns the time in nanoseconds to process value units at the given rate (at most XCP_IO_RATE_LIMIT_MAX).
+static inline uint64_t get_rate_time (uint64_t value, uint64_t rate) {
+  const uint64_t seconds = value / rate;
+  if (XCP_UNLIKELY(seconds >= XCP_IO_RATE_LIMIT_MAX))
+    return UINT64_MAX / 2;
+  return seconds * NSEC_PER_SEC + value % rate * NSEC_PER_SEC / rate;
+}
+
+static inline void init_rate_limit_bucket (XcpIoRateLimitBucket *bucket, uint64_t rate, uint64_t burst) {
+  bucket->rate = rate;
+  bucket->tolerance = rate ? get_rate_time(burst, rate) : 0;
+}
+
+// Returns the first time at which the bucket admits a request.
+static inline uint64_t get_rate_limit_bucket_release_time (const XcpIoRateLimitBucket *bucket) {
+  return bucket->tat > bucket->tolerance ? bucket->tat - bucket->tolerance : 0;
+}
+
+static inline void charge_rate_limit_bucket (XcpIoRateLimitBucket *bucket, uint64_t now, uint64_t cost) {
+  if (bucket->rate)
+    bucket->tat = (bucket->tat > now ? bucket->tat : now) + get_rate_time(cost, bucket->rate);
+}
+
+static inline uint64_t get_rate_limiter_release_time (const XcpIoRateLimiter *limiter) {
+  const uint64_t reqTime = get_rate_limit_bucket_release_time(&limiter->reqBucket);
+  const uint64_t byteTime = get_rate_limit_bucket_release_time(&limiter->byteBucket);
+  return reqTime > byteTime ? reqTime : byteTime;
+}
+
+// Charge a request and the rest of its chain.
+static inline void charge_rate_limiter (XcpIoRateLimiter *limiter, const XcpIoReq *req, uint64_t now) {
+  uint64_t count = 0;
+  uint64_t size = 0;
+  do {
+    ++count;
+    if (xcp_io_opcode_has_data(req->opcode) || req->opcode == XcpIoOpcodeSplice)
+      size += xcp_io_req_get_size(req);
+  } while ((req = req->pImpl.link));
+
+  charge_rate_limit_bucket(&limiter->reqBucket, now, count);
+  charge_rate_limit_bucket(&limiter->byteBucket, now, size);
+}
+
+// Returns the index of the first limiter with a key greater than or equal to key.
+static inline size_t find_rate_limiter_index (const XcpIoQueue *queue, uint32_t key) {
+  XcpIoRateLimiter *const *limiters = queue->pImpl.rateLimit.limiters;
+  size_t low = 0;
+  size_t high = queue->pImpl.rateLimit.count;
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    if (limiters[mid]->key < key)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+static inline XcpIoRateLimiter *find_rate_limiter (const XcpIoQueue *queue, uint32_t key) {
+  const size_t index = find_rate_limiter_index(queue, key);
+  return index < queue->pImpl.rateLimit.count && queue->pImpl.rateLimit.limiters[index]->key == key
+    ? queue->pImpl.rateLimit.limiters[index]
+    : NULL;
+}
+
+// Returns the last request of a chain, count is set to the chain length.
+static inline XcpIoReq *get_chain_last (XcpIoReq *req, size_t *count) {
+  *count = 1;
+  while (XCP_UNLIKELY(req->pImpl.link)) {
+    assert(STAILQ_NEXT(req, pImpl.next) == req->pImpl.link);
+    req = req->pImpl.link;
+    ++*count;
+  }
+  return req;
+}
+
+// Insert requests linked with pImpl.next at the head of the pending list, tail is the next field of the last one.
+static inline void insert_pending_head (XcpIoQueue *queue, XcpIoReq *reqs, XcpIoReq **tail) {
+  if (!(*tail = STAILQ_FIRST(&queue->reqs)))
+    queue->reqs.stqh_last = tail;
+  STAILQ_FIRST(&queue->reqs) = reqs;
+}
+
+// Move all the throttled requests of a limiter in the pending list, they are not charged.
+static inline void unthrottle_rate_limiter (XcpIoQueue *queue, XcpIoRateLimiter *limiter) {
+  XcpIoReq *req = STAILQ_FIRST(&limiter->reqs);
+  if (!req)
+    return;
+
+  size_t count = 0;
+  XcpIoReq **tail = limiter->reqs.stqh_last;
+  for (; req; req = STAILQ_NEXT(req, pImpl.next))
+    ++count;
+
+  insert_pending_head(queue, STAILQ_FIRST(&limiter->reqs), tail);
+  STAILQ_INIT(&limiter->reqs);
+
+  assert(queue->pImpl.rateLimit.reqCount >= count);
+  queue->pImpl.rateLimit.reqCount -= count;
+}
+
+// Move the throttled requests that can be submitted now at the head of the pending list.
+static inline void release_throttled (XcpIoQueue *queue, uint64_t now) {
+  XcpIoReq *reqs = NULL;
+  XcpIoReq **tail = &reqs;
+  size_t releasedCount = 0;
+
+  for (size_t i = 0; i < queue->pImpl.rateLimit.count; ++i) {
+    XcpIoRateLimiter *limiter = queue->pImpl.rateLimit.limiters[i];
+    XcpIoReq *req;
+    while ((req = STAILQ_FIRST(&limiter->reqs)) && get_rate_limiter_release_time(limiter) <= now) {
+      size_t count;
+      XcpIoReq *last = get_chain_last(req, &count);
+      STAILQ_REMOVE_HEAD_UNTIL(&limiter->reqs, last, pImpl.next);
+
+      charge_rate_limiter(limiter, req, now);
+      req->pImpl.state |= ReqStateAdmitted;
+
+      *tail = req;
+      tail = &STAILQ_NEXT(last, pImpl.next);
+      releasedCount += count;
+    }
+  }
+
+  if (releasedCount) {
+    insert_pending_head(queue, reqs, tail);
+    assert(queue->pImpl.rateLimit.reqCount >= releasedCount);
+    queue->pImpl.rateLimit.reqCount -= releasedCount;
+  }
+}
+
+// Check the rate limits of the pending requests that can be put in the submission ring now.
+// Requests over their budget (or behind throttled requests of the same limiter) are moved in their limiter.
+// Returns the number of throttled requests.
+static inline size_t throttle_pending (XcpIoQueue *queue, uint64_t now) {
+  size_t space = io_uring_sq_space_left(&queue->pImpl.ring);
+  size_t throttledCount = 0;
+
+  XcpIoReq **prevNext = &STAILQ_FIRST(&queue->reqs);
+  XcpIoReq *req;
+  while (space && (req = *prevNext)) {
+    size_t count;
+    XcpIoReq *last = get_chain_last(req, &count);
+
+    if (!(req->pImpl.state & (ReqStateAdmitted | ReqStateGroup))) {
+      XcpIoRateLimiter *limiter = find_rate_limiter(queue, xcp_io_req_get_key(req));
+      if (limiter) {
+        if (!STAILQ_EMPTY(&limiter->reqs) || get_rate_limiter_release_time(limiter) > now) {
+          if (!(*prevNext = STAILQ_NEXT(last, pImpl.next)))
+            queue->reqs.stqh_last = prevNext;
+          STAILQ_NEXT(last, pImpl.next) = NULL;
+          *limiter->reqs.stqh_last = req;
+          limiter->reqs.stqh_last = &STAILQ_NEXT(last, pImpl.next);
+          throttledCount += count;
+          continue;
+        }
+        charge_rate_limiter(limiter, req, now);
+      }
+      req->pImpl.state |= ReqStateAdmitted;
+    }
+
+    space = space > count ? space - count : 0;
+    prevNext = &STAILQ_NEXT(last, pImpl.next);
+  }
+
+  queue->pImpl.rateLimit.reqCount += throttledCount;
+  queue->counters.throttledRequests += throttledCount;
+  return throttledCount;
+}
+
+// Arm the wake up timer at the next release time of the throttled requests.
+// If the timer is already armed later, it is updated.
+static inline void arm_rate_limit_timer (XcpIoQueue *queue) {
+  uint64_t deadline = UINT64_MAX;
+  for (size_t i = 0; i < queue->pImpl.rateLimit.count; ++i) {
+    const XcpIoRateLimiter *limiter = queue->pImpl.rateLimit.limiters[i];
+    if (!STAILQ_EMPTY(&limiter->reqs)) {
+      const uint64_t releaseTime = get_rate_limiter_release_time(limiter);
+      if (releaseTime < deadline)
+        deadline = releaseTime;
+    }
+  }
+
+  if (queue->pImpl.rateLimit.timerArmed && queue->pImpl.rateLimit.timerDeadline <= deadline)
+    return;
+
+  // If the ring is full, the next completions wake up the ring anyway.
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&queue->pImpl.ring);
+  if (!sqe)
+    return;
+
+  struct __kernel_timespec *spec = &queue->pImpl.rateLimit.timerSpec;
+  spec->tv_sec = (int64_t)(deadline / NSEC_PER_SEC);
+  spec->tv_nsec = (long long)(deadline % NSEC_PER_SEC);
+
+  // The timer CQE is tagged with the queue address, not the update CQE.
+  const uint64_t timerData = (uint64_t)queue | CqeTagThrottle;
+  if (!queue->pImpl.rateLimit.timerArmed) {
+    io_uring_prep_timeout(sqe, spec, 0, IORING_TIMEOUT_ABS);
+    sqe->user_data = timerData;
+  } else {
+    // Same as io_uring_prep_timeout_update (liburing >= 2.1).
+    io_uring_prep_rw(IORING_OP_TIMEOUT_REMOVE, sqe, -1, NULL, 0, (uint64_t)spec);
+    sqe->addr = timerData;
+    sqe->timeout_flags = IORING_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+    sqe->user_data = CqeTagThrottle;
+  }
+
+  queue->pImpl.rateLimit.timerArmed = true;
+  queue->pImpl.rateLimit.timerDeadline = deadline;
+}
+
+// Apply the rate limits before a submission.
+static inline void apply_rate_limits (XcpIoQueue *queue) {
+  const uint64_t now = get_monotonic_time();
+  if (queue->pImpl.rateLimit.reqCount)
+    release_throttled(queue, now);
+
+  // Throttled requests leave free slots in the ring: the scheduler can fill them.
+  do {
+    if (queue->pImpl.sched.reqCount)
+      dequeue_scheduled(queue);
+  } while (throttle_pending(queue, now) && queue->pImpl.sched.reqCount);
+
+  // With IOPOLL, timeouts are not supported: throttled requests are released by the next submissions.
+  if (queue->pImpl.rateLimit.reqCount && !queue->usePolling)
+    arm_rate_limit_timer(queue);
+}
+
+// -----------------------------------------------------------------------------
+
+#ifdef XCP_IO_ENABLE_STATS
+  // The statistics are written by the queue thread only: relaxed atomic stores are enough to let the
+  // other threads read them, no read-modify-write instruction is necessary.
+  #define STATS_ADD(FIELD, VALUE) __atomic_store_n(&(FIELD), (FIELD) + (VALUE), __ATOMIC_RELAXED)
+  #define STATS_LOAD(FIELD) __atomic_load_n(&(FIELD), __ATOMIC_RELAXED)
+
+  static inline void stats_record (XcpIoHistogram *histogram, uint64_t value) {
+    STATS_ADD(histogram->count, 1);
+    STATS_ADD(histogram->sum, value);
+    STATS_ADD(histogram->buckets[xcp_io_histogram_get_bucket_index(value)], 1);
+  }
+
+  static inline XcpIoOpStats *get_op_stats (XcpIoQueue *queue, const XcpIoReq *req) {
+    return &queue->pImpl.stats.current->ops[xcp_io_opcode_get_index(req->opcode)];
+  }
+
+  // Find the slot of a fd with a linear probing, the last slot is used when the table is full.
+  static inline XcpIoFdStats *get_fd_stats (XcpIoQueue *queue, int fd) {
+    XcpIoFdStats *fds = queue->pImpl.stats.current->fds;
+    const unsigned int slotCount = XCP_IO_STATS_FD_COUNT - 1;
+
+    unsigned int index = (unsigned int)fd % slotCount;
+    for (unsigned int i = 0; i < slotCount; ++i) {
+      XcpIoFdStats *fdStats = &fds[index];
+      if (fdStats->fd == fd)
+        return fdStats;
+      if (fdStats->fd == -1) {
+        __atomic_store_n(&fdStats->fd, fd, __ATOMIC_RELAXED);
+        return fdStats;
+      }
+      if (++index == slotCount)
+        index = 0;
+    }
+    return &fds[slotCount];
+  }
+
+  static inline void stats_on_insert (XcpIoReq *req) {
+    const uint64_t now = get_monotonic_time();
+    do {
+      req->pImpl.insertTime = now;
+      req->pImpl.submitTime = 0;
+    } while ((req = req->pImpl.link));
+  }
+
+  static inline void stats_on_req_submit (XcpIoQueue *queue, XcpIoReq *req, uint64_t now) {
+    // A continued request keeps its first submission time.
+    if (req->pImpl.submitTime)
+      return;
+    req->pImpl.submitTime = now;
+    stats_record(&get_op_stats(queue, req)->queueTime, now - req->pImpl.insertTime);
+  }
+
+  // Called when the pending requests until last (n user requests) are moved in the submission ring.
+  static inline void stats_on_submit (XcpIoQueue *queue, XcpIoReq *last, size_t n) {
+    const uint64_t now = get_monotonic_time();
+    XcpIoReq *req = STAILQ_FIRST(&queue->reqs);
+    for (;;) {
+      if (XCP_UNLIKELY(req->pImpl.state & ReqStateGroup)) {
+        XcpIoReq *member;
+        STAILQ_FOREACH(member, &((XcpIoMergeGroup *)req)->members, pImpl.next)
+          stats_on_req_submit(queue, member, now);
+      } else {
+        // The children of a split request are accounted to their parent.
+        XcpIoSplit *split = req->pImpl.split;
+        stats_on_req_submit(queue, XCP_UNLIKELY(split) ? split->parent : req, now);
+      }
+
+      if (req == last)
+        break;
+      req = STAILQ_NEXT(req, pImpl.next);
+    }
+
+    stats_record(&queue->pImpl.stats.current->batchSizes, n);
+  }
+
+  static inline void stats_on_short_transfer (XcpIoQueue *queue, const XcpIoReq *req) {
+    STATS_ADD(get_op_stats(queue, req)->shortTransfers, 1);
+  }
+
+  // Must be called before a series of stats_on_completion calls.
+  static inline void stats_begin_completions (XcpIoQueue *queue) {
+    queue->pImpl.stats.completionTime = get_monotonic_time();
+  }
+
+  static inline void stats_on_completion (XcpIoQueue *queue, const XcpIoReq *req, int err) {
+    XcpIoOpStats *opStats = get_op_stats(queue, req);
+    XcpIoFdStats *fdStats = get_fd_stats(queue, req->fd);
+
+    STATS_ADD(opStats->count, 1);
+    STATS_ADD(fdStats->count, 1);
+    if (err) {
+      STATS_ADD(opStats->errors, 1);
+      STATS_ADD(fdStats->errors, 1);
+    } else if (xcp_io_opcode_has_data(req->opcode)) {
+      const size_t size = xcp_io_req_get_size(req);
+      STATS_ADD(opStats->bytes, size);
+      STATS_ADD(fdStats->bytes, size);
+    }
+
+    const uint64_t submitTime = req->pImpl.submitTime;
+    if (submitTime) {
+      const uint64_t completionTime = queue->pImpl.stats.completionTime;
+      const uint64_t serviceTime = completionTime > submitTime ? completionTime - submitTime : 0;
+      stats_record(&opStats->serviceTime, serviceTime);
+      stats_record(&fdStats->serviceTime, serviceTime);
+    }
+  }
+
+  // Copy src in dst, minus base if not NULL.
+  static inline void copy_stats_value (uint64_t *dst, const uint64_t *src, const uint64_t *base) {
+    *dst = STATS_LOAD(*src) - (base ? *base : 0);
+  }
+
+  static void copy_histogram (XcpIoHistogram *dst, const XcpIoHistogram *src, const XcpIoHistogram *base) {
+    copy_stats_value(&dst->count, &src->count, base ? &base->count : NULL);
+    copy_stats_value(&dst->sum, &src->sum, base ? &base->sum : NULL);
+    for (unsigned int i = 0; i < XCP_IO_HISTOGRAM_BUCKET_COUNT; ++i)
+      copy_stats_value(&dst->buckets[i], &src->buckets[i], base ? &base->buckets[i] : NULL);
+  }
+
+  static void copy_stats (XcpIoQueueStats *dst, const XcpIoQueueStats *src, const XcpIoQueueStats *base) {
+    for (unsigned int i = 0; i < XCP_IO_OPCODE_COUNT; ++i) {
+      XcpIoOpStats *d = &dst->ops[i];
+      const XcpIoOpStats *s = &src->ops[i];
+      const XcpIoOpStats *b = base ? &base->ops[i] : NULL;
+      copy_stats_value(&d->count, &s->count, b ? &b->count : NULL);
+      copy_stats_value(&d->errors, &s->errors, b ? &b->errors : NULL);
+      copy_stats_value(&d->bytes, &s->bytes, b ? &b->bytes : NULL);
+      copy_stats_value(&d->shortTransfers, &s->shortTransfers, b ? &b->shortTransfers : NULL);
+      copy_histogram(&d->queueTime, &s->queueTime, b ? &b->queueTime : NULL);
+      copy_histogram(&d->serviceTime, &s->serviceTime, b ? &b->serviceTime : NULL);
+    }
+
+    for (unsigned int i = 0; i < XCP_IO_STATS_FD_COUNT; ++i) {
+      XcpIoFdStats *d = &dst->fds[i];
+      const XcpIoFdStats *s = &src->fds[i];
+      const XcpIoFdStats *b = base ? &base->fds[i] : NULL;
+      d->fd = __atomic_load_n(&s->fd, __ATOMIC_RELAXED);
+      copy_stats_value(&d->count, &s->count, b ? &b->count : NULL);
+      copy_stats_value(&d->errors, &s->errors, b ? &b->errors : NULL);
+      copy_stats_value(&d->bytes, &s->bytes, b ? &b->bytes : NULL);
+      copy_histogram(&d->serviceTime, &s->serviceTime, b ? &b->serviceTime : NULL);
+    }
+
+    copy_histogram(&dst->batchSizes, &src->batchSizes, base ? &base->batchSizes : NULL);
+  }
+#else
+  static inline void stats_on_insert (XcpIoReq *req) { XCP_UNUSED(req); }
+  static inline void stats_on_submit (XcpIoQueue *queue, XcpIoReq *last, size_t n) {
+    XCP_UNUSED(queue);
+    XCP_UNUSED(last);
+    XCP_UNUSED(n);
+  }
+  static inline void stats_on_short_transfer (XcpIoQueue *queue, const XcpIoReq *req) {
+    XCP_UNUSED(queue);
+    XCP_UNUSED(req);
+  }
+  static inline void stats_begin_completions (XcpIoQueue *queue) { XCP_UNUSED(queue); }
+  static inline void stats_on_completion (XcpIoQueue *queue, const XcpIoReq *req, int err) {
+    XCP_UNUSED(queue);
+    XCP_UNUSED(req);
+    XCP_UNUSED(err);
+  }
+#endif // ifdef XCP_IO_ENABLE_STATS
+
+
+// Give the buffered responses to the batch callback.
+static inline void flush_batch (XcpIoQueue *queue) {
+  const size_t count = queue->pImpl.batch.count;
+  if (count) {
+    queue->pImpl.batch.count = 0;
+    queue->pImpl.batch.cb(queue, queue->pImpl.batch.responses, count, queue->pImpl.batch.userArg);
+  }
+}
+
+// Release a split request when all its children are completed. Returns the request, its error is written
+// in err: the first error of the children. Its result is the result of the failed child, or its size.
+static inline XcpIoReq *finish_split (XcpIoSplit *split, int *err) {
+  XcpIoReq *req = split->parent;
+  *err = split->err;
+
+  const size_t size = xcp_io_req_get_size(req);
+  req->pImpl.res = split->err ? split->res : (int)(size < INT_MAX ? size : INT_MAX);
+  req->pImpl.split = NULL;
+  free(split);
+  return req;
+}
+
+// Notify the user: call the request callback or buffer the response for the batch callback.
+// A child of a split request is not given to the user: its parent is completed with the last child.
+static inline void complete_request (XcpIoQueue *queue, XcpIoReq *req, int err) {
+  XcpIoSplit *split = req->pImpl.split;
+  if (XCP_UNLIKELY(split)) {
+    assert(req != split->parent);
+    if (err) {
+      // A short child gives the size transferred by its parent: the data before the child and its own data.
+      int res = req->pImpl.res;
+      if (err == -EIO && res >= 0) {
+        const uint64_t size = (uint64_t)(req->offset - split->parent->offset) + (uint64_t)res;
+        res = size < INT_MAX ? (int)size : INT_MAX;
+      }
+      if (!split->err || (err == -EIO && split->err == -EIO && res < split->res)) {
+        split->err = err;
+        split->res = res;
+      }
+    }
+    if (--split->remainingCount)
+      return;
+    req = finish_split(split, &err);
+  }
+
+  stats_on_completion(queue, req, err);
+  xcp_io_req_process_buffer(req, err);
+  if (queue->pImpl.batch.cb) {
+    XcpIoResponse *response = &queue->pImpl.batch.responses[queue->pImpl.batch.count];
+    response->req = req;
+    response->err = err;
+    if (++queue->pImpl.batch.count == queue->pImpl.batch.size)
+      flush_batch(queue);
+  } else if (XCP_LIKELY(req->cb))
+    req->cb(req, err, req->userData);
+}
+
+static inline bool is_vectored (XcpIoOpcode opcode) {
+  return opcode & (XcpIoOpcodeReadV | XcpIoOpcodeWriteV);
+}
+
+// Find the remaining data of a short request: the first iovec not fully transferred and the rest of
+// this iovec in partialIov. The iovecs of the request are not modified.
+static inline void adjust_req_iov (XcpIoReq *req) {
+  size_t skip = req->pImpl.transferred;
+  const struct iovec *iov = &req->iov;
+  if (is_vectored(req->opcode)) {
+    uint32_t i = 0;
+    iov = req->iov.iov_base;
+    while (skip >= iov[i].iov_len)
+      skip -= iov[i++].iov_len;
+    req->pImpl.iovIndex = i;
+    iov += i;
+  }
+
+  if (skip) {
+    req->pImpl.partialIov.iov_base = (char *)iov->iov_base + skip;
+    req->pImpl.partialIov.iov_len = iov->iov_len - skip;
+  }
+}
+
+static inline void restore_req_iov (XcpIoReq *req) {
+  if (XCP_LIKELY(!req->pImpl.transferred))
+    return;
+
+  req->pImpl.transferred = 0;
+  req->pImpl.iovIndex = 0;
+  req->pImpl.partialIov.iov_len = 0;
+}
+
+static inline int set_sqes_from_req (struct io_uring *ring, XcpIoReq *req);
+static inline int submit_sqes (XcpIoQueue *queue);
+
+// Resubmit the remaining data of a short request.
+// The SQEs are directly added in the ring if possible, otherwise the request is put at the pending list head.
+static inline void continue_request (XcpIoQueue *queue, XcpIoReq *req, size_t transferred) {
+  ++queue->counters.shortTransfers;
+  stats_on_short_transfer(queue, req);
+
+  req->pImpl.transferred = transferred;
+  adjust_req_iov(req);
+
+  if (!set_sqes_from_req(&queue->pImpl.ring, req))
+    ++queue->inflightCount;
+  else {
+    req->pImpl.state = ReqStatePending | ReqStateAdmitted;
+    STAILQ_INSERT_HEAD(&queue->reqs, req, pImpl.next);
+    ++queue->pendingCount;
+  }
+}
+
+// A short request can be continued only if it's not linked: in this case the chain is already broken.
+// A request with no progress (like a read at the end of the file) is a failure.
+static inline bool can_continue_request (const XcpIoReq *req, int res) {
+  return res > 0 &&
+    !(req->flags & (XcpIoReqFlagLink | XcpIoReqFlagHardLink)) &&
+    !(req->pImpl.state & (ReqStateTimedOut | ReqStateCanceled));
+}
+
+// Call the request callback after completion.
+// Returns false if the request is not completed because the remaining data was resubmitted.
+static inline bool process_response (XcpIoQueue *queue, XcpIoReq *req, int res) {
+  const size_t transferred = req->pImpl.transferred;
+  restore_req_iov(req);
+
+  int err;
+  if (XCP_UNLIKELY(res < 0)) {
+    // A request aborted by the kernel returns -ECANCELED or -EINTR (if a worker was executing it).
+    err = res;
+    if (res == -ECANCELED || res == -EINTR) {
+      if (req->pImpl.state & ReqStateTimedOut)
+        err = -ETIMEDOUT;
+      else if (req->pImpl.state & ReqStateCanceled)
+        err = -ECANCELED;
+    }
+  }
+  else if (!xcp_io_opcode_has_data(req->opcode) || XCP_LIKELY(transferred + (size_t)res == xcp_io_req_get_size(req)))
+    err = 0;
+  else if (can_continue_request(req, res)) {
+    continue_request(queue, req, transferred + (size_t)res);
+    return false;
+  } else {
+    // The result of a short transfer is the transferred size, like the data read before the end of a file.
+    const size_t size = transferred + (size_t)res;
+    req->pImpl.res = size < INT_MAX ? (int)size : INT_MAX;
+    err = -EIO;
+  }
+
+  complete_request(queue, req, err);
+  return true;
+}
+
+static inline void release_group (XcpIoQueue *queue, XcpIoMergeGroup *group) {
+  group->req.pImpl.state = 0;
+  group->nextFree = queue->pImpl.merge.freeGroups;
+  queue->pImpl.merge.freeGroups = group;
+}
+
+// Complete the requests of a merged request, each request receives its part of the result.
+// After a short transfer, the requests not fully transferred are continued alone.
+// Returns the number of completed requests.
+static inline unsigned int complete_group (XcpIoQueue *queue, XcpIoMergeGroup *group, int res) {
+  const uint8_t state = group->req.pImpl.state & ReqStateCanceled;
+  size_t remaining = res > 0 ? (size_t)res : 0;
+
+  XcpIoReq *req = STAILQ_FIRST(&group->members);
+  release_group(queue, group);
+
+  unsigned int completedCount = 0;
+  while (req) {
+    XcpIoReq *nextReq = STAILQ_NEXT(req, pImpl.next);
+    req->pImpl.group = NULL;
+    req->pImpl.state = state;
+
+    if (res < 0)
+      completedCount += process_response(queue, req, res);
+    else {
+      const size_t size = xcp_io_req_get_size(req);
+      const size_t reqRes = remaining < size ? remaining : size;
+      remaining -= reqRes;
+
+      // If nothing is transferred (like at the end of file), the requests fail.
+      if (reqRes || !res)
+        completedCount += process_response(queue, req, (int)reqRes);
+      else
+        continue_request(queue, req, 0);
+    }
+
+    req = nextReq;
+  }
+
+  return completedCount;
+}
+
+// Fetch responses in the queue and notify user, returns the number of completed requests.
+// A request is completed only when all its CQEs are received (see XcpIoReq.pImpl.cqeCount), so the
+// completion callback can reuse it safely: the kernel has no remaining reference to its address.
+static inline unsigned int fetch_responses (XcpIoQueue *queue) {
+  struct io_uring *ring = &queue->pImpl.ring;
+
+  // How many CQEs are ready?
+  const unsigned int count = io_uring_cq_ready(ring);
+  if (XCP_UNLIKELY(!count))
+    return 0;
+
+  stats_begin_completions(queue);
+
+  unsigned int head = *ring->cq.khead;
+  const unsigned int mask = *ring->cq.kring_mask;
+
+  const uint64_t continuedCount = queue->counters.shortTransfers;
+  unsigned int completedCount = 0;
+  for (const unsigned int last = head + count; head != last; ++head) {
+    const struct io_uring_cqe *cqe = &ring->cq.cqes[head & mask];
+    XcpIoReq *req = (XcpIoReq *)(cqe->user_data & ~(uint64_t)CqeTagMask);
+
+    switch (cqe->user_data & CqeTagMask) {
+      case CqeTagReq:
+        req->pImpl.res = cqe->res;
+        break;
+      case CqeTagThrottle:
+        // Rate limit timer expiration or update result: not related to a request.
+        if (req)
+          queue->pImpl.rateLimit.timerArmed = false;
+        continue;
+      case CqeTagTimeout:
+        // -ETIME: Expired, -ECANCELED: The request was completed before.
+        if (cqe->res == -ETIME)
+          req->pImpl.state |= ReqStateTimedOut;
+        break;
+      default:
+        // The cancel result is useless: the request result is enough.
+        break;
+    }
+
+    assert(req->pImpl.cqeCount);
+    if (XCP_LIKELY(!--req->pImpl.cqeCount)) {
+      // The queue counters are updated before the callback call, so it can insert new requests.
+      if (XCP_UNLIKELY(req->pImpl.state & ReqStateGroup)) {
+        XcpIoMergeGroup *group = (XcpIoMergeGroup *)req;
+        assert(queue->inflightCount >= group->memberCount);
+        queue->inflightCount -= group->memberCount;
+        completedCount += complete_group(queue, group, req->pImpl.res);
+      } else {
+        assert(queue->inflightCount);
+        --queue->inflightCount;
+        completedCount += process_response(queue, req, req->pImpl.res);
+      }
+    }
+  }
+
+  // Mark responses as read in the ring.
+  const struct io_uring_cq *cq = &ring->cq;
+  io_uring_smp_store_release(cq->khead, *cq->khead + count);
+
+  // Submit the continued requests now, without waiting the next submit call.
+  // On failure, the SQEs stay in the ring and they are submitted by the next call.
+  if (XCP_UNLIKELY(queue->counters.shortTransfers != continuedCount) && io_uring_sq_ready(ring))
+    submit_sqes(queue);
+
+  flush_batch(queue);
+
+  return completedCount;
+}
+
+// Poll responses if polling is enabled.
+// Note: With SQPOLL, the kernel thread reaps the completions itself.
+static inline int poll_responses (XcpIoQueue *queue) {
+  int ret = 0;
+  if (queue->usePolling && !(queue->flags & XcpIoQueueFlagSqPoll) && queue->inflightCount) {
+    struct io_uring *ring = &queue->pImpl.ring;
+    do {
+      // We must call explicitly io_uring_enter in this case to get responses.
+      // We can't use io_uring_submit here.
+      ret = (int)syscall(__NR_io_uring_enter, ring->ring_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, _NSIG / 8);
+    } while (ret < 0 && errno == EAGAIN);
+  }
+  return ret >= 0 ? 0 : ret;
+}
+
+// -----------------------------------------------------------------------------
+
+static inline void cpu_relax (void) {
+  #if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+  #elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+  #else
+    __asm__ __volatile__("" ::: "memory");
+  #endif
+}
+
+// Update the spin budget using the last wait time.
+// If the device is usually slower than the max spin time, spinning is useless: the budget is set to 0.
+static inline void update_spin_budget (XcpIoQueue *queue, uint64_t waitTime) {
+  uint64_t avgWaitTime = queue->pImpl.hybridPoll.avgWaitTime;
+  avgWaitTime = waitTime >= avgWaitTime
+    ? avgWaitTime + (waitTime - avgWaitTime) / 8
+    : avgWaitTime - (avgWaitTime - waitTime) / 8;
+  queue->pImpl.hybridPoll.avgWaitTime = avgWaitTime;
+
+  // Spin a bit longer than the average to catch most of the responses.
+  const uint64_t spinBudget = avgWaitTime + avgWaitTime / 2;
+  queue->pImpl.hybridPoll.spinBudget = spinBudget <= queue->pImpl.hybridPoll.maxSpinTime ? spinBudget : 0;
+}
+
+// Wait at least one response: spin on the completion ring, then sleep if nothing comes.
+static inline int wait_responses (XcpIoQueue *queue) {
+  struct io_uring *ring = &queue->pImpl.ring;
+  if (io_uring_cq_ready(ring) || (!queue->inflightCount && !queue->pImpl.rateLimit.timerArmed))
+    return 0;
+
+  const uint64_t start = get_monotonic_time();
+  const uint64_t spinBudget = queue->pImpl.hybridPoll.spinBudget;
+
+  uint64_t now = start;
+  while (now - start < spinBudget) {
+    if (io_uring_cq_ready(ring)) {
+      ++queue->counters.spinHits;
+      update_spin_budget(queue, get_monotonic_time() - start);
+      return 0;
+    }
+    cpu_relax();
+    now = get_monotonic_time();
+  }
+
+  // The SQEs left in the ring by a failed or partial submission are submitted before sleeping,
+  // otherwise the responses of their requests would never come.
+  int ret;
+  do {
+    ret = io_uring_submit_and_wait(ring, 1);
+  } while (ret == -EINTR || (ret == -EAGAIN && io_uring_sq_ready(ring)));
+  if (XCP_UNLIKELY(ret < 0))
+    return ret;
+
+  ++queue->counters.spinMisses;
+  update_spin_budget(queue, get_monotonic_time() - start);
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+// Remove a request and the rest of its chain from a list of pending requests, the removed requests
+// are terminated by NULL. The previous request of the chain (if any) is not linked anymore.
+// Returns the number of removed requests, 0 if the request is not in the list.
+static inline size_t remove_chain (XcpIoReq **first, XcpIoReq ***last, XcpIoReq *req) {
+  XcpIoReq **prevNext = first;
+  XcpIoReq *prev = NULL;
+  while (*prevNext != req) {
+    if (!(prev = *prevNext))
+      return 0;
+    prevNext = &STAILQ_NEXT(prev, pImpl.next);
+  }
+
+  size_t count;
+  XcpIoReq *chainLast = get_chain_last(req, &count);
+  count += get_req_count(req) - 1;
+
+  if (prev && prev->pImpl.link == req) {
+    prev->pImpl.link = NULL;
+    prev->flags &= (uint8_t)~(XcpIoReqFlagLink | XcpIoReqFlagHardLink);
+  }
+
+  if (!(*prevNext = STAILQ_NEXT(chainLast, pImpl.next)))
+    *last = prevNext;
+  STAILQ_NEXT(chainLast, pImpl.next) = NULL;
+  return count;
+}
+
+// Cancel all given requests.
+static inline void cancel_requests (XcpIoQueue *queue, XcpIoReq *reqs, int err) {
+  stats_begin_completions(queue);
+  while (reqs) {
+    XcpIoReq *nextReq = STAILQ_NEXT(reqs, pImpl.next);
+
+    // Replace a merged request by its requests.
+    if (XCP_UNLIKELY(reqs->pImpl.state & ReqStateGroup)) {
+      XcpIoMergeGroup *group = (XcpIoMergeGroup *)reqs;
+      *group->members.stqh_last = nextReq;
+      nextReq = STAILQ_FIRST(&group->members);
+      release_group(queue, group);
+      reqs = nextReq;
+      continue;
+    }
+
+    reqs->pImpl.group = NULL;
+    restore_req_iov(reqs);
+    reqs->pImpl.state = 0;
+    complete_request(queue, reqs, err);
+    reqs = nextReq;
+  }
+  flush_batch(queue);
+}
+
+// Returns the number of SQEs used by a request: the request itself and its link timeout.
+static inline unsigned int get_sqe_count (const XcpIoReq *req) {
+  return req->timeout ? 2 : 1;
+}
+
+// Returns the number of SQEs used by a chain.
+static inline unsigned int get_chain_sqe_count (const XcpIoReq *req) {
+  unsigned int count = 0;
+  do {
+    count += get_sqe_count(req);
+  } while ((req = req->pImpl.link));
+  return count;
+}
+
+static inline void set_sqe_len (struct io_uring_sqe *sqe, size_t len) {
+  assert(len <= UINT32_MAX);
+  sqe->len = (uint32_t)len;
+}
+
+// Returns the buffer of a request which is not vectored, or the rest of this buffer if the request is continued.
+static inline const struct iovec *get_remaining_iov (const XcpIoReq *req) {
+  return XCP_UNLIKELY(req->pImpl.partialIov.iov_len) ? &req->pImpl.partialIov : &req->iov;
+}
+
+// Fill a io_uring_sqe instance from a XcpIoReq.
+static inline void set_sqe_from_req (XcpIoReq *req, struct io_uring_sqe *sqe) {
+  // The sqe layout depends on the kernel headers version, so we can't reset the padding fields one by one.
+  memset(sqe, 0, sizeof *sqe);
+
+  switch (req->opcode) {
+    case XcpIoOpcodeRead:
+    case XcpIoOpcodeWrite:
+      sqe->opcode = req->opcode == XcpIoOpcodeRead ? IORING_OP_READV : IORING_OP_WRITEV;
+      sqe->addr = (uint64_t)get_remaining_iov(req);
+      sqe->len = 1;
+      break;
+    case XcpIoOpcodeReadV:
+    case XcpIoOpcodeWriteV:
+      sqe->opcode = req->opcode == XcpIoOpcodeReadV ? IORING_OP_READV : IORING_OP_WRITEV;
+      if (XCP_UNLIKELY(req->pImpl.partialIov.iov_len)) {
+        // The rest of a partially transferred iovec is submitted alone, the next iovecs are continued after.
+        sqe->addr = (uint64_t)&req->pImpl.partialIov;
+        sqe->len = 1;
+      } else {
+        sqe->addr = (uint64_t)((const struct iovec *)req->iov.iov_base + req->pImpl.iovIndex);
+        set_sqe_len(sqe, req->iov.iov_len - req->pImpl.iovIndex);
+      }
+      break;
+    case XcpIoOpcodeReadFixed:
+    case XcpIoOpcodeWriteFixed:
+      sqe->opcode = req->opcode == XcpIoOpcodeReadFixed ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+      sqe->addr = (uint64_t)get_remaining_iov(req)->iov_base;
+      set_sqe_len(sqe, get_remaining_iov(req)->iov_len);
+      sqe->buf_index = req->bufIndex;
+      break;
+    case XcpIoOpcodeFsync:
+    case XcpIoOpcodeFdatasync:
+      sqe->opcode = IORING_OP_FSYNC;
+      sqe->fsync_flags = req->opcode == XcpIoOpcodeFdatasync ? IORING_FSYNC_DATASYNC : 0;
+      break;
+    case XcpIoOpcodeSyncFileRange:
+      sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+      set_sqe_len(sqe, req->iov.iov_len);
+      sqe->sync_range_flags = req->opFlags;
+      break;
+    case XcpIoOpcodePoll:
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->poll32_events = req->opFlags;
+      break;
+    case XcpIoOpcodeSplice:
+      sqe->opcode = IORING_OP_SPLICE;
+      set_sqe_len(sqe, req->iov.iov_len);
+      sqe->splice_off_in = (uint64_t)req->inOffset;
+      sqe->splice_fd_in = req->inFd;
+      sqe->splice_flags = req->opFlags;
+      break;
+    case XcpIoOpcodeFallocate:
+      sqe->opcode = IORING_OP_FALLOCATE;
+      sqe->addr = (uint64_t)req->iov.iov_len;
+      sqe->len = req->opFlags;
+      break;
+  }
+
+  if (req->flags & XcpIoReqFlagFixedFile)
+    sqe->flags |= IOSQE_FIXED_FILE;
+  if (req->flags & XcpIoReqFlagLink)
+    sqe->flags |= IOSQE_IO_LINK;
+  else if (req->flags & XcpIoReqFlagHardLink)
+    sqe->flags |= IOSQE_IO_HARDLINK;
+  if (req->flags & XcpIoReqFlagBarrier)
+    sqe->flags |= IOSQE_IO_DRAIN;
+
+  // The offset -1 (current file position) is updated by the kernel.
+  off_t offset = req->offset;
+  if (XCP_UNLIKELY(req->pImpl.transferred) && offset != -1)
+    offset += (off_t)req->pImpl.transferred;
+
+  sqe->fd = req->fd;
+  sqe->off = (uint64_t)offset;
+  sqe->ioprio = req->ioprio;
+  sqe->user_data = (uint64_t)req;
+
+  req->pImpl.cqeCount = 1;
+  req->pImpl.state &= ReqStateGroup;
+}
+
+// Fill the SQE of the link timeout of a request, must directly follow the request SQE.
+static inline void set_timeout_sqe_from_req (XcpIoReq *req, struct io_uring_sqe *reqSqe, struct io_uring_sqe *sqe) {
+  req->pImpl.timeoutSpec.tv_sec = (int64_t)(req->timeout / 1000000);
+  req->pImpl.timeoutSpec.tv_nsec = (long long)(req->timeout % 1000000 * 1000);
+
+  io_uring_prep_link_timeout(sqe, &req->pImpl.timeoutSpec, 0);
+  sqe->user_data = (uint64_t)req | CqeTagTimeout;
+
+  // The timeout is attached to the request by a link, the request link (if any) is copied on the timeout
+  // to continue the chain. A hard link is kept on the request: a failure must not cancel the chain.
+  sqe->flags = reqSqe->flags & (IOSQE_IO_LINK | IOSQE_IO_HARDLINK);
+  if (!(reqSqe->flags & IOSQE_IO_HARDLINK))
+    reqSqe->flags |= IOSQE_IO_LINK;
+
+  ++req->pImpl.cqeCount;
+}
+
+// Fill the SQEs of one request (see: get_sqe_count). Returns -EBUSY if the ring is full.
+static inline int set_sqes_from_req (struct io_uring *ring, XcpIoReq *req) {
+  // The space is checked first: a SQE is never reserved without being filled.
+  if (XCP_UNLIKELY(io_uring_sq_space_left(ring) < get_sqe_count(req)))
+    return -EBUSY;
+
+  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *timeoutSqe = XCP_UNLIKELY(req->timeout) ? io_uring_get_sqe(ring) : NULL;
+  if (XCP_UNLIKELY(!sqe || (req->timeout && !timeoutSqe)))
+    return -EBUSY;
+
+  set_sqe_from_req(req, sqe);
+  if (timeoutSqe)
+    set_timeout_sqe_from_req(req, sqe, timeoutSqe);
+  return 0;
+}
+
+// Move pending requests in the submission ring, returns the number of moved requests.
+// Once in the ring, requests are considered inflight: if the submission fails they
+// stay in the ring and are submitted by the next io_uring_enter call.
+static inline size_t fill_sqes (XcpIoQueue *queue) {
+  if (XCP_UNLIKELY(queue->pImpl.rateLimit.count))
+    apply_rate_limits(queue);
+  else if (queue->pImpl.sched.reqCount)
+    dequeue_scheduled(queue);
+
+  if (XCP_UNLIKELY(!STAILQ_FIRST(&queue->reqs)))
+    return 0;
+  assert(queue->pendingCount);
+
+  if (queue->flags & XcpIoQueueFlagMerge)
+    merge_pending(queue);
+
+  XcpIoReq *req = STAILQ_FIRST(&queue->reqs);
+  struct io_uring *ring = &queue->pImpl.ring;
+  XcpIoReq *last = NULL;
+  size_t n = 0;
+  while (req) {
+    // A chain can't be split between two submissions, otherwise the link is lost.
+    // It's the same thing for a request and its timeout.
+    if (XCP_UNLIKELY(req->pImpl.link || req->timeout)) {
+      const unsigned int sqeCount = get_chain_sqe_count(req);
+      assert(sqeCount <= ring->sq.ring_entries);
+      if (io_uring_sq_space_left(ring) < sqeCount)
+        break;
+      bool linked;
+      do {
+        linked = req->pImpl.link;
+        // The space of the whole chain is checked: its SQEs can't be missing.
+        const int ret = set_sqes_from_req(ring, req);
+        assert(!ret);
+        XCP_UNUSED(ret);
+        last = req;
+        req = STAILQ_NEXT(req, pImpl.next);
+        ++n;
+      } while (linked);
+      continue;
+    }
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (!sqe)
+      break;
+    set_sqe_from_req(req, sqe);
+    last = req;
+    n += get_req_count(req);
+    req = STAILQ_NEXT(req, pImpl.next);
+  }
+
+  if (XCP_LIKELY(n)) {
+    stats_on_submit(queue, last, n);
+    STAILQ_REMOVE_HEAD_UNTIL(&queue->reqs, last, pImpl.next);
+    assert(queue->pendingCount >= n);
+    queue->pendingCount -= n;
+    queue->inflightCount += n;
+  }
+
+  return n;
+}
 
-// =============================================================================
+// Submit the SQEs of the ring.
+static inline int submit_sqes (XcpIoQueue *queue) {
+  struct io_uring *ring = &queue->pImpl.ring;
 
-// Move [HEAD1, LAST] to the new list HEAD2.
-// It's an optimization to avoid remove/insert.
-#define STAILQ_CUT(HEAD1, LAST, HEAD2, FIELD) \
-  do { \
-    assert((LAST)); \
-    (HEAD2)->stqh_first = (HEAD1)->stqh_first; \
-    (HEAD2)->stqh_last = &(LAST)->FIELD.stqe_next; \
-    (LAST)->FIELD.stqe_next = NULL; \
-    if (!((HEAD1)->stqh_first = (LAST)->FIELD.stqe_next)) \
-      (HEAD1)->stqh_last = &(HEAD1)->stqh_first; \
-  } while (false)
+  // Note: With SQPOLL, io_uring_submit only calls io_uring_enter to wake up the kernel
+  // thread when it is sleeping (IORING_SQ_NEED_WAKEUP), otherwise no syscall is made.
+  int ret;
+  do {
+    ret = io_uring_submit(ring);
+  } while (ret == -EAGAIN);
+  return ret;
+}
 
 // -----------------------------------------------------------------------------
 
-// Call the request callback after completion.
-static inline void process_response (XcpIoReq *req, int res) {
-  int err;
-  if (XCP_UNLIKELY(res < 0))
-    err = res;
-  else if (XCP_LIKELY((size_t)res == xcp_io_req_get_size(req)))
-    err = 0;
-  else // TODO: Reschedule instead.
-    err = -EIO;
+// Add a request and the rest of its chain in the pending list. With a scheduler, only the head is given.
+static inline void insert_requests (XcpIoQueue *queue, XcpIoReq *req) {
+  XcpIoScheduler *scheduler = queue->pImpl.sched.scheduler;
 
-  if (XCP_LIKELY(req->cb))
-     req->cb(req, err, req->userData);
-}
+  XcpIoReq *head = req;
+  stats_on_insert(head);
 
-// Fetch responses in the queue and notify user.
-static inline unsigned int fetch_responses (XcpIoQueue *queue) {
-  struct io_uring *ring = &queue->pImpl.ring;
+  size_t count = 0;
+  do {
+    req->pImpl.state = ReqStatePending;
+    req->pImpl.cqeCount = 0;
+    req->pImpl.transferred = 0;
+    req->pImpl.iovIndex = 0;
+    req->pImpl.partialIov.iov_len = 0;
+    if (XCP_LIKELY(!scheduler))
+      STAILQ_INSERT_TAIL(&queue->reqs, req, pImpl.next);
+    ++count;
+  } while (XCP_UNLIKELY(req = req->pImpl.link));
 
-  // How many responses are ready?
-  const unsigned int count = io_uring_cq_ready(ring);
-  if (XCP_UNLIKELY(!count))
-    return 0;
-  assert(count <= queue->capacity);
+  queue->pendingCount += count;
+  if (scheduler) {
+    queue->pImpl.sched.reqCount += count;
+    scheduler->ops->enqueue(scheduler, head);
+  }
+}
 
-  // Fill response array.
-  unsigned int head = *ring->cq.khead;
-  const unsigned int mask = *ring->cq.kring_mask;
+static inline size_t find_split_limit_index (const XcpIoQueue *queue, int fd) {
+  const XcpIoSplitLimit *limits = queue->pImpl.split.limits;
+  size_t low = 0;
+  size_t high = queue->pImpl.split.count;
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    if (limits[mid].fd < fd)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
 
-  for (const unsigned int last = head + count; head != last; ++head) {
-    const struct io_uring_cqe *cqe = &ring->cq.cqes[head & mask];
-    process_response((XcpIoReq *)cqe->user_data, cqe->res);
+// Get the limits of the fd of a request (if any), combined with the limits of the kernel.
+static inline void get_split_limit (const XcpIoQueue *queue, const XcpIoReq *req, XcpIoSplitLimit *limit) {
+  int fd = req->fd;
+  if (req->flags & XcpIoReqFlagFixedFile)
+    fd = (unsigned int)fd < queue->pImpl.files.size ? queue->pImpl.files.fds[fd] : -1;
+
+  const size_t index = find_split_limit_index(queue, fd);
+  if (index < queue->pImpl.split.count && queue->pImpl.split.limits[index].fd == fd)
+    *limit = queue->pImpl.split.limits[index];
+  else {
+    limit->fd = fd;
+    limit->maxSize = SIZE_MAX;
+    limit->maxIovecCount = IOV_MAX;
   }
 
-  // Mark responses as read in the ring.
-  const struct io_uring_cq *cq = &ring->cq;
-  io_uring_smp_store_release(cq->khead, *cq->khead + count);
+  if ((req->opcode & (XcpIoOpcodeReadFixed | XcpIoOpcodeWriteFixed)) && limit->maxSize > SPLIT_MAX_FIXED_SIZE)
+    limit->maxSize = SPLIT_MAX_FIXED_SIZE;
+}
 
-  assert(queue->inflightCount >= count);
-  queue->inflightCount -= count;
+// Returns true if a request exceeds its limits, which are returned in limit.
+static inline bool needs_split (const XcpIoQueue *queue, const XcpIoReq *req, XcpIoSplitLimit *limit) {
+  // Without device limits, only the vectored and fixed requests can exceed the limits of the kernel.
+  const XcpIoOpcode opcode = req->opcode;
+  if (XCP_LIKELY(!queue->pImpl.split.count) &&
+    !(opcode & (XcpIoOpcodeReadV | XcpIoOpcodeWriteV | XcpIoOpcodeReadFixed | XcpIoOpcodeWriteFixed)))
+    return false;
 
-  return count;
+  if (!xcp_io_opcode_has_data(opcode) || req->offset < 0 || req->pImpl.link || (req->flags & ~XcpIoReqFlagFixedFile))
+    return false;
+
+  get_split_limit(queue, req, limit);
+  return get_iovec_count(req) > limit->maxIovecCount ||
+    (limit->maxSize != SIZE_MAX && xcp_io_req_get_size(req) > limit->maxSize);
 }
 
-// Poll responses if polling is enabled.
-static inline int poll_responses (XcpIoQueue *queue) {
-  int ret = 0;
-  if (queue->usePolling && queue->inflightCount) {
-    struct io_uring *ring = &queue->pImpl.ring;
-    do {
-      // We must call explicitly io_uring_enter in this case to get responses.
-      // We can't use io_uring_submit here.
-      ret = (int)syscall(__NR_io_uring_enter, ring->ring_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, _NSIG / 8);
-    } while (ret < 0 && errno == EAGAIN);
+// Prepare a child of a split request, it inherits the properties of its parent but not its callback.
+static inline void prep_split_child (
+  XcpIoSplit *split, XcpIoReq *child, struct iovec *iovecs, size_t iovecCount, off_t offset
+) {
+  const XcpIoReq *parent = split->parent;
+  if (is_vectored(parent->opcode))
+    xcp_io_req_prep_rw(child, parent->opcode, parent->fd, iovecs, iovecCount, offset);
+  else {
+    assert(iovecCount == 1);
+    xcp_io_req_prep_rw(child, parent->opcode, parent->fd, iovecs->iov_base, iovecs->iov_len, offset);
+    child->bufIndex = parent->bufIndex;
   }
-  return ret >= 0 ? 0 : ret;
+
+  child->cb = NULL;
+  child->userData = NULL;
+  child->flags = parent->flags;
+  child->timeout = parent->timeout;
+  child->ioprio = parent->ioprio;
+  child->tenant = parent->tenant;
+  child->pImpl.res = 0;
+  child->pImpl.split = split;
 }
 
-// Cancel all given requests.
-static inline void cancel_requests (XcpIoReq *reqs, int err) {
-  while (reqs) {
-    XcpIoReq *nextReq = STAILQ_NEXT(reqs, pImpl.next);
+// Cut a request in children: a child ends at a multiple of the max size in the file, or after the max
+// number of iovecs. Returns the number of children, the number of iovecs of all the children is written
+// in iovecCount. If split is not NULL, the children and their iovecs are prepared.
+static size_t cut_request (const XcpIoReq *req, const XcpIoSplitLimit *limit, XcpIoSplit *split, size_t *iovecCount) {
+  const struct iovec *iovecs = get_iovecs(req);
+  const size_t count = get_iovec_count(req);
+  struct iovec *childIovecs = split ? (struct iovec *)(void *)&split->children[split->childCount] : NULL;
 
-    if (XCP_LIKELY(reqs->cb))
-      reqs->cb(reqs, err, reqs->userData);
-    reqs = nextReq;
+  uint64_t offset = (uint64_t)req->offset;
+  size_t childCount = 0;
+  size_t total = 0;
+  size_t index = 0;
+  size_t skip = 0; // Size of iovecs[index] given to the previous children.
+  while (index < count) {
+    const uint64_t end = limit->maxSize == SIZE_MAX
+      ? UINT64_MAX
+      : (offset / limit->maxSize + 1) * limit->maxSize;
+
+    const size_t first = total;
+    uint64_t size = 0;
+    for (; index < count && total - first < limit->maxIovecCount && offset + size < end; ++total) {
+      const size_t len = iovecs[index].iov_len - skip;
+      const size_t partLen = end - offset - size < len ? (size_t)(end - offset - size) : len;
+      if (childIovecs) {
+        childIovecs[total].iov_base = (char *)iovecs[index].iov_base + skip;
+        childIovecs[total].iov_len = partLen;
+      }
+
+      size += partLen;
+      if (partLen == len) {
+        ++index;
+        skip = 0;
+      } else
+        skip += partLen;
+    }
+
+    if (split)
+      prep_split_child(split, &split->children[childCount], &childIovecs[first], total - first, (off_t)offset);
+    offset += size;
+    ++childCount;
   }
+
+  *iovecCount = total;
+  return childCount;
 }
 
-static inline void set_sqe_len (struct io_uring_sqe *sqe, size_t len) {
-  assert(len <= UINT32_MAX);
-  sqe->len = (uint32_t)len;
+// Insert the children of a request in the pending list instead of the request.
+// Returns -ENOMEM if the children can't be allocated: the request can't be inserted as is, the kernel would
+// reject it.
+static int split_request (XcpIoQueue *queue, XcpIoReq *req, const XcpIoSplitLimit *limit) {
+  size_t iovecCount;
+  const size_t childCount = cut_request(req, limit, NULL, &iovecCount);
+
+  XcpIoSplit *split = malloc(
+    sizeof *split + childCount * sizeof *split->children + iovecCount * sizeof(struct iovec)
+  );
+  if (XCP_UNLIKELY(!split))
+    return -ENOMEM;
+
+  split->parent = req;
+  split->remainingCount = childCount;
+  split->err = 0;
+  split->res = 0;
+  split->childCount = childCount;
+  cut_request(req, limit, split, &iovecCount);
+
+  req->pImpl.split = split;
+  req->pImpl.state = 0;
+  req->pImpl.cqeCount = 0;
+  stats_on_insert(req);
+
+  ++queue->counters.splits;
+  queue->counters.splitRequests += childCount;
+  for (size_t i = 0; i < childCount; ++i)
+    insert_requests(queue, &split->children[i]);
+  return 0;
 }
 
-// Fill a io_uring_sqe instance from a XcpIoReq.
-static inline void set_sqe_from_req (const XcpIoReq *req, struct io_uring_sqe *sqe) {
-  sqe->opcode = req->opcode == XcpIoOpcodeRead || req->opcode == XcpIoOpcodeReadV
-    ? IORING_OP_READV
-    : IORING_OP_WRITEV;
-  sqe->flags = 0;
-  sqe->ioprio = 0;
-  sqe->fd = req->fd;
-  sqe->off = (uint64_t)req->offset;
-  sqe->addr = (uint64_t)&req->iov;
-  set_sqe_len(sqe, req->opcode == XcpIoOpcodeRead || req->opcode == XcpIoOpcodeWrite ? 1 : (uint32_t)req->iov.iov_len);
-  sqe->rw_flags = 0;
-  sqe->user_data = (uint64_t)req;
-  sqe->__pad2[0] = sqe->__pad2[1] = sqe->__pad2[2] = 0;
-  sqe->buf_index = 0;
+// Cancel the children of a split request, the request is completed with the last child.
+static int cancel_split (XcpIoQueue *queue, XcpIoSplit *split) {
+  // Hold a reference: the split can't be completed by the cancellations of the loop.
+  ++split->remainingCount;
+
+  int ret = 0;
+  for (size_t i = 0; i < split->childCount; ++i) {
+    const int childRet = xcp_io_req_cancel(queue, &split->children[i]);
+    if (childRet && childRet != -ENOENT && !ret)
+      ret = childRet;
+  }
+
+  if (!--split->remainingCount) {
+    int err;
+    XcpIoReq *req = finish_split(split, &err);
+    stats_begin_completions(queue);
+    complete_request(queue, req, err);
+    flush_batch(queue);
+  }
+  return ret;
 }
 
 // -----------------------------------------------------------------------------
 
 int xcp_io_queue_init (XcpIoQueue *queue, size_t capacity, bool usePolling) {
+  XcpIoQueueOptions options;
+  xcp_io_queue_options_init(&options, capacity);
+  if (usePolling)
+    options.flags |= XcpIoQueueFlagIoPoll;
+  return xcp_io_queue_init_with_options(queue, &options);
+}
+
+int xcp_io_queue_init_with_options (XcpIoQueue *queue, const XcpIoQueueOptions *options) {
   // 1. Init fields.
   memset(queue, 0, sizeof *queue);
+  size_t capacity = options->capacity;
   if (!capacity)
     return -EINVAL;
   if (capacity > INT_MAX)
     capacity = INT_MAX;
 
+  const bool usePolling = options->flags & XcpIoQueueFlagIoPoll;
+  const bool useEventFd = !usePolling && !(options->flags & (XcpIoQueueFlagNoEventFd | XcpIoQueueFlagHybridPoll));
+
   queue->eventFd = -1;
   queue->usePolling = usePolling;
+  queue->flags = options->flags;
+
+  // Start with a spin budget equal to the max spin time, it's quickly adjusted.
+  const uint64_t maxSpinTime = 1000 * (uint64_t)(options->maxSpinTime
+    ? options->maxSpinTime
+    : XCP_IO_QUEUE_DEFAULT_MAX_SPIN_TIME
+  );
+  queue->pImpl.hybridPoll.maxSpinTime = maxSpinTime;
+  queue->pImpl.hybridPoll.spinBudget = maxSpinTime;
+  queue->pImpl.hybridPoll.avgWaitTime = maxSpinTime / 2;
 
   STAILQ_INIT(&queue->reqs);
 
   int err = 0;
 
   // 2. Create an eventfd to be notified when a request ends.
-  if (!usePolling && (queue->eventFd = eventfd(0, 0)) < 0)
+  if (useEventFd && (queue->eventFd = eventfd(0, 0)) < 0)
     return -errno;
 
   // 3. Init ring.
+  struct io_uring_params params;
+  memset(&params, 0, sizeof params);
+
+  // Timeouts and cancellations add CQEs: use a larger completion ring than the default one (2 * capacity).
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+  params.cq_entries = capacity <= INT_MAX / 4 ? (unsigned int)capacity * 4 : INT_MAX;
+  if (usePolling)
+    params.flags |= IORING_SETUP_IOPOLL;
+  if (options->flags & XcpIoQueueFlagSqPoll) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = options->sqThreadIdle;
+    if (options->sqThreadCpu >= 0) {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = (uint32_t)options->sqThreadCpu;
+    }
+  }
+  if (options->parent) {
+    params.flags |= IORING_SETUP_ATTACH_WQ;
+    params.wq_fd = (uint32_t)options->parent->pImpl.ring.ring_fd;
+  }
+
   struct io_uring *ring = &queue->pImpl.ring;
-  if ((err = io_uring_queue_init((unsigned int)capacity, ring, usePolling ? IORING_SETUP_IOPOLL : 0)) < 0) {
+  if ((err = io_uring_queue_init_params((unsigned int)capacity, ring, &params)) < 0) {
     close(queue->eventFd);
     queue->eventFd = -1;
-  } else if (!usePolling && (err = io_uring_register_eventfd(ring, queue->eventFd)) < 0)
-    xcp_io_queue_uninit(queue);
-  else
-    queue->capacity = capacity;
+    return err;
+  }
+
+  // 4. Register eventfd and set worker limits.
+  unsigned int maxBoundedWorkers = options->maxBoundedWorkers;
+  unsigned int maxUnboundedWorkers = options->maxUnboundedWorkers;
+  if (
+    (useEventFd && (err = io_uring_register_eventfd(ring, queue->eventFd)) < 0) ||
+    ((maxBoundedWorkers || maxUnboundedWorkers) &&
+      (err = xcp_io_queue_set_max_workers(queue, &maxBoundedWorkers, &maxUnboundedWorkers)) < 0)
+  ) {
+    io_uring_queue_exit(ring);
+    close(queue->eventFd);
+    queue->eventFd = -1;
+    return err;
+  }
+
+  // 5. Allocate merge groups: a group contains at least two requests.
+  if (options->flags & XcpIoQueueFlagMerge) {
+    const size_t groupCount = capacity / 2 ? capacity / 2 : 1;
+    XcpIoMergeGroup *groups = malloc(groupCount * sizeof *groups);
+    if (!groups) {
+      io_uring_queue_exit(ring);
+      close(queue->eventFd);
+      queue->eventFd = -1;
+      return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < groupCount; ++i)
+      groups[i].nextFree = i + 1 < groupCount ? &groups[i + 1] : NULL;
+    queue->pImpl.merge.groups = groups;
+    queue->pImpl.merge.freeGroups = groups;
+    queue->pImpl.merge.maxSize = options->maxMergeSize
+      ? options->maxMergeSize
+      : XCP_IO_QUEUE_DEFAULT_MAX_MERGE_SIZE;
+  }
+
+  // 6. Allocate statistics.
+  #ifdef XCP_IO_ENABLE_STATS
+    XcpIoQueueStats *stats = calloc(2, sizeof *stats);
+    if (!stats) {
+      free(queue->pImpl.merge.groups);
+      io_uring_queue_exit(ring);
+      close(queue->eventFd);
+      queue->eventFd = -1;
+      return -ENOMEM;
+    }
+
+    for (unsigned int i = 0; i < XCP_IO_STATS_FD_COUNT; ++i)
+      stats[0].fds[i].fd = stats[1].fds[i].fd = -1;
+    queue->pImpl.stats.current = &stats[0];
+    queue->pImpl.stats.baseline = &stats[1];
+  #endif // ifdef XCP_IO_ENABLE_STATS
 
-  return err;
+  queue->capacity = capacity;
+  return 0;
 }
 
 void xcp_io_queue_uninit (XcpIoQueue *queue) {
   if (!queue->capacity)
     return;
 
+  xcp_io_queue_unregister_buffers(queue);
+  xcp_io_queue_unregister_file_table(queue);
+  free(queue->pImpl.batch.responses);
+  free(queue->pImpl.merge.groups);
+
+  for (size_t i = 0; i < queue->pImpl.rateLimit.count; ++i)
+    free(queue->pImpl.rateLimit.limiters[i]);
+  free(queue->pImpl.rateLimit.limiters);
+  free(queue->pImpl.split.limits);
+
+  #ifdef XCP_IO_ENABLE_STATS
+    free(queue->pImpl.stats.current);
+  #endif // ifdef XCP_IO_ENABLE_STATS
+
   if (queue->eventFd != -1) {
     close(queue->eventFd);
     queue->eventFd = -1;
@@ -186,70 +1706,282 @@ void xcp_io_queue_uninit (XcpIoQueue *queue) {
   io_uring_queue_exit(&queue->pImpl.ring);
 }
 
-void xcp_io_queue_insert (XcpIoQueue *queue, XcpIoReq *req) {
-  STAILQ_INSERT_TAIL(&queue->reqs, req, pImpl.next);
-  ++queue->pendingCount;
+int xcp_io_queue_set_max_workers (XcpIoQueue *queue, unsigned int *bounded, unsigned int *unbounded) {
+  unsigned int values[2] = { *bounded, *unbounded };
+  const int ret = io_uring_register_iowq_max_workers(&queue->pImpl.ring, values);
+  if (ret < 0)
+    return ret;
+
+  *bounded = values[0];
+  *unbounded = values[1];
+  return 0;
+}
+
+int xcp_io_queue_insert (XcpIoQueue *queue, XcpIoReq *req) {
+  XcpIoSplitLimit limit;
+  if (XCP_UNLIKELY(needs_split(queue, req, &limit)))
+    return split_request(queue, req, &limit);
+  insert_requests(queue, req);
+  return 0;
 }
 
 int xcp_io_queue_submit (XcpIoQueue *queue) {
+  // 1. Insert requests in the ring.
+  const size_t n = fill_sqes(queue);
+
+  // 2. Submit requests.
+  int ret;
+  if (XCP_LIKELY(n) || io_uring_sq_ready(&queue->pImpl.ring))
+    ret = submit_sqes(queue);
+  else
+    ret = poll_responses(queue);
+
+  return ret < 0 ? ret : (int)n;
+}
+
+int xcp_io_queue_submit_and_wait (XcpIoQueue *queue, unsigned int minComplete, const struct timespec *timeout) {
   struct io_uring *ring = &queue->pImpl.ring;
 
   // 1. Insert requests in the ring.
-  size_t n = 0;
-  XcpIoReq *req = STAILQ_FIRST(&queue->reqs);
-  if (XCP_LIKELY(req)) {
-    assert(queue->pendingCount);
+  fill_sqes(queue);
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
-    if (XCP_LIKELY(sqe)) {
-      set_sqe_from_req(req, sqe);
+  // 2. Submit and wait responses in one syscall.
+  // Never wait more responses than inflight requests, otherwise we could be stuck forever.
+  // Without inflight requests, the rate limit timer (if armed) is waited.
+  if (minComplete > queue->inflightCount)
+    minComplete = queue->inflightCount ? (unsigned int)queue->inflightCount : queue->pImpl.rateLimit.timerArmed;
 
-      for (++n; n < queue->pendingCount; ++n) {
-        struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
-        if (!sqe)
-          break;
-        req = STAILQ_NEXT(req, pImpl.next);
-        set_sqe_from_req(req, sqe);
-      }
-    }
+  struct __kernel_timespec ts;
+  if (timeout) {
+    ts.tv_sec = timeout->tv_sec;
+    ts.tv_nsec = timeout->tv_nsec;
   }
 
-  // 2. Submit requests and clean pending req list.
-  int ret = 0;
-  if (XCP_LIKELY(n)) {
-    STAILQ_HEAD(, XcpIoReq) reqsToSubmit;
-    STAILQ_INIT(&reqsToSubmit);
-    STAILQ_CUT(&queue->reqs, req, &reqsToSubmit, pImpl.next);
-    do {
-      ret = io_uring_submit(ring);
-    } while (ret < 0 && errno == EAGAIN);
-
-    // Fatal error, discard requests.
-    if (XCP_UNLIKELY(ret < 0))
-      cancel_requests(STAILQ_FIRST(&reqsToSubmit), -errno);
-    else
-      queue->inflightCount += n;
+  struct io_uring_cqe *cqe;
+  int ret;
+  do {
+    ret = io_uring_submit_and_wait_timeout(ring, &cqe, minComplete, timeout ? &ts : NULL, NULL);
+  } while (ret == -EAGAIN && io_uring_sq_ready(ring));
 
-    assert(queue->pendingCount >= n);
-    queue->pendingCount -= n;
-  } else
-    ret = poll_responses(queue);
+  // Timeout or interruption: the SQEs are consumed anyway, we can fetch the available responses.
+  if (XCP_UNLIKELY(ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EAGAIN))
+    return ret;
 
-  return ret ? ret : (int)n;
+  // 3. Process responses.
+  return (int)fetch_responses(queue);
 }
 
 int xcp_io_queue_cancel (XcpIoQueue *queue) {
-  cancel_requests(STAILQ_FIRST(&queue->reqs), -EIO);
+  // Throttled requests are canceled first, scheduled requests last.
+  XcpIoScheduler *scheduler = queue->pImpl.sched.scheduler;
+  XcpIoReq *req;
+  while (queue->pImpl.sched.reqCount && (req = scheduler->ops->dequeue(scheduler)))
+    queue->pImpl.sched.reqCount -= append_chain(queue, req);
+  assert(!queue->pImpl.sched.reqCount);
+
+  for (size_t i = 0; queue->pImpl.rateLimit.reqCount && i < queue->pImpl.rateLimit.count; ++i)
+    unthrottle_rate_limiter(queue, queue->pImpl.rateLimit.limiters[i]);
+
+  XcpIoReq *reqs = STAILQ_FIRST(&queue->reqs);
   STAILQ_INIT(&queue->reqs);
 
   const size_t pendingCount = queue->pendingCount;
   queue->pendingCount = 0;
+
+  cancel_requests(queue, reqs, -EIO);
   return (int)pendingCount;
 }
 
+int xcp_io_queue_set_scheduler (XcpIoQueue *queue, XcpIoScheduler *scheduler) {
+  if (queue->pImpl.sched.reqCount)
+    return -EBUSY;
+  queue->pImpl.sched.scheduler = scheduler;
+  return 0;
+}
+
+int xcp_io_queue_set_rate_limit (XcpIoQueue *queue, uint32_t key, const XcpIoRateLimit *limit) {
+  XcpIoRateLimiter **limiters = queue->pImpl.rateLimit.limiters;
+  const size_t count = queue->pImpl.rateLimit.count;
+  const size_t index = find_rate_limiter_index(queue, key);
+  XcpIoRateLimiter *limiter = index < count && limiters[index]->key == key ? limiters[index] : NULL;
+
+  // 1. Remove the limit, throttled requests can be submitted immediately.
+  if (!limit || (!limit->iops && !limit->bandwidth)) {
+    if (limiter) {
+      unthrottle_rate_limiter(queue, limiter);
+      memmove(&limiters[index], &limiters[index + 1], (count - index - 1) * sizeof *limiters);
+      queue->pImpl.rateLimit.count = count - 1;
+      free(limiter);
+    }
+    return 0;
+  }
+
+  if (limit->iops > XCP_IO_RATE_LIMIT_MAX || limit->bandwidth > XCP_IO_RATE_LIMIT_MAX)
+    return -EINVAL;
+
+  // 2. Add a new limiter, its buckets are full.
+  if (!limiter) {
+    if (!(limiter = malloc(sizeof *limiter)))
+      return -ENOMEM;
+    if (!(limiters = realloc(limiters, (count + 1) * sizeof *limiters))) {
+      free(limiter);
+      return -ENOMEM;
+    }
+
+    memmove(&limiters[index + 1], &limiters[index], (count - index) * sizeof *limiters);
+    limiters[index] = limiter;
+    queue->pImpl.rateLimit.limiters = limiters;
+    queue->pImpl.rateLimit.count = count + 1;
+
+    limiter->key = key;
+    limiter->reqBucket.tat = 0;
+    limiter->byteBucket.tat = 0;
+    STAILQ_INIT(&limiter->reqs);
+  }
+
+  // 3. Set the rates, the state of an existing limiter is kept.
+  init_rate_limit_bucket(&limiter->reqBucket, limit->iops, limit->iopsBurst);
+  init_rate_limit_bucket(&limiter->byteBucket, limit->bandwidth, limit->bandwidthBurst);
+  return 0;
+}
+
+int xcp_io_queue_set_device_limits (XcpIoQueue *queue, int fd, const XcpIoDeviceLimits *limits) {
+  if (fd < 0)
+    return -EBADF;
+
+  XcpIoSplitLimit *splitLimits = queue->pImpl.split.limits;
+  const size_t count = queue->pImpl.split.count;
+  const size_t index = find_split_limit_index(queue, fd);
+  const bool found = index < count && splitLimits[index].fd == fd;
+
+  // 1. Remove the limits.
+  if (!limits) {
+    if (found) {
+      memmove(&splitLimits[index], &splitLimits[index + 1], (count - index - 1) * sizeof *splitLimits);
+      queue->pImpl.split.count = count - 1;
+    }
+    return 0;
+  }
+
+  const size_t blockSize = limits->logicalBlockSize;
+  if (!blockSize || (blockSize & (blockSize - 1)))
+    return -EINVAL;
+
+  // 2. Add the limits of a new fd.
+  if (!found) {
+    if (!(splitLimits = realloc(splitLimits, (count + 1) * sizeof *splitLimits)))
+      return -ENOMEM;
+
+    memmove(&splitLimits[index + 1], &splitLimits[index], (count - index) * sizeof *splitLimits);
+    queue->pImpl.split.limits = splitLimits;
+    queue->pImpl.split.count = count + 1;
+    splitLimits[index].fd = fd;
+  }
+
+  // 3. The size of the children is a multiple of the optimal size (if possible) and of the block size.
+  size_t maxSize = limits->maxTransferSize ? limits->maxTransferSize : SIZE_MAX;
+  if (maxSize != SIZE_MAX) {
+    const size_t optimalSize = limits->optimalTransferSize;
+    if (optimalSize && optimalSize <= maxSize)
+      maxSize -= maxSize % optimalSize;
+    maxSize = maxSize > blockSize ? maxSize & ~(blockSize - 1) : blockSize;
+  }
+
+  splitLimits[index].maxSize = maxSize;
+  splitLimits[index].maxIovecCount = limits->maxSegmentCount && limits->maxSegmentCount < IOV_MAX
+    ? limits->maxSegmentCount
+    : IOV_MAX;
+  return 0;
+}
+
+int xcp_io_req_cancel (XcpIoQueue *queue, XcpIoReq *req) {
+  // A split request is canceled with its children.
+  if (XCP_UNLIKELY(req->pImpl.split) && req->pImpl.split->parent == req)
+    return cancel_split(queue, req->pImpl.split);
+
+  // A merged request can only be canceled with the other requests of its group.
+  if (req->pImpl.group)
+    req = req->pImpl.group;
+
+  // 1. Inflight request: ask the kernel to abort it.
+  // The request is completed when the cancel response is received, see fetch_responses.
+  if (req->pImpl.cqeCount) {
+    struct io_uring *ring = &queue->pImpl.ring;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (XCP_UNLIKELY(!sqe))
+      return -EBUSY;
+
+    io_uring_prep_cancel(sqe, req, 0);
+    sqe->user_data = (uint64_t)req | CqeTagCancel;
+    req->pImpl.state |= ReqStateCanceled;
+    ++req->pImpl.cqeCount;
+
+    const int ret = submit_sqes(queue);
+    return ret < 0 ? ret : 0;
+  }
+
+  if (!(req->pImpl.state & ReqStatePending))
+    return -ENOENT;
+
+  // 2. Pending or throttled request: remove it and the rest of its chain.
+  size_t count = remove_chain(&STAILQ_FIRST(&queue->reqs), &queue->reqs.stqh_last, req);
+  for (size_t i = 0; !count && queue->pImpl.rateLimit.reqCount && i < queue->pImpl.rateLimit.count; ++i) {
+    XcpIoRateLimiter *limiter = queue->pImpl.rateLimit.limiters[i];
+    if ((count = remove_chain(&STAILQ_FIRST(&limiter->reqs), &limiter->reqs.stqh_last, req))) {
+      assert(queue->pImpl.rateLimit.reqCount >= count);
+      queue->pImpl.rateLimit.reqCount -= count;
+    }
+  }
+
+  // 3. Not found: the request is in the scheduler.
+  // A chain is scheduled as one request, so only its head can be removed.
+  if (!count) {
+    XcpIoScheduler *scheduler = queue->pImpl.sched.scheduler;
+    if (!scheduler || !scheduler->ops->remove(scheduler, req))
+      return -EBUSY;
+
+    XcpIoReq *cur = req;
+    for (; cur->pImpl.link; cur = cur->pImpl.link, ++count)
+      STAILQ_NEXT(cur, pImpl.next) = cur->pImpl.link;
+    STAILQ_NEXT(cur, pImpl.next) = NULL;
+    ++count;
+
+    assert(queue->pImpl.sched.reqCount >= count);
+    queue->pImpl.sched.reqCount -= count;
+  }
+
+  assert(queue->pendingCount >= count);
+  queue->pendingCount -= count;
+
+  cancel_requests(queue, req, -ECANCELED);
+  return 0;
+}
+
+int xcp_io_queue_set_batch_cb (XcpIoQueue *queue, XcpIoQueueBatchCb cb, void *userArg) {
+  assert(!queue->pImpl.batch.count);
+
+  if (cb && !queue->pImpl.batch.responses) {
+    // The completion ring can contain more responses than the queue capacity,
+    // in this case the callback is called several times.
+    const size_t size = queue->capacity;
+    if (!(queue->pImpl.batch.responses = malloc(size * sizeof *queue->pImpl.batch.responses)))
+      return -ENOMEM;
+    queue->pImpl.batch.size = size;
+  }
+
+  queue->pImpl.batch.cb = cb;
+  queue->pImpl.batch.userArg = userArg;
+  return 0;
+}
+
 int xcp_io_queue_process_responses (XcpIoQueue *queue) {
-  // Fetch responses directly if polling is used.
-  if (queue->usePolling)
+  if (xcp_io_queue_hybrid_polling_enabled(queue)) {
+    const int ret = wait_responses(queue);
+    return ret < 0 ? ret : (int)fetch_responses(queue);
+  }
+
+  // Fetch responses directly if polling is used or if there is no event fd.
+  if (queue->eventFd == -1)
     return (int)fetch_responses(queue);
 
   // Get current response count.
@@ -263,3 +1995,221 @@ int xcp_io_queue_process_responses (XcpIoQueue *queue) {
   // the ring counter can be updated by the kernel just after our previous read.
   return (int)fetch_responses(queue);
 }
+
+int xcp_io_queue_process (XcpIoQueue *queue) {
+  int ret;
+  if (xcp_io_queue_hybrid_polling_enabled(queue)) {
+    if ((ret = xcp_io_queue_submit(queue)) < 0 || (ret = xcp_io_queue_process_responses(queue)) < 0)
+      return ret;
+    return 0;
+  }
+
+  if (queue->eventFd == -1) {
+    ret = xcp_io_queue_submit_and_wait(queue, 1, NULL);
+    return ret < 0 ? ret : 0;
+  }
+
+  if ((ret = xcp_io_queue_submit(queue)) < 0)
+    return ret;
+
+  struct pollfd fds;
+  fds.events = POLLIN;
+  fds.fd = queue->eventFd;
+  fds.revents = 0;
+
+  do {
+    ret = poll(&fds, 1, -1);
+  } while (ret == -1 && errno == EINTR);
+  if (ret < 0)
+    return -errno;
+
+  ret = xcp_io_queue_process_responses(queue);
+  return ret < 0 ? ret : 0;
+}
+
+int xcp_io_queue_get_stats (const XcpIoQueue *queue, XcpIoQueueStats *stats) {
+  #ifdef XCP_IO_ENABLE_STATS
+    copy_stats(stats, queue->pImpl.stats.current, queue->pImpl.stats.baseline);
+    return 0;
+  #else
+    XCP_UNUSED(queue);
+    XCP_UNUSED(stats);
+    return -ENOTSUP;
+  #endif // ifdef XCP_IO_ENABLE_STATS
+}
+
+int xcp_io_queue_reset_stats (XcpIoQueue *queue) {
+  #ifdef XCP_IO_ENABLE_STATS
+    copy_stats(queue->pImpl.stats.baseline, queue->pImpl.stats.current, NULL);
+    return 0;
+  #else
+    XCP_UNUSED(queue);
+    return -ENOTSUP;
+  #endif // ifdef XCP_IO_ENABLE_STATS
+}
+
+// -----------------------------------------------------------------------------
+
+int xcp_io_queue_register_buffers (XcpIoQueue *queue, size_t size, size_t count) {
+  if (!size || !count || count > UINT16_MAX)
+    return -EINVAL;
+  if (queue->pImpl.buffers.arena)
+    return -EBUSY;
+
+  // 1. Allocate one arena for all buffers, each buffer is page aligned.
+  const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  const size_t stride = (size + pageSize - 1) & ~(pageSize - 1);
+  if (stride > SIZE_MAX / count)
+    return -ENOMEM;
+
+  const size_t arenaSize = stride * count;
+  void *arena = mmap(NULL, arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED)
+    return -errno;
+
+  uint16_t *freeIndexes = malloc(count * sizeof *freeIndexes);
+  struct iovec *iovecs = malloc(count * sizeof *iovecs);
+  if (!freeIndexes || !iovecs) {
+    free(freeIndexes);
+    free(iovecs);
+    munmap(arena, arenaSize);
+    return -ENOMEM;
+  }
+
+  // 2. Register one iovec per buffer, so bufIndex is the buffer index in the arena.
+  for (size_t i = 0; i < count; ++i) {
+    iovecs[i].iov_base = (char *)arena + i * stride;
+    iovecs[i].iov_len = size;
+
+    // Lowest indexes are given first.
+    freeIndexes[i] = (uint16_t)(count - i - 1);
+  }
+
+  const int err = io_uring_register_buffers(&queue->pImpl.ring, iovecs, (unsigned int)count);
+  free(iovecs);
+  if (err < 0) {
+    free(freeIndexes);
+    munmap(arena, arenaSize);
+    return err;
+  }
+
+  queue->pImpl.buffers.arena = arena;
+  queue->pImpl.buffers.arenaSize = arenaSize;
+  queue->pImpl.buffers.size = size;
+  queue->pImpl.buffers.stride = stride;
+  queue->pImpl.buffers.freeIndexes = freeIndexes;
+  queue->pImpl.buffers.freeCount = (uint16_t)count;
+  queue->pImpl.buffers.count = (uint16_t)count;
+
+  return 0;
+}
+
+void xcp_io_queue_unregister_buffers (XcpIoQueue *queue) {
+  if (!queue->pImpl.buffers.arena)
+    return;
+
+  io_uring_unregister_buffers(&queue->pImpl.ring);
+  free(queue->pImpl.buffers.freeIndexes);
+  munmap(queue->pImpl.buffers.arena, queue->pImpl.buffers.arenaSize);
+  memset(&queue->pImpl.buffers, 0, sizeof queue->pImpl.buffers);
+}
+
+void *xcp_io_queue_get_buffer (XcpIoQueue *queue, uint16_t *bufIndex) {
+  if (XCP_UNLIKELY(!queue->pImpl.buffers.freeCount))
+    return NULL;
+
+  const uint16_t index = queue->pImpl.buffers.freeIndexes[--queue->pImpl.buffers.freeCount];
+  *bufIndex = index;
+  return (char *)queue->pImpl.buffers.arena + index * queue->pImpl.buffers.stride;
+}
+
+void xcp_io_queue_put_buffer (XcpIoQueue *queue, uint16_t bufIndex) {
+  assert(bufIndex < queue->pImpl.buffers.count);
+  assert(queue->pImpl.buffers.freeCount < queue->pImpl.buffers.count);
+  queue->pImpl.buffers.freeIndexes[queue->pImpl.buffers.freeCount++] = bufIndex;
+}
+
+// -----------------------------------------------------------------------------
+
+int xcp_io_queue_register_file_table (XcpIoQueue *queue, unsigned int size) {
+  if (!size || size > INT_MAX)
+    return -EINVAL;
+  if (queue->pImpl.files.fds)
+    return -EBUSY;
+
+  int *fds = malloc(size * sizeof *fds);
+  unsigned int *freeIndexes = malloc(size * sizeof *freeIndexes);
+  if (!fds || !freeIndexes) {
+    free(fds);
+    free(freeIndexes);
+    return -ENOMEM;
+  }
+
+  for (unsigned int i = 0; i < size; ++i) {
+    fds[i] = -1;
+
+    // Lowest indexes are given first.
+    freeIndexes[i] = size - i - 1;
+  }
+
+  // Use a sparse table if possible, otherwise register a table of empty (-1) entries.
+  // The last method is supported by old kernels but requires a copy of the table.
+  struct io_uring *ring = &queue->pImpl.ring;
+  int err = io_uring_register_files_sparse(ring, size);
+  if (err == -EINVAL)
+    err = io_uring_register_files(ring, fds, size);
+  if (err < 0) {
+    free(fds);
+    free(freeIndexes);
+    return err;
+  }
+
+  queue->pImpl.files.fds = fds;
+  queue->pImpl.files.freeIndexes = freeIndexes;
+  queue->pImpl.files.freeCount = size;
+  queue->pImpl.files.size = size;
+
+  return 0;
+}
+
+void xcp_io_queue_unregister_file_table (XcpIoQueue *queue) {
+  if (!queue->pImpl.files.fds)
+    return;
+
+  io_uring_unregister_files(&queue->pImpl.ring);
+  free(queue->pImpl.files.fds);
+  free(queue->pImpl.files.freeIndexes);
+  memset(&queue->pImpl.files, 0, sizeof queue->pImpl.files);
+}
+
+int xcp_io_queue_register_file (XcpIoQueue *queue, int fd) {
+  if (fd < 0)
+    return -EBADF;
+  if (XCP_UNLIKELY(!queue->pImpl.files.freeCount))
+    return queue->pImpl.files.fds ? -ENFILE : -ENXIO;
+
+  const unsigned int index = queue->pImpl.files.freeIndexes[queue->pImpl.files.freeCount - 1];
+  const int ret = io_uring_register_files_update(&queue->pImpl.ring, index, &fd, 1);
+  if (ret < 0)
+    return ret;
+
+  --queue->pImpl.files.freeCount;
+  queue->pImpl.files.fds[index] = fd;
+  return (int)index;
+}
+
+int xcp_io_queue_unregister_file (XcpIoQueue *queue, int fileIndex) {
+  if (fileIndex < 0 || (unsigned int)fileIndex >= queue->pImpl.files.size)
+    return -EINVAL;
+  if (queue->pImpl.files.fds[fileIndex] == -1)
+    return -ENOENT;
+
+  int fd = -1;
+  const int ret = io_uring_register_files_update(&queue->pImpl.ring, (unsigned int)fileIndex, &fd, 1);
+  if (ret < 0)
+    return ret;
+
+  queue->pImpl.files.fds[fileIndex] = -1;
+  queue->pImpl.files.freeIndexes[queue->pImpl.files.freeCount++] = (unsigned int)fileIndex;
+  return 0;
+}
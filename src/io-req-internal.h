@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_ASYNC_IO_IO_REQ_INTERNAL_H_
+#define _XCP_NG_ASYNC_IO_IO_REQ_INTERNAL_H_
+
+#include "xcp-ng/async-io/io-queue.h"
+#include "xcp-ng/async-io/io-req.h"
+#include "xcp-ng/async-io/io-zero.h"
+
+// =============================================================================
+
+// Compute the buffer results read by the completion callback: the hash (see xcp_io_req_set_checksum) and the
+// zero check (see xcp_io_req_set_zero_check). Must be called by every completion path before the callback:
+// the queue, and the modules completing requests without the queue (cache, write combiner).
+static inline void xcp_io_req_process_buffer (XcpIoReq *req, int err) {
+  if (req->checksum && !err)
+    req->pImpl.hash = xcp_io_checksum_compute((XcpIoChecksum)req->checksum, req->iov.iov_base, req->iov.iov_len);
+  if (req->zeroCheck)
+    req->pImpl.isZero = !err && xcp_io_is_zero_buffer(req->iov.iov_base, req->iov.iov_len);
+}
+
+// Insert a request in a queue. If the insertion fails, the request is completed with the error: used by the
+// modules reporting all their errors with the completion callbacks. The queue must not have a batch callback.
+static inline void xcp_io_queue_insert_or_complete (XcpIoQueue *queue, XcpIoReq *req) {
+  const int ret = xcp_io_queue_insert(queue, req);
+  if (XCP_UNLIKELY(ret < 0)) {
+    req->pImpl.res = ret;
+    xcp_io_req_process_buffer(req, ret);
+    if (req->cb)
+      req->cb(req, ret, req->userData);
+  }
+}
+
+#endif // ifndef _XCP_NG_ASYNC_IO_IO_REQ_INTERNAL_H_
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "xcp-ng/async-io/io-req-pool.h"
+
+// =============================================================================
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static inline size_t align_up (size_t value, size_t alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static inline uint64_t make_free_head (uint64_t oldHead, uint32_t index) {
+  return ((oldHead >> 32) + 1) << 32 | index;
+}
+
+// Allocate a prefaulted arena, with huge pages if requested.
+static void *alloc_arena (size_t *size, bool useHugePages) {
+  void *arena;
+  if (useHugePages) {
+    const size_t hugeSize = align_up(*size, HUGE_PAGE_SIZE);
+    arena = mmap(
+      NULL, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0
+    );
+    if (arena != MAP_FAILED) {
+      *size = hugeSize;
+      return arena;
+    }
+
+    // No reserved huge pages, fallback to transparent huge pages.
+    *size = hugeSize;
+    arena = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED)
+      return NULL;
+    madvise(arena, *size, MADV_HUGEPAGE);
+    memset(arena, 0, *size);
+    return arena;
+  }
+
+  arena = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  return arena == MAP_FAILED ? NULL : arena;
+}
+
+// -----------------------------------------------------------------------------
+
+int xcp_io_req_pool_init (XcpIoReqPool *pool, size_t count, size_t dataSize, unsigned int flags) {
+  memset(pool, 0, sizeof *pool);
+  if (!count || count >= UINT32_MAX)
+    return -EINVAL;
+
+  // 1. Compute layout: [request headers][free list][data slots].
+  const size_t reqStride = align_up(sizeof(XcpIoReq), XCP_IO_REQ_POOL_REQ_ALIGNMENT);
+  const size_t dataStride = align_up(dataSize, XCP_IO_REQ_POOL_DATA_ALIGNMENT);
+  if (count > (SIZE_MAX / 2) / (reqStride + dataStride + sizeof(uint32_t)))
+    return -ENOMEM;
+
+  const size_t nextFreeOffset = count * reqStride;
+  const size_t dataOffset = align_up(nextFreeOffset + count * sizeof(uint32_t), XCP_IO_REQ_POOL_DATA_ALIGNMENT);
+  size_t arenaSize = dataOffset + count * dataStride;
+
+  // 2. Allocate.
+  char *arena = alloc_arena(&arenaSize, flags & XcpIoReqPoolFlagHugePages);
+  if (!arena)
+    return -ENOMEM;
+
+  pool->count = count;
+  pool->dataSize = dataSize;
+  pool->pImpl.arena = arena;
+  pool->pImpl.arenaSize = arenaSize;
+  pool->pImpl.reqs = arena;
+  pool->pImpl.reqStride = reqStride;
+  pool->pImpl.data = dataSize ? arena + dataOffset : NULL;
+  pool->pImpl.dataStride = dataStride;
+  pool->pImpl.nextFree = (_Atomic uint32_t *)(arena + nextFreeOffset);
+
+  // 3. Build free list, lowest indexes are given first.
+  for (size_t i = 0; i < count; ++i)
+    atomic_init(&pool->pImpl.nextFree[i], i + 1 < count ? (uint32_t)(i + 2) : 0);
+  atomic_init(&pool->pImpl.freeHead, 1);
+
+  return 0;
+}
+
+void xcp_io_req_pool_uninit (XcpIoReqPool *pool) {
+  if (!pool->pImpl.arena)
+    return;
+
+  munmap(pool->pImpl.arena, pool->pImpl.arenaSize);
+  memset(pool, 0, sizeof *pool);
+}
+
+XcpIoReq *xcp_io_req_pool_get (XcpIoReqPool *pool) {
+  uint64_t head = atomic_load_explicit(&pool->pImpl.freeHead, memory_order_acquire);
+  uint32_t index;
+  do {
+    if (XCP_UNLIKELY(!(index = (uint32_t)head)))
+      return NULL;
+
+    // Note: next can be outdated if another thread takes this request, in this case
+    // the tag of the head is changed and the CAS fails.
+    const uint32_t next = atomic_load_explicit(&pool->pImpl.nextFree[index - 1], memory_order_relaxed);
+    if (atomic_compare_exchange_weak_explicit(
+      &pool->pImpl.freeHead, &head, make_free_head(head, next), memory_order_acquire, memory_order_acquire
+    ))
+      break;
+  } while (true);
+
+  return (XcpIoReq *)(pool->pImpl.reqs + (index - 1) * pool->pImpl.reqStride);
+}
+
+void xcp_io_req_pool_put (XcpIoReqPool *pool, XcpIoReq *req) {
+  const uint32_t index = (uint32_t)xcp_io_req_pool_get_index(pool, req) + 1;
+
+  uint64_t head = atomic_load_explicit(&pool->pImpl.freeHead, memory_order_relaxed);
+  do {
+    atomic_store_explicit(&pool->pImpl.nextFree[index - 1], (uint32_t)head, memory_order_relaxed);
+  } while (!atomic_compare_exchange_weak_explicit(
+    &pool->pImpl.freeHead, &head, make_free_head(head, index), memory_order_release, memory_order_relaxed
+  ));
+}
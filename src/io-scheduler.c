@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xcp-ng/async-io/io-scheduler.h"
+
+// =============================================================================
+
+// Min cost of a request: the fixed cost of an I/O is not negligible compared to small transfers.
+#define WFQ_MIN_COST 4096
+
+#define WFQ_NOT_IN_HEAP UINT32_MAX
+
+typedef struct XcpIoWfqFlow {
+  STAILQ_HEAD(, XcpIoReq) reqs;
+  uint64_t lastFinishTag;
+  unsigned int weight;
+  unsigned int heapIndex;
+} XcpIoWfqFlow;
+
+// -----------------------------------------------------------------------------
+
+static inline unsigned int get_flow_index (const XcpIoWfqScheduler *scheduler, uint32_t key) {
+  // Fibonacci hashing, fds and tenants are usually small consecutive integers.
+  return (unsigned int)((key * 2654435761u) >> 16) & (scheduler->pImpl.flowCount - 1);
+}
+
+static inline unsigned int get_req_flow_index (const XcpIoWfqScheduler *scheduler, const XcpIoReq *req) {
+  return get_flow_index(scheduler, xcp_io_req_get_key(req));
+}
+
+// Real-time: 0, best effort (and none): 1, idle: 2.
+static inline unsigned int get_class_rank (const XcpIoReq *req) {
+  switch (xcp_io_req_get_priority_class(req)) {
+    case XcpIoPrioClassRealTime: return 0;
+    case XcpIoPrioClassIdle: return 2;
+    default: return 1;
+  }
+}
+
+static inline uint64_t get_cost (const XcpIoReq *req) {
+  size_t size = 0;
+  if (xcp_io_opcode_has_data(req->opcode)) {
+    for (const XcpIoReq *cur = req; cur; cur = cur->pImpl.link)
+      size += xcp_io_req_get_size(cur);
+  }
+  if (size < WFQ_MIN_COST)
+    size = WFQ_MIN_COST;
+
+  // A lower priority level costs more.
+  const unsigned int level = req->ioprio & ((1u << XCP_IO_PRIO_CLASS_SHIFT) - 1);
+  return (uint64_t)size * (level + 1);
+}
+
+// -----------------------------------------------------------------------------
+
+static inline bool flow_less (const XcpIoWfqScheduler *scheduler, unsigned int a, unsigned int b) {
+  const XcpIoReq *reqA = STAILQ_FIRST(&scheduler->pImpl.flows[a].reqs);
+  const XcpIoReq *reqB = STAILQ_FIRST(&scheduler->pImpl.flows[b].reqs);
+
+  const unsigned int rankA = get_class_rank(reqA);
+  const unsigned int rankB = get_class_rank(reqB);
+  if (rankA != rankB)
+    return rankA < rankB;
+
+  // Compare tags with a difference to support the wrap around.
+  return (int64_t)(reqA->pImpl.schedTag - reqB->pImpl.schedTag) < 0;
+}
+
+static inline void heap_set (XcpIoWfqScheduler *scheduler, unsigned int index, unsigned int flowIndex) {
+  scheduler->pImpl.heap[index] = flowIndex;
+  scheduler->pImpl.flows[flowIndex].heapIndex = index;
+}
+
+static void heap_sift_up (XcpIoWfqScheduler *scheduler, unsigned int index) {
+  const unsigned int flowIndex = scheduler->pImpl.heap[index];
+  while (index) {
+    const unsigned int parent = (index - 1) / 2;
+    if (!flow_less(scheduler, flowIndex, scheduler->pImpl.heap[parent]))
+      break;
+    heap_set(scheduler, index, scheduler->pImpl.heap[parent]);
+    index = parent;
+  }
+  heap_set(scheduler, index, flowIndex);
+}
+
+static void heap_sift_down (XcpIoWfqScheduler *scheduler, unsigned int index) {
+  const unsigned int flowIndex = scheduler->pImpl.heap[index];
+  const unsigned int size = scheduler->pImpl.heapSize;
+  for (;;) {
+    unsigned int child = 2 * index + 1;
+    if (child >= size)
+      break;
+    if (child + 1 < size && flow_less(scheduler, scheduler->pImpl.heap[child + 1], scheduler->pImpl.heap[child]))
+      ++child;
+    if (!flow_less(scheduler, scheduler->pImpl.heap[child], flowIndex))
+      break;
+    heap_set(scheduler, index, scheduler->pImpl.heap[child]);
+    index = child;
+  }
+  heap_set(scheduler, index, flowIndex);
+}
+
+static void heap_remove (XcpIoWfqScheduler *scheduler, unsigned int flowIndex) {
+  const unsigned int index = scheduler->pImpl.flows[flowIndex].heapIndex;
+  scheduler->pImpl.flows[flowIndex].heapIndex = WFQ_NOT_IN_HEAP;
+
+  const unsigned int last = --scheduler->pImpl.heapSize;
+  if (index == last)
+    return;
+
+  // Move the last flow in the hole and restore the heap order.
+  const unsigned int movedFlowIndex = scheduler->pImpl.heap[last];
+  heap_set(scheduler, index, movedFlowIndex);
+  heap_sift_up(scheduler, index);
+  heap_sift_down(scheduler, scheduler->pImpl.flows[movedFlowIndex].heapIndex);
+}
+
+// Update the heap after a change of the first request of a flow.
+static void update_flow (XcpIoWfqScheduler *scheduler, unsigned int flowIndex) {
+  XcpIoWfqFlow *flow = &scheduler->pImpl.flows[flowIndex];
+  if (STAILQ_EMPTY(&flow->reqs)) {
+    if (flow->heapIndex != WFQ_NOT_IN_HEAP)
+      heap_remove(scheduler, flowIndex);
+    return;
+  }
+
+  if (flow->heapIndex == WFQ_NOT_IN_HEAP) {
+    const unsigned int index = scheduler->pImpl.heapSize++;
+    heap_set(scheduler, index, flowIndex);
+    heap_sift_up(scheduler, index);
+    return;
+  }
+
+  heap_sift_up(scheduler, flow->heapIndex);
+  heap_sift_down(scheduler, flow->heapIndex);
+}
+
+// -----------------------------------------------------------------------------
+
+static void wfq_enqueue (XcpIoScheduler *base, XcpIoReq *req) {
+  XcpIoWfqScheduler *scheduler = (XcpIoWfqScheduler *)base;
+  const unsigned int flowIndex = get_req_flow_index(scheduler, req);
+  XcpIoWfqFlow *flow = &scheduler->pImpl.flows[flowIndex];
+
+  // Start tag: a flow can't accumulate credit while it is idle.
+  uint64_t startTag = flow->lastFinishTag;
+  if ((int64_t)(startTag - scheduler->pImpl.virtualTime) < 0)
+    startTag = scheduler->pImpl.virtualTime;
+
+  req->pImpl.schedTag = startTag;
+  flow->lastFinishTag = startTag + get_cost(req) * XCP_IO_WFQ_DEFAULT_WEIGHT / flow->weight;
+
+  const bool wasEmpty = STAILQ_EMPTY(&flow->reqs);
+  STAILQ_INSERT_TAIL(&flow->reqs, req, pImpl.next);
+  if (wasEmpty)
+    update_flow(scheduler, flowIndex);
+}
+
+static XcpIoReq *wfq_dequeue (XcpIoScheduler *base) {
+  XcpIoWfqScheduler *scheduler = (XcpIoWfqScheduler *)base;
+  if (!scheduler->pImpl.heapSize)
+    return NULL;
+
+  const unsigned int flowIndex = scheduler->pImpl.heap[0];
+  XcpIoWfqFlow *flow = &scheduler->pImpl.flows[flowIndex];
+
+  XcpIoReq *req = STAILQ_FIRST(&flow->reqs);
+  STAILQ_REMOVE_HEAD(&flow->reqs, pImpl.next);
+  update_flow(scheduler, flowIndex);
+
+  if ((int64_t)(req->pImpl.schedTag - scheduler->pImpl.virtualTime) > 0)
+    scheduler->pImpl.virtualTime = req->pImpl.schedTag;
+
+  return req;
+}
+
+static bool wfq_remove (XcpIoScheduler *base, XcpIoReq *req) {
+  XcpIoWfqScheduler *scheduler = (XcpIoWfqScheduler *)base;
+  const unsigned int flowIndex = get_req_flow_index(scheduler, req);
+  XcpIoWfqFlow *flow = &scheduler->pImpl.flows[flowIndex];
+
+  XcpIoReq *cur;
+  STAILQ_FOREACH(cur, &flow->reqs, pImpl.next) {
+    if (cur == req)
+      break;
+  }
+  if (!cur)
+    return false;
+
+  const bool isFirst = STAILQ_FIRST(&flow->reqs) == req;
+  STAILQ_REMOVE(&flow->reqs, req, XcpIoReq, pImpl.next);
+  if (isFirst)
+    update_flow(scheduler, flowIndex);
+  return true;
+}
+
+static const XcpIoSchedulerOps WfqOps = {
+  wfq_enqueue,
+  wfq_dequeue,
+  wfq_remove
+};
+
+// -----------------------------------------------------------------------------
+
+int xcp_io_wfq_scheduler_init (XcpIoWfqScheduler *scheduler, unsigned int flowCount) {
+  memset(scheduler, 0, sizeof *scheduler);
+  if (!flowCount || flowCount > (1u << 16))
+    return -EINVAL;
+
+  unsigned int count = 1;
+  while (count < flowCount)
+    count <<= 1;
+
+  XcpIoWfqFlow *flows = malloc(count * sizeof *flows);
+  unsigned int *heap = malloc(count * sizeof *heap);
+  if (!flows || !heap) {
+    free(flows);
+    free(heap);
+    return -ENOMEM;
+  }
+
+  for (unsigned int i = 0; i < count; ++i) {
+    STAILQ_INIT(&flows[i].reqs);
+    flows[i].lastFinishTag = 0;
+    flows[i].weight = XCP_IO_WFQ_DEFAULT_WEIGHT;
+    flows[i].heapIndex = WFQ_NOT_IN_HEAP;
+  }
+
+  scheduler->base.ops = &WfqOps;
+  scheduler->pImpl.flows = flows;
+  scheduler->pImpl.flowCount = count;
+  scheduler->pImpl.heap = heap;
+
+  return 0;
+}
+
+void xcp_io_wfq_scheduler_uninit (XcpIoWfqScheduler *scheduler) {
+  free(scheduler->pImpl.flows);
+  free(scheduler->pImpl.heap);
+  memset(scheduler, 0, sizeof *scheduler);
+}
+
+void xcp_io_wfq_scheduler_set_weight (XcpIoWfqScheduler *scheduler, uint32_t key, unsigned int weight) {
+  assert(weight);
+  scheduler->pImpl.flows[get_flow_index(scheduler, key)].weight = weight;
+}
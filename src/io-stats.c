@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "xcp-ng/async-io/io-stats.h"
+
+// =============================================================================
+
+#define SUB_BUCKET_COUNT (1u << XCP_IO_HISTOGRAM_SUB_BUCKET_BITS)
+
+uint64_t xcp_io_histogram_get_bucket_max (unsigned int index) {
+  assert(index < XCP_IO_HISTOGRAM_BUCKET_COUNT);
+  if (index < 2 * SUB_BUCKET_COUNT)
+    return index;
+
+  // Inverse of xcp_io_histogram_get_bucket_index: the bucket contains 2^shift values.
+  const unsigned int shift = (index >> XCP_IO_HISTOGRAM_SUB_BUCKET_BITS) - 1;
+  const uint64_t min = (uint64_t)((index & (SUB_BUCKET_COUNT - 1)) | SUB_BUCKET_COUNT) << shift;
+  return min + (UINT64_C(1) << shift) - 1;
+}
+
+uint64_t xcp_io_histogram_get_percentile (const XcpIoHistogram *histogram, double percentile) {
+  if (!histogram->count)
+    return 0;
+
+  // Nearest rank: ceil(percentile * count / 100), in [1, count].
+  const double exactRank = percentile / 100.0 * (double)histogram->count;
+  uint64_t rank = exactRank > 0.0 ? (uint64_t)exactRank : 0;
+  if ((double)rank < exactRank)
+    ++rank;
+  if (rank < 1)
+    rank = 1;
+  else if (rank > histogram->count)
+    rank = histogram->count;
+
+  uint64_t count = 0;
+  for (unsigned int i = 0; i < XCP_IO_HISTOGRAM_BUCKET_COUNT; ++i) {
+    if ((count += histogram->buckets[i]) >= rank)
+      return xcp_io_histogram_get_bucket_max(i);
+  }
+
+  // The count is not consistent with the buckets (histogram read during an update).
+  return xcp_io_histogram_get_bucket_max(XCP_IO_HISTOGRAM_BUCKET_COUNT - 1);
+}
+
+void xcp_io_histogram_reset (XcpIoHistogram *histogram) {
+  memset(histogram, 0, sizeof *histogram);
+}
+
+void xcp_io_histogram_merge (XcpIoHistogram *dst, const XcpIoHistogram *src) {
+  dst->count += src->count;
+  dst->sum += src->sum;
+  for (unsigned int i = 0; i < XCP_IO_HISTOGRAM_BUCKET_COUNT; ++i)
+    dst->buckets[i] += src->buckets[i];
+}
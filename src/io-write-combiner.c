@@ -0,0 +1,880 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "xcp-ng/async-io/io-req-pool.h"
+#include "xcp-ng/async-io/io-write-combiner.h"
+#include "io-req-internal.h"
+
+// =============================================================================
+
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+#define MIN_SECTOR_SIZE 512
+
+// Max number of iovecs of a flush write.
+#define MAX_FLUSH_IOV_COUNT IOV_MAX
+
+#define STAGED_OPCODES (XcpIoOpcodeWrite | XcpIoOpcodeWriteV | XcpIoOpcodeWriteFixed)
+
+typedef enum {
+  ExtentStateFree,
+  ExtentStateIdle,
+  ExtentStateFilling, // Partial sectors of a write are being read.
+  ExtentStateFlushing
+} ExtentState;
+
+typedef struct XcpIoWriteCombinerExtent XcpIoWriteCombinerExtent;
+
+struct XcpIoWriteCombinerExtent {
+  TAILQ_ENTRY(XcpIoWriteCombinerExtent) next; // Position in the free list or in the dirty list.
+  XcpIoWriteCombinerExtent *hashNext;
+  XcpIoWriteCombiner *combiner;
+
+  uint64_t index; // Offset in the file divided by the extent size.
+  uint8_t state;
+  bool dirty; // In the dirty list: idle with dirty sectors.
+  uint64_t dirtyTime; // Time of the first staged write since the last flush, in nanoseconds.
+
+  char *data;
+  uint64_t *validBits; // Sectors containing the data of the file.
+  uint64_t *dirtyBits; // Sectors to write.
+
+  // Number of reads or writes of the extent in the queue.
+  unsigned int pendingCount;
+
+  // Reads of the first and last sectors of a partial write, and the write waiting for them.
+  XcpIoReq fillReqs[2];
+  XcpIoReq *fillWaiter;
+  int fillError;
+};
+
+// Flush write, the iovecs point to the data of the extents.
+typedef struct XcpIoWriteCombinerFlush {
+  XcpIoReq req;
+  XcpIoWriteCombiner *combiner;
+  struct iovec iovs[];
+} XcpIoWriteCombinerFlush;
+
+// Callback and user data of a write given to the queue, replaced to track it until its completion.
+typedef struct XcpIoWriteCombinerWrite {
+  TAILQ_ENTRY(XcpIoWriteCombinerWrite) next;
+  XcpIoWriteCombiner *combiner;
+  XcpIoReqCb cb;
+  void *userData;
+  uint64_t offset;
+  uint64_t end;
+} XcpIoWriteCombinerWrite;
+
+static void process_blocked (XcpIoWriteCombiner *combiner);
+
+// -----------------------------------------------------------------------------
+
+static inline uint64_t get_monotonic_time (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static int get_file_size (int fd, uint64_t *size) {
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return -errno;
+
+  if (S_ISBLK(st.st_mode))
+    return ioctl(fd, BLKGETSIZE64, size) < 0 ? -errno : 0;
+
+  *size = (uint64_t)st.st_size;
+  return 0;
+}
+
+// Complete a request without the queue, like the queue does.
+static inline void complete_req (XcpIoReq *req, int err) {
+  req->pImpl.res = err ? err : xcp_io_opcode_has_data(req->opcode) ? (int)xcp_io_req_get_size(req) : 0;
+  xcp_io_req_process_buffer(req, err);
+
+  if (XCP_LIKELY(req->cb))
+    req->cb(req, err, req->userData);
+}
+
+// -----------------------------------------------------------------------------
+
+// Set or clear the bits of [first, end[.
+static void set_bits (uint64_t *bitmap, size_t first, size_t end, bool value) {
+  while (first < end) {
+    const size_t shift = first % 64;
+    const size_t count = end - first < 64 - shift ? end - first : 64 - shift;
+    const uint64_t mask = (count == 64 ? UINT64_MAX : (UINT64_C(1) << count) - 1) << shift;
+    if (value)
+      bitmap[first / 64] |= mask;
+    else
+      bitmap[first / 64] &= ~mask;
+    first += count;
+  }
+}
+
+static inline bool test_bit (const uint64_t *bitmap, size_t bit) {
+  return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+// Returns the first bit of [first, end[ equal to value, or end.
+static size_t find_bit (const uint64_t *bitmap, size_t first, size_t end, bool value) {
+  while (first < end) {
+    const size_t shift = first % 64;
+    const uint64_t word = (value ? bitmap[first / 64] : ~bitmap[first / 64]) >> shift;
+    if (word) {
+      const size_t bit = first + (size_t)__builtin_ctzll(word);
+      return bit < end ? bit : end;
+    }
+    first += 64 - shift;
+  }
+  return end;
+}
+
+// -----------------------------------------------------------------------------
+
+static inline size_t get_sector_count (const XcpIoWriteCombiner *combiner) {
+  return combiner->extentSize / combiner->sectorSize;
+}
+
+static inline bool has_dirty_sectors (const XcpIoWriteCombiner *combiner, const XcpIoWriteCombinerExtent *extent) {
+  const size_t sectorCount = get_sector_count(combiner);
+  return find_bit(extent->dirtyBits, 0, sectorCount, true) < sectorCount;
+}
+
+static inline size_t hash_index (const XcpIoWriteCombiner *combiner, uint64_t index) {
+  uint64_t hash = index * UINT64_C(0x9e3779b97f4a7c15);
+  return (size_t)(hash ^ (hash >> 29)) & combiner->pImpl.bucketMask;
+}
+
+static inline XcpIoWriteCombinerExtent *find_extent (const XcpIoWriteCombiner *combiner, uint64_t index) {
+  XcpIoWriteCombinerExtent *extent = combiner->pImpl.buckets[hash_index(combiner, index)];
+  while (extent && extent->index != index)
+    extent = extent->hashNext;
+  return extent;
+}
+
+static XcpIoWriteCombinerExtent *alloc_extent (XcpIoWriteCombiner *combiner, uint64_t index) {
+  XcpIoWriteCombinerExtent *extent = TAILQ_FIRST(&combiner->pImpl.freeExtents);
+  assert(extent);
+  TAILQ_REMOVE(&combiner->pImpl.freeExtents, extent, next);
+  ++combiner->pImpl.usedCount;
+
+  XcpIoWriteCombinerExtent **bucket = &combiner->pImpl.buckets[hash_index(combiner, index)];
+  extent->hashNext = *bucket;
+  *bucket = extent;
+
+  const size_t wordCount = (get_sector_count(combiner) + 63) / 64;
+  memset(extent->validBits, 0, wordCount * sizeof *extent->validBits);
+  memset(extent->dirtyBits, 0, wordCount * sizeof *extent->dirtyBits);
+
+  extent->index = index;
+  extent->state = ExtentStateIdle;
+  extent->dirty = false;
+  extent->fillWaiter = NULL;
+  extent->fillError = 0;
+  return extent;
+}
+
+static void release_extent (XcpIoWriteCombiner *combiner, XcpIoWriteCombinerExtent *extent) {
+  assert(extent->state == ExtentStateIdle && !extent->dirty && !extent->pendingCount);
+
+  XcpIoWriteCombinerExtent **it = &combiner->pImpl.buckets[hash_index(combiner, extent->index)];
+  while (*it != extent)
+    it = &(*it)->hashNext;
+  *it = extent->hashNext;
+
+  extent->state = ExtentStateFree;
+  TAILQ_INSERT_TAIL(&combiner->pImpl.freeExtents, extent, next);
+  --combiner->pImpl.usedCount;
+}
+
+// Only the idle extents can be modified or flushed: the dirty ones are in the dirty list.
+static inline void set_busy (XcpIoWriteCombiner *combiner, XcpIoWriteCombinerExtent *extent, ExtentState state) {
+  if (extent->dirty) {
+    TAILQ_REMOVE(&combiner->pImpl.dirtyExtents, extent, next);
+    extent->dirty = false;
+  }
+  extent->state = (uint8_t)state;
+}
+
+static inline void set_idle (XcpIoWriteCombiner *combiner, XcpIoWriteCombinerExtent *extent) {
+  extent->state = ExtentStateIdle;
+  if (has_dirty_sectors(combiner, extent)) {
+    extent->dirty = true;
+    TAILQ_INSERT_TAIL(&combiner->pImpl.dirtyExtents, extent, next);
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+static void finish_flush (XcpIoWriteCombiner *combiner, XcpIoWriteCombinerExtent *extent) {
+  // Without memory for a flush write, the sectors are still dirty.
+  set_idle(combiner, extent);
+  if (!extent->dirty)
+    release_extent(combiner, extent);
+}
+
+static void flush_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XcpIoWriteCombinerFlush *flush = userArg;
+  XcpIoWriteCombiner *combiner = flush->combiner;
+
+  // Like the page cache: the data is dropped and the error is reported by the next sync.
+  if (err && !combiner->pImpl.flushError)
+    combiner->pImpl.flushError = err;
+
+  const size_t extentSize = combiner->extentSize;
+  const size_t sectorSize = combiner->sectorSize;
+  const uint64_t offset = (uint64_t)req->offset;
+  const uint64_t end = offset + xcp_io_req_get_size(req);
+  for (uint64_t index = offset / extentSize; index <= (end - 1) / extentSize; ++index) {
+    XcpIoWriteCombinerExtent *extent = find_extent(combiner, index);
+    const uint64_t base = index * extentSize;
+    const size_t first = (size_t)((offset > base ? offset - base : 0) / sectorSize);
+    const uint64_t extentEnd = end < base + extentSize ? end : base + extentSize;
+    const size_t last = (size_t)((extentEnd - base + sectorSize - 1) / sectorSize);
+    set_bits(extent->dirtyBits, first, last, false);
+    if (!--extent->pendingCount)
+      finish_flush(combiner, extent);
+  }
+
+  free(flush);
+  process_blocked(combiner);
+}
+
+static void submit_flush (XcpIoWriteCombiner *combiner, uint64_t offset, uint64_t size, size_t iovCount) {
+  XcpIoWriteCombinerFlush *flush = malloc(sizeof *flush + iovCount * sizeof *flush->iovs);
+  if (!flush)
+    return;
+
+  flush->combiner = combiner;
+  memcpy(flush->iovs, combiner->pImpl.iovs, iovCount * sizeof *flush->iovs);
+
+  XcpIoReq *req = &flush->req;
+  if (iovCount == 1)
+    xcp_io_req_prep_rw(
+      req, XcpIoOpcodeWrite, combiner->fd, flush->iovs[0].iov_base, flush->iovs[0].iov_len, (off_t)offset
+    );
+  else
+    xcp_io_req_prep_rw(req, XcpIoOpcodeWriteV, combiner->fd, flush->iovs, iovCount, (off_t)offset);
+  xcp_io_req_set_cb(req, flush_completion_cb);
+  xcp_io_req_set_user_data(req, flush);
+
+  const size_t extentSize = combiner->extentSize;
+  for (uint64_t index = offset / extentSize; index <= (offset + size - 1) / extentSize; ++index)
+    ++find_extent(combiner, index)->pendingCount;
+
+  ++combiner->counters.flushes;
+  combiner->counters.flushedBytes += size;
+  xcp_io_queue_insert_or_complete(combiner->queue, req);
+}
+
+static int compare_extents (const void *a, const void *b) {
+  const uint64_t indexA = (*(XcpIoWriteCombinerExtent *const *)a)->index;
+  const uint64_t indexB = (*(XcpIoWriteCombinerExtent *const *)b)->index;
+  return indexA < indexB ? -1 : indexA > indexB;
+}
+
+// Write the dirty sectors of idle extents: contiguous runs are merged in one write, even across extents.
+static void flush_extents (XcpIoWriteCombiner *combiner, XcpIoWriteCombinerExtent **extents, size_t count) {
+  if (count > 1)
+    qsort(extents, count, sizeof *extents, compare_extents);
+
+  // The extents are kept busy while the writes are prepared.
+  for (size_t i = 0; i < count; ++i) {
+    set_busy(combiner, extents[i], ExtentStateFlushing);
+    ++extents[i]->pendingCount;
+  }
+
+  const size_t sectorCount = get_sector_count(combiner);
+  const size_t sectorSize = combiner->sectorSize;
+  struct iovec *iovs = combiner->pImpl.iovs;
+  size_t iovCount = 0;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    XcpIoWriteCombinerExtent *extent = extents[i];
+    const uint64_t base = extent->index * combiner->extentSize;
+
+    size_t sector = 0;
+    while ((sector = find_bit(extent->dirtyBits, sector, sectorCount, true)) < sectorCount) {
+      const size_t end = find_bit(extent->dirtyBits, sector, sectorCount, false);
+      const uint64_t runOffset = base + sector * sectorSize;
+      char *runData = extent->data + sector * sectorSize;
+      size_t runSize = (end - sector) * sectorSize;
+      if (!combiner->directIo && runOffset + runSize > combiner->pImpl.fileSize)
+        runSize = (size_t)(combiner->pImpl.fileSize - runOffset);
+      sector = end;
+
+      if (iovCount && offset + size == runOffset && size + runSize <= combiner->maxFlushSize) {
+        struct iovec *last = &iovs[iovCount - 1];
+        if ((char *)last->iov_base + last->iov_len == runData) {
+          last->iov_len += runSize;
+          size += runSize;
+          continue;
+        }
+        if (iovCount < MAX_FLUSH_IOV_COUNT) {
+          iovs[iovCount++] = (struct iovec){ .iov_base = runData, .iov_len = runSize };
+          size += runSize;
+          continue;
+        }
+      }
+
+      if (iovCount)
+        submit_flush(combiner, offset, size, iovCount);
+      iovs[0] = (struct iovec){ .iov_base = runData, .iov_len = runSize };
+      iovCount = 1;
+      offset = runOffset;
+      size = runSize;
+    }
+  }
+
+  if (iovCount)
+    submit_flush(combiner, offset, size, iovCount);
+
+  for (size_t i = 0; i < count; ++i) {
+    if (!--extents[i]->pendingCount)
+      finish_flush(combiner, extents[i]);
+  }
+}
+
+static void flush_oldest (XcpIoWriteCombiner *combiner) {
+  XcpIoWriteCombinerExtent *extent = TAILQ_FIRST(&combiner->pImpl.dirtyExtents);
+  if (extent)
+    flush_extents(combiner, &extent, 1);
+}
+
+// Flush the dirty extents of [offset, end[ and release the clean ones.
+// Returns true if no extent overlaps the range.
+static bool settle_range (XcpIoWriteCombiner *combiner, uint64_t offset, uint64_t end) {
+  if (!combiner->pImpl.usedCount)
+    return true;
+
+  const size_t extentSize = combiner->extentSize;
+  XcpIoWriteCombinerExtent **batch = combiner->pImpl.batch;
+  size_t count = 0;
+  bool busy = false;
+
+  for (size_t i = 0; i < combiner->pImpl.extentCount; ++i) {
+    XcpIoWriteCombinerExtent *extent = &combiner->pImpl.extents[i];
+    if (
+      extent->state == ExtentStateFree ||
+      (extent->index + 1) * extentSize <= offset || extent->index * extentSize >= end
+    )
+      continue;
+
+    if (extent->state != ExtentStateIdle)
+      busy = true;
+    else if (extent->dirty)
+      batch[count++] = extent;
+    else
+      release_extent(combiner, extent);
+  }
+
+  if (count)
+    flush_extents(combiner, batch, count);
+  return !busy && !count;
+}
+
+// -----------------------------------------------------------------------------
+
+static void fill_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XcpIoWriteCombinerExtent *extent = userArg;
+  XcpIoWriteCombiner *combiner = extent->combiner;
+  const size_t sectorSize = combiner->sectorSize;
+  const uint64_t offset = (uint64_t)req->offset;
+
+  // The queue fails a read which reaches the end of the file (the last result is 0): the sector
+  // is zeroed before the read, so the part after the end is valid.
+  if (err == -EIO && xcp_io_req_get_result(req) >= 0)
+    err = 0;
+
+  if (err) {
+    if (!extent->fillError)
+      extent->fillError = err;
+  } else {
+    const size_t sector = (size_t)(offset - extent->index * combiner->extentSize) / sectorSize;
+    set_bits(extent->validBits, sector, sector + 1, true);
+  }
+
+  if (!--extent->pendingCount)
+    set_idle(combiner, extent);
+  process_blocked(combiner);
+}
+
+// Read a sector partially covered by a write if it's not valid. Returns true if a read is started.
+static bool fill_sector (XcpIoWriteCombiner *combiner, XcpIoWriteCombinerExtent *extent, size_t sector, XcpIoReq *req) {
+  if (test_bit(extent->validBits, sector))
+    return false;
+
+  const size_t sectorSize = combiner->sectorSize;
+  const uint64_t offset = extent->index * combiner->extentSize + sector * sectorSize;
+  char *data = extent->data + sector * sectorSize;
+
+  // After the end of the file, there is nothing to read.
+  memset(data, 0, sectorSize);
+  if (offset >= combiner->pImpl.fileSize) {
+    set_bits(extent->validBits, sector, sector + 1, true);
+    return false;
+  }
+
+  set_busy(combiner, extent, ExtentStateFilling);
+  ++extent->pendingCount;
+  ++combiner->counters.readModifyWrites;
+
+  xcp_io_req_prep_rw(req, XcpIoOpcodeRead, combiner->fd, data, sectorSize, (off_t)offset);
+  xcp_io_req_set_cb(req, fill_completion_cb);
+  xcp_io_req_set_user_data(req, extent);
+  xcp_io_queue_insert_or_complete(combiner->queue, req);
+  return true;
+}
+
+static inline bool overlaps_direct_write (const XcpIoWriteCombiner *combiner, uint64_t offset, uint64_t end) {
+  const XcpIoWriteCombinerWrite *write;
+  TAILQ_FOREACH(write, &combiner->pImpl.directWrites, next) {
+    if (write->offset < end && offset < write->end)
+      return true;
+  }
+  return false;
+}
+
+static void copy_to_extents (
+  XcpIoWriteCombiner *combiner, XcpIoWriteCombinerExtent *const *extents, const XcpIoReq *req
+) {
+  const struct iovec *iov = &req->iov;
+  size_t iovCount = 1;
+  if (req->opcode == XcpIoOpcodeWriteV) {
+    iov = (const struct iovec *)req->iov.iov_base;
+    iovCount = req->iov.iov_len;
+  }
+
+  const size_t extentSize = combiner->extentSize;
+  const uint64_t firstIndex = (uint64_t)req->offset / extentSize;
+  uint64_t offset = (uint64_t)req->offset;
+  for (size_t i = 0; i < iovCount; ++i) {
+    const char *src = iov[i].iov_base;
+    size_t size = iov[i].iov_len;
+    while (size) {
+      XcpIoWriteCombinerExtent *extent = extents[offset / extentSize - firstIndex];
+      const size_t pos = (size_t)(offset % extentSize);
+      const size_t chunk = size < extentSize - pos ? size : extentSize - pos;
+      memcpy(extent->data + pos, src, chunk);
+      src += chunk;
+      offset += chunk;
+      size -= chunk;
+    }
+  }
+}
+
+// Copy a write smaller than an extent in the one or two extents of its range.
+// Returns false if the write must wait.
+static bool stage_write (XcpIoWriteCombiner *combiner, XcpIoReq *req, size_t size) {
+  const size_t extentSize = combiner->extentSize;
+  const size_t sectorSize = combiner->sectorSize;
+  const uint64_t offset = (uint64_t)req->offset;
+  const uint64_t end = offset + size;
+
+  // The staged data must not be written before the overlapping writes of the queue. The partial sectors
+  // are read and flushed entirely: the range is rounded to the sectors on both sides.
+  const uint64_t sectorMask = (uint64_t)(sectorSize - 1);
+  if (overlaps_direct_write(combiner, offset & ~sectorMask, (end + sectorMask) & ~sectorMask))
+    return false;
+
+  const uint64_t firstIndex = offset / extentSize;
+  const size_t count = (size_t)((end - 1) / extentSize - firstIndex + 1);
+  XcpIoWriteCombinerExtent *extents[2] = { NULL, NULL };
+  size_t missingCount = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (!(extents[i] = find_extent(combiner, firstIndex + i)))
+      ++missingCount;
+    else if (extents[i]->state != ExtentStateIdle)
+      return false;
+  }
+
+  if (missingCount > combiner->pImpl.extentCount - combiner->pImpl.usedCount) {
+    flush_oldest(combiner);
+    return false;
+  }
+
+  // A failed read of a partial sector fails the write waiting for it.
+  int err = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (!extents[i])
+      extents[i] = alloc_extent(combiner, firstIndex + i);
+    else if (extents[i]->fillWaiter == req) {
+      if (!err)
+        err = extents[i]->fillError;
+      extents[i]->fillWaiter = NULL;
+      extents[i]->fillError = 0;
+    }
+  }
+
+  if (err) {
+    for (size_t i = 0; i < count; ++i) {
+      if (!extents[i]->dirty)
+        release_extent(combiner, extents[i]);
+    }
+    complete_req(req, err);
+    return true;
+  }
+
+  size_t firstSectors[2];
+  size_t endSectors[2];
+  bool filling = false;
+  for (size_t i = 0; i < count; ++i) {
+    XcpIoWriteCombinerExtent *extent = extents[i];
+    const uint64_t base = extent->index * extentSize;
+    const size_t from = (size_t)((offset > base ? offset : base) - base);
+    const size_t to = (size_t)((end < base + extentSize ? end : base + extentSize) - base);
+    firstSectors[i] = from / sectorSize;
+    endSectors[i] = (to + sectorSize - 1) / sectorSize;
+
+    bool extentFilling = false;
+    if (from % sectorSize)
+      extentFilling = fill_sector(combiner, extent, firstSectors[i], &extent->fillReqs[0]);
+    if (to % sectorSize && (endSectors[i] - 1 != firstSectors[i] || !(from % sectorSize)))
+      extentFilling |= fill_sector(combiner, extent, endSectors[i] - 1, &extent->fillReqs[1]);
+
+    if (extentFilling) {
+      extent->fillWaiter = req;
+      filling = true;
+    }
+  }
+  if (filling)
+    return false;
+
+  copy_to_extents(combiner, extents, req);
+  if (combiner->pImpl.fileSize < end)
+    combiner->pImpl.fileSize = end;
+
+  const size_t sectorCount = get_sector_count(combiner);
+  size_t fullCount = 0;
+  for (size_t i = 0; i < count; ++i) {
+    XcpIoWriteCombinerExtent *extent = extents[i];
+    set_bits(extent->validBits, firstSectors[i], endSectors[i], true);
+    set_bits(extent->dirtyBits, firstSectors[i], endSectors[i], true);
+    if (!extent->dirty) {
+      extent->dirty = true;
+      extent->dirtyTime = get_monotonic_time();
+      TAILQ_INSERT_TAIL(&combiner->pImpl.dirtyExtents, extent, next);
+    }
+
+    // Flush on size: the extent can be written with one aligned write.
+    if (find_bit(extent->dirtyBits, 0, sectorCount, false) == sectorCount)
+      combiner->pImpl.batch[fullCount++] = extent;
+  }
+  if (fullCount)
+    flush_extents(combiner, combiner->pImpl.batch, fullCount);
+
+  ++combiner->counters.stagedWrites;
+  complete_req(req, 0);
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+
+static void direct_write_completion_cb (XcpIoReq *req, int err, void *userArg) {
+  XcpIoWriteCombinerWrite *write = userArg;
+  XcpIoWriteCombiner *combiner = write->combiner;
+  req->cb = write->cb;
+  req->userData = write->userData;
+  TAILQ_REMOVE(&combiner->pImpl.directWrites, write, next);
+  free(write);
+
+  if (XCP_LIKELY(req->cb))
+    req->cb(req, err, req->userData);
+  process_blocked(combiner);
+}
+
+// Returns the range modified by a request of fd, the end is 0 if it doesn't write.
+static void get_write_range (const XcpIoWriteCombiner *combiner, const XcpIoReq *req, uint64_t *offset, uint64_t *end) {
+  *offset = *end = 0;
+  if (
+    req->fd != combiner->fd || (req->flags & XcpIoReqFlagFixedFile) ||
+    !(req->opcode & (STAGED_OPCODES | XcpIoOpcodeSplice | XcpIoOpcodeFallocate))
+  )
+    return;
+
+  const uint64_t size = xcp_io_req_get_size(req);
+  if (req->offset < 0) {
+    *end = UINT64_MAX;
+    return;
+  }
+
+  *offset = (uint64_t)req->offset;
+  *end = *offset + size;
+}
+
+// Give a chain to the queue, its writes are tracked until their completion.
+static void insert_chain (XcpIoWriteCombiner *combiner, XcpIoReq *req) {
+  for (XcpIoReq *it = req; it; it = it->pImpl.link) {
+    uint64_t offset, end;
+    get_write_range(combiner, it, &offset, &end);
+    if (offset == end)
+      continue;
+
+    if (
+      combiner->pImpl.fileSize < end && end != UINT64_MAX &&
+      !(it->opcode == XcpIoOpcodeFallocate && (it->opFlags & FALLOC_FL_KEEP_SIZE))
+    )
+      combiner->pImpl.fileSize = end;
+    ++combiner->counters.directWrites;
+
+    // Without memory, the write is not tracked: the next staged writes can be flushed before it.
+    XcpIoWriteCombinerWrite *write = malloc(sizeof *write);
+    if (write) {
+      write->combiner = combiner;
+      write->cb = it->cb;
+      write->userData = it->userData;
+      write->offset = offset;
+      write->end = end;
+      TAILQ_INSERT_TAIL(&combiner->pImpl.directWrites, write, next);
+      it->cb = direct_write_completion_cb;
+      it->userData = write;
+    }
+  }
+
+  xcp_io_queue_insert_or_complete(combiner->queue, req);
+}
+
+// Returns false if the request must wait.
+static bool process_req (XcpIoWriteCombiner *combiner, XcpIoReq *req) {
+  // Chains and barriers are ordered with all the staged data.
+  if (req->pImpl.link || (req->flags & XcpIoReqFlagBarrier)) {
+    if (!settle_range(combiner, 0, UINT64_MAX))
+      return false;
+    insert_chain(combiner, req);
+    return true;
+  }
+
+  switch (req->opcode) {
+    case XcpIoOpcodeWrite:
+    case XcpIoOpcodeWriteV:
+    case XcpIoOpcodeWriteFixed:
+    case XcpIoOpcodeSplice:
+    case XcpIoOpcodeFallocate: {
+      uint64_t offset, end;
+      get_write_range(combiner, req, &offset, &end);
+      if (offset == end)
+        break;
+
+      if ((req->opcode & STAGED_OPCODES) && end != UINT64_MAX) {
+        if (end - offset < combiner->extentSize)
+          return stage_write(combiner, req, (size_t)(end - offset));
+
+        if (combiner->directIo && ((offset | end) & (combiner->sectorSize - 1))) {
+          complete_req(req, -EINVAL);
+          return true;
+        }
+      }
+
+      if (!settle_range(combiner, offset, end))
+        return false;
+      insert_chain(combiner, req);
+      return true;
+    }
+
+    case XcpIoOpcodeRead:
+    case XcpIoOpcodeReadV:
+    case XcpIoOpcodeReadFixed: {
+      const uint64_t size = xcp_io_req_get_size(req);
+      const uint64_t offset = req->offset < 0 ? 0 : (uint64_t)req->offset;
+      const uint64_t end = req->offset < 0 ? UINT64_MAX : offset + size;
+      if (size && !settle_range(combiner, offset, end))
+        return false;
+      break;
+    }
+
+    case XcpIoOpcodeFsync:
+    case XcpIoOpcodeFdatasync:
+    case XcpIoOpcodeSyncFileRange:
+      if (!settle_range(combiner, 0, UINT64_MAX))
+        return false;
+
+      if (req->opcode != XcpIoOpcodeSyncFileRange && combiner->pImpl.flushError) {
+        const int err = combiner->pImpl.flushError;
+        combiner->pImpl.flushError = 0;
+        complete_req(req, err);
+        return true;
+      }
+      break;
+
+    case XcpIoOpcodePoll:
+      break;
+  }
+
+  xcp_io_queue_insert_or_complete(combiner->queue, req);
+  return true;
+}
+
+static void process_blocked (XcpIoWriteCombiner *combiner) {
+  if (combiner->pImpl.replaying)
+    return;
+
+  combiner->pImpl.replaying = true;
+  XcpIoReq *req;
+  while ((req = STAILQ_FIRST(&combiner->pImpl.blocked))) {
+    STAILQ_REMOVE_HEAD(&combiner->pImpl.blocked, pImpl.next);
+    if (!process_req(combiner, req)) {
+      STAILQ_INSERT_HEAD(&combiner->pImpl.blocked, req, pImpl.next);
+      break;
+    }
+  }
+  combiner->pImpl.replaying = false;
+}
+
+// -----------------------------------------------------------------------------
+
+int xcp_io_write_combiner_init (
+  XcpIoWriteCombiner *combiner, XcpIoQueue *queue, int fd, const XcpIoWriteCombinerOptions *options
+) {
+  const size_t extentSize = options->extentSize;
+  const size_t extentCount = options->extentCount;
+  const size_t sectorSize = options->sectorSize;
+  if (
+    sectorSize < MIN_SECTOR_SIZE || sectorSize > XCP_IO_REQ_POOL_DATA_ALIGNMENT || (sectorSize & (sectorSize - 1)) ||
+    !extentSize || extentSize % XCP_IO_REQ_POOL_DATA_ALIGNMENT || extentSize > INT_MAX ||
+    extentCount < 2 || extentCount > SIZE_MAX / extentSize ||
+    !options->maxFlushSize || options->maxFlushSize > INT_MAX
+  )
+    return -EINVAL;
+
+  const int flags = fcntl(fd, F_GETFL);
+  if (flags < 0)
+    return -errno;
+
+  uint64_t fileSize;
+  int ret = get_file_size(fd, &fileSize);
+  if (ret < 0)
+    return ret;
+
+  memset(combiner, 0, sizeof *combiner);
+  combiner->queue = queue;
+  combiner->fd = fd;
+  combiner->extentSize = extentSize;
+  combiner->sectorSize = sectorSize;
+  combiner->maxFlushSize = options->maxFlushSize;
+  combiner->maxAge = options->maxAge;
+  combiner->directIo = flags & O_DIRECT;
+
+  combiner->pImpl.extentCount = extentCount;
+  combiner->pImpl.fileSize = fileSize;
+  TAILQ_INIT(&combiner->pImpl.freeExtents);
+  TAILQ_INIT(&combiner->pImpl.dirtyExtents);
+  STAILQ_INIT(&combiner->pImpl.blocked);
+  TAILQ_INIT(&combiner->pImpl.directWrites);
+
+  size_t bucketCount = 1;
+  while (bucketCount < 2 * extentCount)
+    bucketCount <<= 1;
+  combiner->pImpl.bucketMask = bucketCount - 1;
+
+  const size_t wordCount = (extentSize / sectorSize + 63) / 64;
+  if (
+    !(combiner->pImpl.extents = calloc(extentCount, sizeof *combiner->pImpl.extents)) ||
+    !(combiner->pImpl.arena = aligned_alloc(XCP_IO_REQ_POOL_DATA_ALIGNMENT, extentCount * extentSize)) ||
+    !(combiner->pImpl.bitmaps = calloc(2 * extentCount * wordCount, sizeof *combiner->pImpl.bitmaps)) ||
+    !(combiner->pImpl.buckets = calloc(bucketCount, sizeof *combiner->pImpl.buckets)) ||
+    !(combiner->pImpl.batch = malloc(extentCount * sizeof *combiner->pImpl.batch)) ||
+    !(combiner->pImpl.iovs = malloc(MAX_FLUSH_IOV_COUNT * sizeof *combiner->pImpl.iovs))
+  ) {
+    xcp_io_write_combiner_uninit(combiner);
+    return -ENOMEM;
+  }
+
+  for (size_t i = 0; i < extentCount; ++i) {
+    XcpIoWriteCombinerExtent *extent = &combiner->pImpl.extents[i];
+    extent->combiner = combiner;
+    extent->data = combiner->pImpl.arena + i * extentSize;
+    extent->validBits = combiner->pImpl.bitmaps + 2 * i * wordCount;
+    extent->dirtyBits = extent->validBits + wordCount;
+    TAILQ_INSERT_TAIL(&combiner->pImpl.freeExtents, extent, next);
+  }
+
+  return 0;
+}
+
+void xcp_io_write_combiner_uninit (XcpIoWriteCombiner *combiner) {
+  assert(xcp_io_write_combiner_is_empty(combiner));
+
+  free(combiner->pImpl.iovs);
+  free(combiner->pImpl.batch);
+  free(combiner->pImpl.buckets);
+  free(combiner->pImpl.bitmaps);
+  free(combiner->pImpl.arena);
+  free(combiner->pImpl.extents);
+}
+
+void xcp_io_write_combiner_insert (XcpIoWriteCombiner *combiner, XcpIoReq *req) {
+  if (req->fd != combiner->fd || (req->flags & XcpIoReqFlagFixedFile)) {
+    xcp_io_queue_insert_or_complete(combiner->queue, req);
+    return;
+  }
+
+  if (!STAILQ_EMPTY(&combiner->pImpl.blocked) || !process_req(combiner, req)) {
+    STAILQ_INSERT_TAIL(&combiner->pImpl.blocked, req, pImpl.next);
+    ++combiner->counters.blockedRequests;
+  }
+
+  xcp_io_write_combiner_flush_expired(combiner);
+}
+
+void xcp_io_write_combiner_flush (XcpIoWriteCombiner *combiner) {
+  size_t count = 0;
+  XcpIoWriteCombinerExtent *extent;
+  TAILQ_FOREACH(extent, &combiner->pImpl.dirtyExtents, next)
+    combiner->pImpl.batch[count++] = extent;
+
+  if (count)
+    flush_extents(combiner, combiner->pImpl.batch, count);
+}
+
+uint64_t xcp_io_write_combiner_flush_expired (XcpIoWriteCombiner *combiner) {
+  if (!combiner->maxAge || TAILQ_EMPTY(&combiner->pImpl.dirtyExtents))
+    return UINT64_MAX;
+
+  // The extents dirty again after a failed flush keep their time: the list is not sorted.
+  const uint64_t now = get_monotonic_time();
+  const uint64_t maxAge = combiner->maxAge * NSEC_PER_USEC;
+  uint64_t nextTime = UINT64_MAX;
+  size_t count = 0;
+  XcpIoWriteCombinerExtent *extent;
+  TAILQ_FOREACH(extent, &combiner->pImpl.dirtyExtents, next) {
+    const uint64_t expirationTime = extent->dirtyTime + maxAge;
+    if (expirationTime <= now)
+      combiner->pImpl.batch[count++] = extent;
+    else if (expirationTime < nextTime)
+      nextTime = expirationTime;
+  }
+
+  if (count)
+    flush_extents(combiner, combiner->pImpl.batch, count);
+
+  return nextTime == UINT64_MAX ? UINT64_MAX : (nextTime - now + NSEC_PER_USEC - 1) / NSEC_PER_USEC;
+}
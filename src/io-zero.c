@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+  #include <immintrin.h>
+#elif defined(__aarch64__)
+  #include <arm_neon.h>
+#endif
+
+#include "xcp-ng/async-io/io-zero.h"
+
+// =============================================================================
+
+// Number of bytes checked before the vectorized loop: most non-zero blocks are detected here.
+#define ZERO_PREFIX_SIZE 16
+
+typedef bool (*IsZeroBufferFn)(const unsigned char *buf, size_t size);
+
+static bool is_zero_buffer_generic (const unsigned char *buf, size_t size) {
+  uint64_t acc = 0;
+  for (; size >= 4 * sizeof(uint64_t); size -= 4 * sizeof(uint64_t), buf += 4 * sizeof(uint64_t)) {
+    uint64_t values[4];
+    memcpy(values, buf, sizeof values);
+    if (values[0] | values[1] | values[2] | values[3])
+      return false;
+  }
+
+  while (size--)
+    acc |= *buf++;
+  return !acc;
+}
+
+#if defined(__x86_64__)
+  __attribute__((__target__("avx2")))
+  static bool is_zero_buffer_avx2 (const unsigned char *buf, size_t size) {
+    for (; size >= 4 * sizeof(__m256i); size -= 4 * sizeof(__m256i), buf += 4 * sizeof(__m256i)) {
+      const __m256i acc = _mm256_or_si256(
+        _mm256_or_si256(_mm256_loadu_si256((const __m256i *)buf), _mm256_loadu_si256((const __m256i *)buf + 1)),
+        _mm256_or_si256(_mm256_loadu_si256((const __m256i *)buf + 2), _mm256_loadu_si256((const __m256i *)buf + 3))
+      );
+      if (!_mm256_testz_si256(acc, acc))
+        return false;
+    }
+    return is_zero_buffer_generic(buf, size);
+  }
+
+  // SSE2 is always available on x86-64.
+  static bool is_zero_buffer_sse2 (const unsigned char *buf, size_t size) {
+    const __m128i zero = _mm_setzero_si128();
+    for (; size >= 4 * sizeof(__m128i); size -= 4 * sizeof(__m128i), buf += 4 * sizeof(__m128i)) {
+      const __m128i acc = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)buf), _mm_loadu_si128((const __m128i *)buf + 1)),
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)buf + 2), _mm_loadu_si128((const __m128i *)buf + 3))
+      );
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+        return false;
+    }
+    return is_zero_buffer_generic(buf, size);
+  }
+#elif defined(__aarch64__)
+  static bool is_zero_buffer_neon (const unsigned char *buf, size_t size) {
+    for (; size >= 4 * sizeof(uint8x16_t); size -= 4 * sizeof(uint8x16_t), buf += 4 * sizeof(uint8x16_t)) {
+      const uint8x16_t acc = vorrq_u8(
+        vorrq_u8(vld1q_u8(buf), vld1q_u8(buf + 16)),
+        vorrq_u8(vld1q_u8(buf + 32), vld1q_u8(buf + 48))
+      );
+      if (vmaxvq_u8(acc))
+        return false;
+    }
+    return is_zero_buffer_generic(buf, size);
+  }
+#endif
+
+static IsZeroBufferFn resolve_is_zero_buffer (void) {
+  #if defined(__x86_64__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? is_zero_buffer_avx2 : is_zero_buffer_sse2;
+  #elif defined(__aarch64__)
+    return is_zero_buffer_neon;
+  #else
+    return is_zero_buffer_generic;
+  #endif
+}
+
+// -----------------------------------------------------------------------------
+
+bool xcp_io_is_zero_buffer (const void *buf, size_t size) {
+  // Concurrent first calls store the same value.
+  static IsZeroBufferFn isZeroBuffer;
+  IsZeroBufferFn fn = __atomic_load_n(&isZeroBuffer, __ATOMIC_RELAXED);
+  if (XCP_UNLIKELY(!fn)) {
+    fn = resolve_is_zero_buffer();
+    __atomic_store_n(&isZeroBuffer, fn, __ATOMIC_RELAXED);
+  }
+
+  const unsigned char *bytes = buf;
+  const size_t prefixSize = size < ZERO_PREFIX_SIZE ? size : ZERO_PREFIX_SIZE;
+  if (!is_zero_buffer_generic(bytes, prefixSize))
+    return false;
+  return fn(bytes + prefixSize, size - prefixSize);
+}